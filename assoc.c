@@ -12,6 +12,7 @@
  */
 
 #include "memcached.h"
+#include "assoc_bucket.h"
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/resource.h>
@@ -34,51 +35,139 @@ unsigned int hashpower = HASHPOWER_DEFAULT;
 #define hashsize(n) ((uint64_t)1<<(n))
 #define hashmask(n) (hashsize(n)-1)
 
-/* Main hash table. This is where we look except during expansion. */
-static item** primary_hashtable = 0;
-
 /*
- * Previous hash table. During expansion, we look here for keys that haven't
- * been moved over to the primary yet.
+ * The hash tables. The maintenance thread swaps them as expansion starts and
+ * ends while the workers keep going, so they are only read as a whole with
+ * assoc_table_get(), and only written by the maintenance thread with
+ * assoc_table_set().
  */
-static item** old_hashtable = 0;
+struct assoc_table {
+    unsigned int hashpower;
+    /* Flag: Are we in the middle of expanding now? */
+    bool expanding;
+    /* Main hash table. This is where we look except during expansion. */
+    item **primary_hashtable;
+    /*
+     * Previous hash table. During expansion, we look here for keys that
+     * haven't been moved over to the primary yet.
+     */
+    item **old_hashtable;
+    /* Same as the above with -o hash_layout=buckets */
+    struct assoc_bucket *primary_buckets;
+    struct assoc_bucket *old_buckets;
+};
+
+static struct assoc_table table;
 
-/* Flag: Are we in the middle of expanding now? */
-static bool expanding = false;
+/* Odd while the maintenance thread is writing the table */
+static unsigned int table_seq = 0;
+
+/* Bytes taken by a bucket of the table */
+static size_t hash_bucket_size(void) {
+    return settings.hash_layout == HASH_LAYOUT_BUCKETS ?
+        sizeof(struct assoc_bucket) : sizeof(void *);
+}
 
 /*
  * During expansion we migrate values with bucket granularity; this is how
  * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
+ * Only moves past a bucket with the item lock of that bucket held.
  */
 static uint64_t expand_bucket = 0;
 
+static void assoc_table_get(struct assoc_table *t) {
+    unsigned int seq;
+
+    do {
+        seq = __atomic_load_n(&table_seq, __ATOMIC_ACQUIRE);
+        t->hashpower = __atomic_load_n(&table.hashpower, __ATOMIC_RELAXED);
+        t->expanding = __atomic_load_n(&table.expanding, __ATOMIC_RELAXED);
+        t->primary_hashtable = __atomic_load_n(&table.primary_hashtable, __ATOMIC_RELAXED);
+        t->old_hashtable = __atomic_load_n(&table.old_hashtable, __ATOMIC_RELAXED);
+        t->primary_buckets = __atomic_load_n(&table.primary_buckets, __ATOMIC_RELAXED);
+        t->old_buckets = __atomic_load_n(&table.old_buckets, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&table_seq, __ATOMIC_RELAXED));
+}
+
+static void assoc_table_set(const struct assoc_table *t) {
+    __atomic_store_n(&table_seq, table_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&table.hashpower, t->hashpower, __ATOMIC_RELAXED);
+    __atomic_store_n(&table.expanding, t->expanding, __ATOMIC_RELAXED);
+    __atomic_store_n(&table.primary_hashtable, t->primary_hashtable, __ATOMIC_RELAXED);
+    __atomic_store_n(&table.old_hashtable, t->old_hashtable, __ATOMIC_RELAXED);
+    __atomic_store_n(&table.primary_buckets, t->primary_buckets, __ATOMIC_RELAXED);
+    __atomic_store_n(&table.old_buckets, t->old_buckets, __ATOMIC_RELAXED);
+    __atomic_store_n(&hashpower, t->hashpower, __ATOMIC_RELAXED);
+    __atomic_store_n(&table_seq, table_seq + 1, __ATOMIC_RELEASE);
+}
+
 void assoc_init(const int hashtable_init) {
     if (hashtable_init) {
         hashpower = hashtable_init;
     }
-    primary_hashtable = calloc(hashsize(hashpower), sizeof(void *));
-    if (! primary_hashtable) {
+    table.hashpower = hashpower;
+    if (settings.hash_layout == HASH_LAYOUT_BUCKETS) {
+        assoc_bucket_init();
+        table.primary_buckets = assoc_buckets_new(hashsize(hashpower));
+    } else {
+        table.primary_hashtable = calloc(hashsize(hashpower), sizeof(void *));
+    }
+    if (! table.primary_hashtable && ! table.primary_buckets) {
         fprintf(stderr, "Failed to init hashtable.\n");
         exit(EXIT_FAILURE);
     }
     STATS_LOCK();
     stats_state.hash_power_level = hashpower;
-    stats_state.hash_bytes = hashsize(hashpower) * sizeof(void *);
+    stats_state.hash_bytes = hashsize(hashpower) * hash_bucket_size();
     STATS_UNLOCK();
 }
 
+/* Bucket of the old table a hash value is in if it hasn't been moved yet.
+ * A table got with the item lock of the hash value held stays good for it
+ * until the lock is released: any table swapped in meanwhile still has its
+ * items where this one says. */
+static inline bool _in_old_table(const struct assoc_table *t, const uint32_t hv,
+                                 uint64_t *oldbucket) {
+    return t->expanding &&
+        (*oldbucket = (hv & hashmask(t->hashpower - 1))) >=
+            __atomic_load_n(&expand_bucket, __ATOMIC_RELAXED);
+}
+
+/* Bucket of the buckets layout a hash value belongs to */
+static struct assoc_bucket *_hash_bucket(const uint32_t hv) {
+    struct assoc_table t;
+    uint64_t oldbucket;
+
+    assoc_table_get(&t);
+    if (_in_old_table(&t, hv, &oldbucket))
+        return &t.old_buckets[oldbucket];
+    return &t.primary_buckets[hv & hashmask(t.hashpower)];
+}
+
+/* Head of the chain a hash value belongs to */
+static item **_hashitem_head(const uint32_t hv) {
+    struct assoc_table t;
+    uint64_t oldbucket;
+
+    assoc_table_get(&t);
+    if (_in_old_table(&t, hv, &oldbucket))
+        return &t.old_hashtable[oldbucket];
+    return &t.primary_hashtable[hv & hashmask(t.hashpower)];
+}
+
 item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
     item *it;
-    uint64_t oldbucket;
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        it = old_hashtable[oldbucket];
-    } else {
-        it = primary_hashtable[hv & hashmask(hashpower)];
+    if (settings.hash_layout == HASH_LAYOUT_BUCKETS) {
+        it = assoc_bucket_find(_hash_bucket(hv), key, nkey, assoc_bucket_tag(hv));
+        MEMCACHED_ASSOC_FIND(key, nkey, 0);
+        return it;
     }
 
+    it = *_hashitem_head(hv);
+
     item *ret = NULL;
     int depth = 0;
     while (it) {
@@ -97,16 +186,7 @@ item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
    the item wasn't found */
 
 static item** _hashitem_before (const char *key, const size_t nkey, const uint32_t hv) {
-    item **pos;
-    uint64_t oldbucket;
-
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        pos = &old_hashtable[oldbucket];
-    } else {
-        pos = &primary_hashtable[hv & hashmask(hashpower)];
-    }
+    item **pos = _hashitem_head(hv);
 
     while (*pos && ((nkey != (*pos)->nkey) || memcmp(key, ITEM_key(*pos), nkey))) {
         pos = &(*pos)->h_next;
@@ -114,26 +194,38 @@ static item** _hashitem_before (const char *key, const size_t nkey, const uint32
     return pos;
 }
 
-/* grows the hashtable to the next power of 2. */
+/* grows the hashtable to the next power of 2. Workers aren't stopped for it:
+ * the ones looking at the table from before find the items where they were,
+ * in what is now the old table, until they get moved under their item lock. */
 static void assoc_expand(void) {
-    old_hashtable = primary_hashtable;
-
-    primary_hashtable = calloc(hashsize(hashpower + 1), sizeof(void *));
-    if (primary_hashtable) {
-        if (settings.verbose > 1)
-            fprintf(stderr, "Hash table expansion starting\n");
-        hashpower++;
-        expanding = true;
-        expand_bucket = 0;
-        STATS_LOCK();
-        stats_state.hash_power_level = hashpower;
-        stats_state.hash_bytes += hashsize(hashpower) * sizeof(void *);
-        stats_state.hash_is_expanding = true;
-        STATS_UNLOCK();
+    struct assoc_table t = table;
+
+    if (settings.hash_layout == HASH_LAYOUT_BUCKETS) {
+        t.old_buckets = t.primary_buckets;
+        t.primary_buckets = assoc_buckets_new(hashsize(t.hashpower + 1));
+        if (t.primary_buckets == NULL) {
+            /* Bad news, but we can keep running. */
+            return;
+        }
     } else {
-        primary_hashtable = old_hashtable;
-        /* Bad news, but we can keep running. */
+        t.old_hashtable = t.primary_hashtable;
+        t.primary_hashtable = calloc(hashsize(t.hashpower + 1), sizeof(void *));
+        if (t.primary_hashtable == NULL) {
+            return;
+        }
     }
+
+    if (settings.verbose > 1)
+        fprintf(stderr, "Hash table expansion starting\n");
+    t.hashpower++;
+    t.expanding = true;
+    __atomic_store_n(&expand_bucket, 0, __ATOMIC_RELAXED);
+    assoc_table_set(&t);
+    STATS_LOCK();
+    stats_state.hash_power_level = t.hashpower;
+    stats_state.hash_bytes += hashsize(t.hashpower) * hash_bucket_size();
+    stats_state.hash_is_expanding = true;
+    STATS_UNLOCK();
 }
 
 void assoc_start_expand(uint64_t curr_items) {
@@ -145,27 +237,88 @@ void assoc_start_expand(uint64_t curr_items) {
     }
 }
 
-/* Note: this isn't an assoc_update.  The key must not already exist to call this */
-int assoc_insert(item *it, const uint32_t hv) {
+/* Buckets of the old table moved so far and to move in all, for stats */
+void assoc_expand_progress(uint64_t *moved, uint64_t *total) {
+    struct assoc_table t;
+
+    assoc_table_get(&t);
+    if (t.expanding) {
+        *moved = __atomic_load_n(&expand_bucket, __ATOMIC_RELAXED);
+        *total = hashsize(t.hashpower - 1);
+    } else {
+        *moved = 0;
+        *total = 0;
+    }
+}
+
+/* assoc_find() for readers not holding the item lock, see item_get(). Every
+ * pointer is validated against the item lock sequence before being followed,
+ * so that a chain changed under us is noticed before we wander off it. *valid
+ * is false if that happened, and the result is to be thrown away.
+ * Only for the chained layout: overflow buckets get freed as items go.
+ * The caller must have its thread's optimistic_seq odd for the old table not
+ * to be freed under it, see item_optimistic_sync(). */
+item *assoc_find_optimistic(const char *key, const size_t nkey, const uint32_t hv,
+                            const unsigned int seq, bool *valid) {
+    struct assoc_table t;
     uint64_t oldbucket;
+    item *it;
+
+    assoc_table_get(&t);
+    if (_in_old_table(&t, hv, &oldbucket)) {
+        it = __atomic_load_n(&t.old_hashtable[oldbucket], __ATOMIC_RELAXED);
+    } else {
+        it = __atomic_load_n(&t.primary_hashtable[hv & hashmask(t.hashpower)],
+                             __ATOMIC_RELAXED);
+    }
 
+    while (it) {
+        if (!item_lock_seq_valid(hv, seq)) {
+            *valid = false;
+            return NULL;
+        }
+        if ((nkey == it->nkey) && (memcmp(key, ITEM_key(it), nkey) == 0))
+            break;
+        it = __atomic_load_n(&it->h_next, __ATOMIC_RELAXED);
+    }
+
+    *valid = item_lock_seq_valid(hv, seq);
+    return it;
+}
+
+/* Note: this isn't an assoc_update.  The key must not already exist to call this */
+int assoc_insert(item *it, const uint32_t hv) {
 //    assert(assoc_find(ITEM_key(it), it->nkey) == 0);  /* shouldn't have duplicately named things defined */
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        it->h_next = old_hashtable[oldbucket];
-        old_hashtable[oldbucket] = it;
-    } else {
-        it->h_next = primary_hashtable[hv & hashmask(hashpower)];
-        primary_hashtable[hv & hashmask(hashpower)] = it;
+    if (settings.hash_layout == HASH_LAYOUT_BUCKETS) {
+        it->h_next = 0;
+        if (!assoc_bucket_insert(_hash_bucket(hv), it, assoc_bucket_tag(hv))) {
+            /* The item is left out of the hash table until it goes away */
+            STATS_LOCK();
+            stats.malloc_fails++;
+            STATS_UNLOCK();
+            return 0;
+        }
+        MEMCACHED_ASSOC_INSERT(ITEM_key(it), it->nkey);
+        return 1;
     }
 
+    item **head = _hashitem_head(hv);
+    it->h_next = *head;
+    *head = it;
+
     MEMCACHED_ASSOC_INSERT(ITEM_key(it), it->nkey);
     return 1;
 }
 
 void assoc_delete(const char *key, const size_t nkey, const uint32_t hv) {
+    if (settings.hash_layout == HASH_LAYOUT_BUCKETS) {
+        if (assoc_bucket_delete(_hash_bucket(hv), key, nkey, assoc_bucket_tag(hv))) {
+            MEMCACHED_ASSOC_DELETE(key, nkey);
+        }
+        return;
+    }
+
     item **before = _hashitem_before(key, nkey, hv);
 
     if (*before) {
@@ -187,6 +340,77 @@ void assoc_delete(const char *key, const size_t nkey, const uint32_t hv) {
 
 static volatile int do_run_maintenance_thread = 1;
 
+/* Undo the moves of assoc_move_bucket() up to slot end of bucket last */
+static void assoc_unmove_bucket(struct assoc_bucket *last, int end) {
+    struct assoc_bucket *b;
+    int i;
+    for (b = &table.old_buckets[expand_bucket]; b; b = b->next) {
+        for (i = 0; i < ASSOC_BUCKET_SLOTS; i++) {
+            item *it = b->items[i];
+            if (b == last && i == end)
+                return;
+            if (b->tags[i] == 0)
+                continue;
+            uint32_t hv = hash(ITEM_key(it), it->nkey);
+            assoc_bucket_delete(&table.primary_buckets[hv & hashmask(table.hashpower)],
+                                ITEM_key(it), it->nkey, b->tags[i]);
+        }
+    }
+}
+
+/* Move the items of the old bucket expand_bucket over to the new table.
+ * Returns false if the buckets layout ran out of memory for an overflow
+ * bucket, in which case the items are all left in the old bucket. */
+static bool assoc_move_bucket(void) {
+    if (settings.hash_layout == HASH_LAYOUT_BUCKETS) {
+        struct assoc_bucket *b;
+        int i;
+        for (b = &table.old_buckets[expand_bucket]; b; b = b->next) {
+            for (i = 0; i < ASSOC_BUCKET_SLOTS; i++) {
+                item *it = b->items[i];
+                if (b->tags[i] == 0)
+                    continue;
+                uint32_t hv = hash(ITEM_key(it), it->nkey);
+                if (!assoc_bucket_insert(&table.primary_buckets[hv & hashmask(table.hashpower)],
+                                         it, b->tags[i])) {
+                    STATS_LOCK();
+                    stats.malloc_fails++;
+                    STATS_UNLOCK();
+                    assoc_unmove_bucket(b, i);
+                    return false;
+                }
+            }
+        }
+        assoc_bucket_clear(&table.old_buckets[expand_bucket]);
+    } else {
+        item *it, *next;
+        uint64_t bucket;
+        for (it = table.old_hashtable[expand_bucket]; NULL != it; it = next) {
+            next = it->h_next;
+            bucket = hash(ITEM_key(it), it->nkey) & hashmask(table.hashpower);
+            it->h_next = table.primary_hashtable[bucket];
+            table.primary_hashtable[bucket] = it;
+        }
+
+        table.old_hashtable[expand_bucket] = NULL;
+    }
+    return true;
+}
+
+/* Waits for everyone who may have got the table before the last
+ * assoc_table_set() to be done with it. Anything holding an item lock is done
+ * once we had every item lock in turn, and optimistic GETs, which don't take
+ * it, are waited for separately. */
+static void assoc_table_sync(void) {
+    uint64_t i;
+
+    for (i = 0; i < hashsize(item_lock_hashpower); i++) {
+        item_lock(i);
+        item_unlock(i);
+    }
+    item_optimistic_sync();
+}
+
 #define DEFAULT_HASH_BULK_MOVE 1
 int hash_bulk_move = DEFAULT_HASH_BULK_MOVE;
 
@@ -197,61 +421,54 @@ static void *assoc_maintenance_thread(void *arg) {
         int ii = 0;
 
         /* There is only one expansion thread, so no need to global lock. */
-        for (ii = 0; ii < hash_bulk_move && expanding; ++ii) {
-            item *it, *next;
-            uint64_t bucket;
-            void *item_lock = NULL;
+        for (ii = 0; ii < hash_bulk_move && table.expanding; ++ii) {
+            uint64_t bucket = expand_bucket;
+            struct assoc_table prev = table;
 
             /* bucket = hv & hashmask(hashpower) =>the bucket of hash table
              * is the lowest N bits of the hv, and the bucket of item_locks is
              *  also the lowest M bits of hv, and N is greater than M.
-             *  So we can process expanding with only one item_lock. cool! */
-            if ((item_lock = item_trylock(expand_bucket))) {
-                    for (it = old_hashtable[expand_bucket]; NULL != it; it = next) {
-                        next = it->h_next;
-                        bucket = hash(ITEM_key(it), it->nkey) & hashmask(hashpower);
-                        it->h_next = primary_hashtable[bucket];
-                        primary_hashtable[bucket] = it;
-                    }
-
-                    old_hashtable[expand_bucket] = NULL;
-
-                    expand_bucket++;
-                    if (expand_bucket == hashsize(hashpower - 1)) {
-                        expanding = false;
-                        free(old_hashtable);
-                        STATS_LOCK();
-                        stats_state.hash_bytes -= hashsize(hashpower - 1) * sizeof(void *);
-                        stats_state.hash_is_expanding = false;
-                        STATS_UNLOCK();
-                        if (settings.verbose > 1)
-                            fprintf(stderr, "Hash table expansion done\n");
-                    }
-
-            } else {
-                usleep(10*1000);
+             *  So we can process expanding with only one item_lock. cool!
+             * Only the workers on that one item lock wait for the move. */
+            item_lock(bucket);
+            if (!assoc_move_bucket()) {
+                /* Try again once some memory may have been freed */
+                item_unlock(bucket);
+                usleep(10000);
+                break;
             }
-
-            if (item_lock) {
-                item_trylock_unlock(item_lock);
-                item_lock = NULL;
+            __atomic_store_n(&expand_bucket, bucket + 1, __ATOMIC_RELAXED);
+            if (bucket + 1 == hashsize(table.hashpower - 1)) {
+                struct assoc_table t = table;
+                t.expanding = false;
+                t.old_hashtable = NULL;
+                t.old_buckets = NULL;
+                assoc_table_set(&t);
+            }
+            item_unlock(bucket);
+
+            if (!table.expanding) {
+                /* Nobody can still be looking at the old table once synced,
+                 * and the next expansion may reset expand_bucket. */
+                assoc_table_sync();
+                free(prev.old_hashtable);
+                free(prev.old_buckets);
+                STATS_LOCK();
+                stats_state.hash_bytes -= hashsize(table.hashpower - 1) * hash_bucket_size();
+                stats_state.hash_is_expanding = false;
+                STATS_UNLOCK();
+                if (settings.verbose > 1)
+                    fprintf(stderr, "Hash table expansion done\n");
             }
         }
 
-        if (!expanding) {
+        if (!table.expanding) {
             /* We are done expanding.. just wait for next invocation */
             pthread_cond_wait(&maintenance_cond, &maintenance_lock);
-            /* assoc_expand() swaps out the hash table entirely, so we need
-             * all threads to not hold any references related to the hash
-             * table while this happens.
-             * This is instead of a more complex, possibly slower algorithm to
-             * allow dynamic hash table expansion without causing significant
-             * wait times.
-             */
+            /* The new table is published while the workers keep going, see
+             * assoc_expand(). */
             if (do_run_maintenance_thread) {
-                pause_threads(PAUSE_ALL_THREADS);
                 assoc_expand();
-                pause_threads(RESUME_ALL_THREADS);
             }
         }
     }
@@ -294,8 +511,36 @@ struct assoc_iterator {
     item *it;
     item *next;
     bool bucket_locked;
+    /* Items of the bucket being walked with the buckets layout, copied
+     * so that the caller may unlink them */
+    item **items;
+    int nitems;
+    int items_size;
+    int pos;
 };
 
+static void _bucket_snapshot(struct assoc_iterator *iter, struct assoc_bucket *b) {
+    int i;
+
+    iter->nitems = 0;
+    iter->pos = 0;
+    for (; b; b = b->next) {
+        for (i = 0; i < ASSOC_BUCKET_SLOTS; i++) {
+            if (b->tags[i] == 0)
+                continue;
+            if (iter->nitems == iter->items_size) {
+                int size = iter->items_size ? iter->items_size * 2 : 16;
+                item **items = realloc(iter->items, size * sizeof(item *));
+                if (items == NULL)
+                    return;
+                iter->items = items;
+                iter->items_size = size;
+            }
+            iter->items[iter->nitems++] = b->items[i];
+        }
+    }
+}
+
 void *assoc_get_iterator(void) {
     struct assoc_iterator *iter = calloc(1, sizeof(struct assoc_iterator));
     if (iter == NULL) {
@@ -311,7 +556,9 @@ bool assoc_iterate(void *iterp, item **it) {
     *it = NULL;
     // - if locked bucket and next, update next and return
     if (iter->bucket_locked) {
-        if (iter->next != NULL) {
+        if (iter->pos < iter->nitems) {
+            *it = iter->items[iter->pos++];
+        } else if (iter->next != NULL) {
             iter->it = iter->next;
             iter->next = iter->it->h_next;
             *it = iter->it;
@@ -332,10 +579,16 @@ bool assoc_iterate(void *iterp, item **it) {
         item_lock(iter->bucket);
         iter->bucket_locked = true;
         // - only check the primary hash table since expand is blocked.
-        iter->it = primary_hashtable[iter->bucket];
+        if (settings.hash_layout == HASH_LAYOUT_BUCKETS) {
+            _bucket_snapshot(iter, &table.primary_buckets[iter->bucket]);
+            iter->it = iter->nitems ? iter->items[iter->pos++] : NULL;
+        } else {
+            iter->it = table.primary_hashtable[iter->bucket];
+            if (iter->it != NULL)
+                iter->next = iter->it->h_next;
+        }
         if (iter->it != NULL) {
-            // - set it, next and return
-            iter->next = iter->it->h_next;
+            // - set it and return
             *it = iter->it;
         } else {
             // - nothing found in this bucket, try next.
@@ -356,5 +609,6 @@ void assoc_iterate_final(void *iterp) {
         item_unlock(iter->bucket);
     }
     mutex_unlock(&maintenance_lock);
+    free(iter->items);
     free(iter);
 }
@@ -1,12 +1,15 @@
 /* associative array */
 void assoc_init(const int hashpower_init);
 item *assoc_find(const char *key, const size_t nkey, const uint32_t hv);
+item *assoc_find_optimistic(const char *key, const size_t nkey, const uint32_t hv,
+                            const unsigned int seq, bool *valid);
 int assoc_insert(item *item, const uint32_t hv);
 void assoc_delete(const char *key, const size_t nkey, const uint32_t hv);
 void do_assoc_move_next_bucket(void);
 int start_assoc_maintenance_thread(void);
 void stop_assoc_maintenance_thread(void);
 void assoc_start_expand(uint64_t curr_items);
+void assoc_expand_progress(uint64_t *moved, uint64_t *total);
 /* walk functions */
 void *assoc_get_iterator(void);
 bool assoc_iterate(void *iterp, item **it);
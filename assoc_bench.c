@@ -0,0 +1,203 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Lookup microbenchmark of the hash table layouts: the default chained one
+ * against the tagged buckets of -o hash_layout=buckets.
+ *
+ * Items are scattered over memory in random order and looked up at random,
+ * so that with enough of them most lookups miss the CPU caches as they would
+ * on a large instance. The table is the smallest one memcached would keep for
+ * that many items, up to 1.5 items per bucket before it grows.
+ *
+ * Buckets are probed with both the scalar tag matching and the one picked for
+ * this CPU.
+ *
+ * Usage: assoc_bench [items] [lookups]
+ */
+#include "memcached.h"
+#include "assoc_bucket.h"
+#include "murmur3_hash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define hashsize(n) ((uint64_t)1<<(n))
+#define hashmask(n) (hashsize(n)-1)
+
+#define KEY_LEN 16
+
+struct lookup {
+    const char *key;
+    uint32_t hv;
+};
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Same walk as assoc_find() */
+static item *chained_find(item **table, unsigned int power, const char *key,
+                          const size_t nkey, const uint32_t hv) {
+    item *it = table[hv & hashmask(power)];
+    while (it) {
+        if ((nkey == it->nkey) && (memcmp(key, ITEM_key(it), nkey) == 0))
+            return it;
+        it = it->h_next;
+    }
+    return NULL;
+}
+
+static double bench_chained(item **table, unsigned int power,
+                            const struct lookup *lookups, uint64_t count,
+                            uint64_t *found) {
+    double start = now_ns();
+    uint64_t i;
+    for (i = 0; i < count; i++) {
+        if (chained_find(table, power, lookups[i].key, KEY_LEN, lookups[i].hv))
+            (*found)++;
+    }
+    return (now_ns() - start) / count;
+}
+
+static double bench_buckets(struct assoc_bucket *table, unsigned int power,
+                            const struct lookup *lookups, uint64_t count,
+                            uint64_t *found) {
+    double start = now_ns();
+    uint64_t i;
+    for (i = 0; i < count; i++) {
+        uint32_t hv = lookups[i].hv;
+        if (assoc_bucket_find(&table[hv & hashmask(power)], lookups[i].key,
+                              KEY_LEN, assoc_bucket_tag(hv)))
+            (*found)++;
+    }
+    return (now_ns() - start) / count;
+}
+
+/* Random lookups of the given keys */
+static struct lookup *make_lookups(const char *keys, uint64_t nkeys, uint64_t count) {
+    struct lookup *lookups = malloc(count * sizeof(struct lookup));
+    uint64_t i;
+    if (lookups == NULL)
+        return NULL;
+    for (i = 0; i < count; i++) {
+        const char *key = keys + (rng_next() % nkeys) * KEY_LEN;
+        lookups[i].key = key;
+        lookups[i].hv = MurmurHash3_x86_32(key, KEY_LEN);
+    }
+    return lookups;
+}
+
+int main(int argc, char **argv) {
+    uint64_t nitems = argc > 1 ? strtoull(argv[1], NULL, 10) : 4000000;
+    uint64_t nlookups = argc > 2 ? strtoull(argv[2], NULL, 10) : 10000000;
+    size_t item_size = (sizeof(item) + KEY_LEN + 15) & ~15;
+    unsigned int power = 1;
+    uint64_t i;
+
+    if (nitems == 0 || nlookups == 0) {
+        fprintf(stderr, "Usage: %s [items] [lookups]\n", argv[0]);
+        return 1;
+    }
+    while (hashsize(power) * 3 / 2 < nitems)
+        power++;
+
+    char *keys = malloc(nitems * KEY_LEN);
+    char *missing = malloc(nitems * KEY_LEN);
+    char *arena = malloc(nitems * item_size);
+    uint64_t *slots = malloc(nitems * sizeof(uint64_t));
+    item **chained = calloc(hashsize(power), sizeof(item *));
+    assoc_bucket_init();
+    assoc_bucket_match_func best_match = assoc_bucket_match;
+    struct assoc_bucket *buckets = assoc_buckets_new(hashsize(power));
+    if (!keys || !missing || !arena || !slots || !chained || !buckets) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    /* Items land in the arena in random order */
+    for (i = 0; i < nitems; i++)
+        slots[i] = i;
+    for (i = nitems - 1; i > 0; i--) {
+        uint64_t j = rng_next() % (i + 1);
+        uint64_t tmp = slots[i];
+        slots[i] = slots[j];
+        slots[j] = tmp;
+    }
+
+    uint64_t overflows = 0;
+    for (i = 0; i < nitems; i++) {
+        char *key = keys + i * KEY_LEN;
+        item *it = (item *)(arena + slots[i] * item_size);
+        char buf[32];
+
+        snprintf(buf, sizeof(buf), "key:%012llu", (unsigned long long)i);
+        memcpy(key, buf, KEY_LEN);
+        snprintf(buf, sizeof(buf), "nah:%012llu", (unsigned long long)i);
+        memcpy(missing + i * KEY_LEN, buf, KEY_LEN);
+
+        memset(it, 0, sizeof(item));
+        it->nkey = KEY_LEN;
+        memcpy(ITEM_key(it), key, KEY_LEN);
+
+        uint32_t hv = MurmurHash3_x86_32(key, KEY_LEN);
+        uint64_t b = hv & hashmask(power);
+        it->h_next = chained[b];
+        chained[b] = it;
+        if (buckets[b].next == NULL && buckets[b].tags[ASSOC_BUCKET_SLOTS - 1] != 0)
+            overflows++;
+        if (!assoc_bucket_insert(&buckets[b], it, assoc_bucket_tag(hv))) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+
+    struct lookup *hits = make_lookups(keys, nitems, nlookups);
+    struct lookup *misses = make_lookups(missing, nitems, nlookups);
+    if (!hits || !misses) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("items %llu, hashpower %u, table bytes chained %llu buckets %llu, "
+           "buckets overflowed %llu\n",
+           (unsigned long long)nitems, power,
+           (unsigned long long)(hashsize(power) * sizeof(item *)),
+           (unsigned long long)(hashsize(power) * sizeof(struct assoc_bucket)),
+           (unsigned long long)overflows);
+
+    uint64_t found = 0;
+    printf("%-10s %12s %12s\n", "layout", "hit ns", "miss ns");
+    double hit = bench_chained(chained, power, hits, nlookups, &found);
+    double miss = bench_chained(chained, power, misses, nlookups, &found);
+    printf("%-10s %12.1f %12.1f\n", "chained", hit, miss);
+    assoc_bucket_match = assoc_bucket_match_sw;
+    hit = bench_buckets(buckets, power, hits, nlookups, &found);
+    miss = bench_buckets(buckets, power, misses, nlookups, &found);
+    printf("%-10s %12.1f %12.1f\n", "scalar", hit, miss);
+    if (best_match != assoc_bucket_match_sw) {
+        assoc_bucket_match = best_match;
+        hit = bench_buckets(buckets, power, hits, nlookups, &found);
+        miss = bench_buckets(buckets, power, misses, nlookups, &found);
+        printf("%-10s %12.1f %12.1f\n", "simd", hit, miss);
+    } else {
+        found += nlookups;
+    }
+
+    if (found != nlookups * 3) {
+        fprintf(stderr, "Lookups found %llu items out of %llu\n",
+                (unsigned long long)found, (unsigned long long)nlookups * 3);
+        return 1;
+    }
+    return 0;
+}
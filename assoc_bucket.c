@@ -0,0 +1,150 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Cache line buckets for the hash table, see assoc_bucket.h
+ */
+#include "memcached.h"
+#include "assoc_bucket.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#endif
+
+#define CACHE_LINE_SIZE 64
+#define SLOTS_MASK ((1U << ASSOC_BUCKET_SLOTS) - 1)
+
+assoc_bucket_match_func assoc_bucket_match = assoc_bucket_match_sw;
+
+unsigned int assoc_bucket_match_sw(const struct assoc_bucket *b, const uint16_t tag) {
+    unsigned int mask = 0;
+    int i;
+    for (i = 0; i < ASSOC_BUCKET_SLOTS; i++) {
+        if (b->tags[i] == tag)
+            mask |= 1U << i;
+    }
+    return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* All the tags of a bucket fit in a single SSE2 register, they are compared
+ * at once and the 16 bit lanes narrowed to one mask bit each. */
+__attribute__((target("sse2")))
+static unsigned int assoc_bucket_match_sse2(const struct assoc_bucket *b,
+                                            const uint16_t tag) {
+    __m128i tags = _mm_load_si128((const __m128i *)b->tags);
+    __m128i eq = _mm_cmpeq_epi16(tags, _mm_set1_epi16((short)tag));
+    return _mm_movemask_epi8(_mm_packs_epi16(eq, _mm_setzero_si128())) & SLOTS_MASK;
+}
+
+/* SSE2 is cpuid leaf 1, edx bit 26. Always there on x86_64. */
+void assoc_bucket_init(void) {
+    uint32_t eax = 1, edx;
+    __asm__("cpuid"
+            : "=d"(edx), "+a"(eax)
+            :
+            : "%ebx", "%ecx");
+    if ((edx >> 26) & 1) {
+        assoc_bucket_match = assoc_bucket_match_sse2;
+    } else {
+        assoc_bucket_match = assoc_bucket_match_sw;
+    }
+}
+#else
+void assoc_bucket_init(void) {
+    assoc_bucket_match = assoc_bucket_match_sw;
+}
+#endif
+
+static struct assoc_bucket *bucket_alloc(const uint64_t count) {
+    void *buckets;
+    if (posix_memalign(&buckets, CACHE_LINE_SIZE,
+                       count * sizeof(struct assoc_bucket)) != 0) {
+        return NULL;
+    }
+    memset(buckets, 0, count * sizeof(struct assoc_bucket));
+    return buckets;
+}
+
+struct assoc_bucket *assoc_buckets_new(const uint64_t count) {
+    return bucket_alloc(count);
+}
+
+void assoc_bucket_clear(struct assoc_bucket *b) {
+    struct assoc_bucket *next = b->next;
+    while (next) {
+        struct assoc_bucket *o = next;
+        next = o->next;
+        free(o);
+    }
+    memset(b, 0, sizeof(*b));
+}
+
+void assoc_buckets_free(struct assoc_bucket *buckets, const uint64_t count) {
+    uint64_t i;
+    for (i = 0; i < count; i++) {
+        if (buckets[i].next)
+            assoc_bucket_clear(&buckets[i]);
+    }
+    free(buckets);
+}
+
+item *assoc_bucket_find(struct assoc_bucket *b, const char *key,
+                        const size_t nkey, const uint16_t tag) {
+    for (; b; b = b->next) {
+        unsigned int mask = assoc_bucket_match(b, tag);
+        while (mask) {
+            item *it = b->items[__builtin_ctz(mask)];
+            if (nkey == it->nkey && memcmp(key, ITEM_key(it), nkey) == 0)
+                return it;
+            mask &= mask - 1;
+        }
+    }
+    return NULL;
+}
+
+int assoc_bucket_insert(struct assoc_bucket *b, item *it, const uint16_t tag) {
+    for (;;) {
+        unsigned int mask = assoc_bucket_match(b, 0);
+        if (mask) {
+            int i = __builtin_ctz(mask);
+            b->items[i] = it;
+            b->tags[i] = tag;
+            return 1;
+        }
+        if (b->next == NULL)
+            break;
+        b = b->next;
+    }
+
+    b->next = bucket_alloc(1);
+    if (b->next == NULL)
+        return 0;
+    b->next->items[0] = it;
+    b->next->tags[0] = tag;
+    return 1;
+}
+
+item *assoc_bucket_delete(struct assoc_bucket *b, const char *key,
+                          const size_t nkey, const uint16_t tag) {
+    struct assoc_bucket *prev = NULL;
+
+    for (; b; prev = b, b = b->next) {
+        unsigned int mask = assoc_bucket_match(b, tag);
+        for (; mask; mask &= mask - 1) {
+            int i = __builtin_ctz(mask);
+            item *it = b->items[i];
+            if (nkey != it->nkey || memcmp(key, ITEM_key(it), nkey) != 0)
+                continue;
+
+            b->tags[i] = 0;
+            b->items[i] = NULL;
+            /* Overflow buckets go away once empty, the first one stays */
+            if (prev && assoc_bucket_match(b, 0) == SLOTS_MASK) {
+                prev->next = b->next;
+                free(b);
+            }
+            return it;
+        }
+    }
+    return NULL;
+}
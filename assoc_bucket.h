@@ -0,0 +1,62 @@
+#ifndef ASSOC_BUCKET_H
+#define ASSOC_BUCKET_H
+
+/* Buckets of the "buckets" hash table layout (-o hash_layout=buckets).
+ *
+ * A bucket is a cache line holding a few item pointers along with a 16 bit
+ * tag of their hash value. Lookups compare the tags first and only touch the
+ * items whose tag matches, so misses and collisions rarely cost more than the
+ * bucket itself. A bucket that fills up chains overflow buckets.
+ *
+ * Buckets are protected by the item lock of their hash value, like the
+ * chains of the default layout.
+ */
+
+#define ASSOC_BUCKET_SLOTS 5
+/* Tags are padded to 16 bytes so that they can be compared at once */
+#define ASSOC_BUCKET_TAGS 8
+
+struct assoc_bucket {
+    uint16_t tags[ASSOC_BUCKET_TAGS]; /* 0 for empty slots and padding */
+    item *items[ASSOC_BUCKET_SLOTS];
+    struct assoc_bucket *next;        /* overflow bucket */
+};
+
+/* The table index is taken from the low bits of the hash value, up to all
+ * of them past a hashpower of 16, so the tag can't simply be the high bits:
+ * items of a bucket would then share most of their tag. Multiplying by an odd
+ * constant mixes every bit of the hash value into the high bits of the
+ * product, which make the tag. 0 marks empty slots. */
+static inline uint16_t assoc_bucket_tag(const uint32_t hv) {
+    uint16_t tag = (uint32_t)(hv * 0x9E3779B1U) >> 16;
+    return tag ? tag : 1;
+}
+
+/* Bitmask of the slots of a bucket whose tag matches, bit i for slot i.
+ * Matching tag 0 gives the empty slots. */
+typedef unsigned int (*assoc_bucket_match_func)(const struct assoc_bucket *b,
+                                                const uint16_t tag);
+extern assoc_bucket_match_func assoc_bucket_match;
+
+/* Pick the fastest tag matching the CPU supports */
+void assoc_bucket_init(void);
+
+/* Expose the scalar variant for benchmarking purposes */
+unsigned int assoc_bucket_match_sw(const struct assoc_bucket *b, const uint16_t tag);
+
+/* Allocate count empty buckets, aligned on cache lines. NULL on failure */
+struct assoc_bucket *assoc_buckets_new(const uint64_t count);
+/* Free buckets along with their overflow ones */
+void assoc_buckets_free(struct assoc_bucket *buckets, const uint64_t count);
+/* Empty a bucket, freeing its overflow ones. The items are left alone */
+void assoc_bucket_clear(struct assoc_bucket *b);
+
+item *assoc_bucket_find(struct assoc_bucket *b, const char *key,
+                        const size_t nkey, const uint16_t tag);
+/* Returns 0 if an overflow bucket was needed but couldn't be allocated */
+int assoc_bucket_insert(struct assoc_bucket *b, item *it, const uint16_t tag);
+/* Returns the item removed, NULL if it wasn't there */
+item *assoc_bucket_delete(struct assoc_bucket *b, const char *key,
+                          const size_t nkey, const uint16_t tag);
+
+#endif
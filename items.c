@@ -67,6 +67,9 @@ static int lru_maintainer_initialized = 0;
 static pthread_mutex_t lru_maintainer_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t cas_id_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t stats_sizes_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Notified of items entering and leaving the hash table */
+static item_link_cb link_hook = NULL;
+static item_link_cb unlink_hook = NULL;
 
 void item_stats_reset(void) {
     int i;
@@ -353,6 +356,9 @@ void item_free(item *it) {
     assert(it != tails[it->slabs_clsid]);
     assert(it->refcount == 0);
 
+    /* an optimistic GET may be about to take a reference it will give up */
+    item_hazard_wait(it);
+
     /* so slab size changer can tell later if item is already free or not */
     clsid = ITEM_clsid(it);
     DEBUG_REFCNT(it, 'F');
@@ -379,30 +385,74 @@ bool item_size_ok(const size_t nkey, const int flags, const int nbytes) {
 }
 
 /* fixing stats/references during warm start */
-void do_item_link_fixup(item *it) {
+/* Relinks an item found in memory on restart. May run from several threads
+ * at once: the hash table is only touched under the item lock, and each item
+ * is the one head or tail of its LRU at most. */
+void item_link_fixup(item *it, struct item_fixup_stats *st) {
     item **head, **tail;
     int ntotal = ITEM_ntotal(it);
     uint32_t hv = hash(ITEM_key(it), it->nkey);
-    assoc_insert(it, hv);
+    int inserted;
 
     head = &heads[it->slabs_clsid];
     tail = &tails[it->slabs_clsid];
     if (it->prev == 0 && *head == 0) *head = it;
     if (it->next == 0 && *tail == 0) *tail = it;
-    sizes[it->slabs_clsid]++;
-    sizes_bytes[it->slabs_clsid] += ntotal;
+    st->sizes[it->slabs_clsid]++;
+    st->sizes_bytes[it->slabs_clsid] += ntotal;
 
-    STATS_LOCK();
-    stats_state.curr_bytes += ntotal;
-    stats_state.curr_items += 1;
-    stats.total_items += 1;
-    STATS_UNLOCK();
+    item_lock(hv);
+    inserted = assoc_insert(it, hv);
+    if (inserted && link_hook != NULL) {
+        link_hook(it);
+    }
+    item_unlock(hv);
+    if (!inserted) {
+        /* Out of memory for the hash table. The item stays on its LRU, which
+         * other threads may be walking, until item_link_fixup_drop() */
+        it->h_next = st->unhashed;
+        st->unhashed = it;
+        return;
+    }
 
-    item_stats_sizes_add(it);
+    st->curr_bytes += ntotal;
+    st->curr_items++;
+
+    if (stats_sizes_hist != NULL) {
+        mutex_lock(&stats_sizes_lock);
+        item_stats_sizes_add(it);
+        mutex_unlock(&stats_sizes_lock);
+    }
 
     return;
 }
 
+void item_link_fixup_stats(const struct item_fixup_stats *st) {
+    int i;
+
+    for (i = 0; i < LARGEST_ID; i++) {
+        sizes[i] += st->sizes[i];
+        sizes_bytes[i] += st->sizes_bytes[i];
+    }
+
+    STATS_LOCK();
+    stats_state.curr_bytes += st->curr_bytes;
+    stats_state.curr_items += st->curr_items;
+    stats.total_items += st->curr_items;
+    STATS_UNLOCK();
+}
+
+void item_link_fixup_drop(struct item_fixup_stats *st) {
+    while (st->unhashed != NULL) {
+        item *it = st->unhashed;
+        st->unhashed = it->h_next;
+        it->h_next = 0;
+        it->it_flags &= ~ITEM_LINKED;
+        item_unlink_q(it);
+        do_item_remove(it);
+    }
+}
+
 static void do_item_link_q(item *it) { /* item is the new head */
     item **head, **tail;
     assert((it->it_flags & ITEM_SLABBED) == 0);
@@ -484,21 +534,28 @@ static void item_unlink_q(item *it) {
 int do_item_link(item *it, const uint32_t hv) {
     MEMCACHED_ITEM_LINK(ITEM_key(it), it->nkey, it->nbytes);
     assert((it->it_flags & (ITEM_LINKED|ITEM_SLABBED)) == 0);
-    it->it_flags |= ITEM_LINKED;
     it->time = current_time;
 
+    /* Allocate a new CAS ID on link. */
+    ITEM_set_cas(it, (settings.use_cas) ? get_cas_id() : 0);
+    /* The buckets layout may run out of memory for an overflow bucket */
+    if (!assoc_insert(it, hv)) {
+        return 0;
+    }
+    it->it_flags |= ITEM_LINKED;
+
     STATS_LOCK();
     stats_state.curr_bytes += ITEM_ntotal(it);
     stats_state.curr_items += 1;
     stats.total_items += 1;
     STATS_UNLOCK();
 
-    /* Allocate a new CAS ID on link. */
-    ITEM_set_cas(it, (settings.use_cas) ? get_cas_id() : 0);
-    assoc_insert(it, hv);
     item_link_q(it);
     refcount_incr(it);
     item_stats_sizes_add(it);
+    if (link_hook != NULL) {
+        link_hook(it);
+    }
 
     return 1;
 }
@@ -512,12 +569,20 @@ void do_item_unlink(item *it, const uint32_t hv) {
         stats_state.curr_items -= 1;
         STATS_UNLOCK();
         item_stats_sizes_remove(it);
+        if (unlink_hook != NULL) {
+            unlink_hook(it);
+        }
         assoc_delete(ITEM_key(it), it->nkey, hv);
         item_unlink_q(it);
         do_item_remove(it);
     }
 }
 
+void item_set_link_hooks(item_link_cb link_cb, item_link_cb unlink_cb) {
+    link_hook = link_cb;
+    unlink_hook = unlink_cb;
+}
+
 /* FIXME: Is it necessary to keep this copy/pasted code? */
 void do_item_unlink_nolock(item *it, const uint32_t hv) {
     MEMCACHED_ITEM_UNLINK(ITEM_key(it), it->nkey, it->nbytes);
@@ -528,6 +593,9 @@ void do_item_unlink_nolock(item *it, const uint32_t hv) {
         stats_state.curr_items -= 1;
         STATS_UNLOCK();
         item_stats_sizes_remove(it);
+        if (unlink_hook != NULL) {
+            unlink_hook(it);
+        }
         assoc_delete(ITEM_key(it), it->nkey, hv);
         do_item_unlink_q(it);
         do_item_remove(it);
@@ -24,7 +24,26 @@ void do_item_remove(item *it);
 void do_item_update(item *it);   /** update LRU time to current and reposition */
 void do_item_update_nolock(item *it);
 int  do_item_replace(item *it, item *new_it, const uint32_t hv);
-void do_item_link_fixup(item *it);
+
+/* Tally of the items a restart fixup thread relinked, added to the totals by
+ * item_link_fixup_stats() once it is done. Items that couldn't be put back in
+ * the hash table are freed by item_link_fixup_drop(), once every thread is
+ * done and counted. */
+struct item_fixup_stats {
+    unsigned int sizes[POWER_LARGEST];
+    uint64_t sizes_bytes[POWER_LARGEST];
+    uint64_t curr_items;
+    uint64_t curr_bytes;
+    item *unhashed; /* chained by h_next */
+};
+void item_link_fixup(item *it, struct item_fixup_stats *st);
+void item_link_fixup_stats(const struct item_fixup_stats *st);
+void item_link_fixup_drop(struct item_fixup_stats *st);
+
+/** Lets other subsystems track items entering and leaving the hash table.
+ * Called with the item lock held. Must be set before any item is linked. */
+typedef void (*item_link_cb)(item *it);
+void item_set_link_hooks(item_link_cb link_cb, item_link_cb unlink_cb);
 
 int item_is_flushed(item *it);
 unsigned int do_get_lru_size(uint32_t id);
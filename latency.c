@@ -0,0 +1,256 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "memcached.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *latency_transport_names[LATENCY_TRANSPORTS] = {
+    "tcp", "udp", "unix", "rdma", "tls"
+};
+
+static const char *latency_op_names[LATENCY_OPS] = {
+    "get", "set", "delete", "meta"
+};
+
+uint64_t latency_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int latency_bucket(uint64_t ns) {
+    if (ns < LATENCY_SUB)
+        return ns;
+    if (ns >> LATENCY_MAX_BITS)
+        return LATENCY_BUCKETS - 1;
+    int shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+    return (shift + 1) * LATENCY_SUB + (int)(ns >> shift) - LATENCY_SUB;
+}
+
+/* Largest value falling in a bucket */
+static uint64_t latency_bucket_top(int b) {
+    if (b < LATENCY_SUB)
+        return b;
+    int shift = b / LATENCY_SUB - 1;
+    return (((uint64_t)LATENCY_SUB + b % LATENCY_SUB + 1) << shift) - 1;
+}
+
+static void latency_hist_record(struct latency_hist *h, uint64_t ns) {
+    h->count++;
+    h->sum += ns;
+    if (ns > h->max)
+        h->max = ns;
+    h->buckets[latency_bucket(ns)]++;
+}
+
+static uint64_t latency_hist_percentile(const struct latency_hist *h, double p) {
+    uint64_t rank = (uint64_t)(h->count * p / 100);
+    uint64_t seen = 0;
+    int b;
+
+    if (rank >= h->count)
+        return h->max;
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > rank)
+            break;
+    }
+    uint64_t top = latency_bucket_top(b);
+    return top < h->max ? top : h->max;
+}
+
+static void latency_hist_merge(struct latency_hist *out, const struct latency_hist *in) {
+    int b;
+    out->count += in->count;
+    out->sum += in->sum;
+    if (in->max > out->max)
+        out->max = in->max;
+    for (b = 0; b < LATENCY_BUCKETS; b++)
+        out->buckets[b] += in->buckets[b];
+}
+
+void latency_stats_merge(struct latency_stats *out, const struct latency_stats *in) {
+    int t, op;
+    for (t = 0; t < LATENCY_TRANSPORTS; t++) {
+        for (op = 0; op < LATENCY_OPS; op++) {
+            latency_hist_merge(&out->service[t][op], &in->service[t][op]);
+            latency_hist_merge(&out->queue[t][op], &in->queue[t][op]);
+        }
+    }
+}
+
+enum latency_op latency_op_ascii(const char *command) {
+    size_t len = strcspn(command, " ");
+
+    if (len == 2 && command[0] == 'm')
+        return LATENCY_META;
+    if ((len == 3 && (strncmp(command, "get", 3) == 0 || strncmp(command, "gat", 3) == 0))
+        || (len == 4 && (strncmp(command, "gets", 4) == 0 || strncmp(command, "gats", 4) == 0)))
+        return LATENCY_GET;
+    if ((len == 3 && (strncmp(command, "set", 3) == 0 || strncmp(command, "add", 3) == 0
+                      || strncmp(command, "cas", 3) == 0))
+        || (len == 6 && strncmp(command, "append", 6) == 0)
+        || (len == 7 && (strncmp(command, "replace", 7) == 0
+                         || strncmp(command, "prepend", 7) == 0)))
+        return LATENCY_SET;
+    if (len == 6 && strncmp(command, "delete", 6) == 0)
+        return LATENCY_DELETE;
+    return LATENCY_NONE;
+}
+
+enum latency_op latency_op_binary(const uint8_t opcode) {
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GETK:
+    case PROTOCOL_BINARY_CMD_GETKQ:
+    case PROTOCOL_BINARY_CMD_GAT:
+    case PROTOCOL_BINARY_CMD_GATQ:
+    case PROTOCOL_BINARY_CMD_GATK:
+    case PROTOCOL_BINARY_CMD_GATKQ:
+        return LATENCY_GET;
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_SETQ:
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_ADDQ:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_APPENDQ:
+    case PROTOCOL_BINARY_CMD_PREPEND:
+    case PROTOCOL_BINARY_CMD_PREPENDQ:
+        return LATENCY_SET;
+    case PROTOCOL_BINARY_CMD_DELETE:
+    case PROTOCOL_BINARY_CMD_DELETEQ:
+        return LATENCY_DELETE;
+    default:
+        return LATENCY_NONE;
+    }
+}
+
+static enum latency_transport conn_latency_transport(conn *c) {
+#ifdef TLS
+    if (c->ssl_enabled)
+        return LATENCY_TLS;
+#endif
+    switch (c->transport) {
+    case local_transport:
+        return LATENCY_UNIX;
+    case udp_transport:
+        return LATENCY_UDP;
+    case rdma_transport:
+    case rdma_ud_transport:
+        return LATENCY_RDMA;
+    default:
+        return LATENCY_TCP;
+    }
+}
+
+/* IOs queued by the commands of a connection so far */
+static int conn_ios_queued(conn *c) {
+    io_queue_t *q;
+    int ios = 0;
+
+    for (q = c->io_queues; q->type != IO_QUEUE_NONE; q++) {
+        ios += q->count;
+    }
+    return ios;
+}
+
+void latency_cmd_start(conn *c, enum latency_op op) {
+    c->latency_op = LATENCY_NONE;
+    if (c->thread->latency == NULL || op == LATENCY_NONE)
+        return;
+    c->latency_op = op;
+    c->latency_start = latency_now();
+    c->latency_ios = conn_ios_queued(c);
+}
+
+void latency_cmd_done(conn *c) {
+    if (c->latency_op == LATENCY_NONE)
+        return;
+
+    uint64_t now = latency_now();
+    enum latency_transport t = conn_latency_transport(c);
+    /* Commands still in the read buffer from an earlier read waited since */
+    uint64_t queued = c->latency_start > c->recv_time ? c->latency_start - c->recv_time : 0;
+    /* A GET that went to extstore is only done once its IO is back, its
+     * last response holds on to it until latency_io_done() */
+    bool io = c->resp != NULL && conn_ios_queued(c) != c->latency_ios;
+
+    pthread_mutex_lock(&c->thread->stats.mutex);
+    if (!io) {
+        latency_hist_record(&c->thread->latency->service[t][c->latency_op],
+                            now - c->latency_start);
+    }
+    latency_hist_record(&c->thread->latency->queue[t][c->latency_op], queued);
+    pthread_mutex_unlock(&c->thread->stats.mutex);
+    if (io) {
+        c->resp->latency_io = true;
+        c->resp->latency_op = c->latency_op;
+        c->resp->latency_start = c->latency_start;
+    }
+    c->latency_op = LATENCY_NONE;
+}
+
+void latency_io_done(conn *c) {
+    uint64_t now = 0;
+    enum latency_transport t = conn_latency_transport(c);
+    mc_resp *resp;
+
+    for (resp = c->resp_head; resp != NULL; resp = resp->next) {
+        if (!resp->latency_io)
+            continue;
+        if (now == 0)
+            now = latency_now();
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        latency_hist_record(&c->thread->latency->service[t][resp->latency_op],
+                            now - resp->latency_start);
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+        resp->latency_io = false;
+    }
+}
+
+static void latency_hist_stats(ADD_STAT add_stats, conn *c, int t, int op,
+                               const char *kind, const struct latency_hist *h) {
+    char name[STAT_KEY_LEN];
+
+#define X(stat, fmt, val) \
+    snprintf(name, sizeof(name), "%s:%s:%s_%s", latency_transport_names[t], \
+             latency_op_names[op], kind, stat); \
+    APPEND_STAT(name, fmt, val);
+    X("mean", "%llu", (unsigned long long)(h->sum / h->count));
+    X("p50", "%llu", (unsigned long long)latency_hist_percentile(h, 50));
+    X("p90", "%llu", (unsigned long long)latency_hist_percentile(h, 90));
+    X("p99", "%llu", (unsigned long long)latency_hist_percentile(h, 99));
+    X("p999", "%llu", (unsigned long long)latency_hist_percentile(h, 99.9));
+    X("max", "%llu", (unsigned long long)h->max);
+#undef X
+}
+
+void process_latency_stats(ADD_STAT add_stats, conn *c) {
+    struct latency_stats *totals = calloc(1, sizeof(*totals));
+    char name[STAT_KEY_LEN];
+    int t, op;
+
+    if (totals == NULL)
+        return;
+    threadlocal_latency_aggregate(totals);
+
+    for (t = 0; t < LATENCY_TRANSPORTS; t++) {
+        for (op = 0; op < LATENCY_OPS; op++) {
+            const struct latency_hist *service = &totals->service[t][op];
+            if (service->count == 0)
+                continue;
+
+            snprintf(name, sizeof(name), "%s:%s:count",
+                     latency_transport_names[t], latency_op_names[op]);
+            APPEND_STAT(name, "%llu", (unsigned long long)service->count);
+            latency_hist_stats(add_stats, c, t, op, "service", service);
+            latency_hist_stats(add_stats, c, t, op, "queue", &totals->queue[t][op]);
+        }
+    }
+
+    free(totals);
+}
@@ -0,0 +1,60 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+/* Per-thread histograms of how long commands take, split by transport and
+ * command type. Service time runs from the start of parsing a command until
+ * its response is ready, extstore reads included, queue time from the read
+ * that brought the command in until parsing starts.
+ *
+ * Histograms are log-linear: values below LATENCY_SUB nanoseconds get a
+ * bucket each, every power of two above is split in LATENCY_SUB buckets, so
+ * that percentiles are within 1/LATENCY_SUB of the actual value.
+ */
+
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+/* Anything longer, about a minute, lands in the last bucket */
+#define LATENCY_MAX_BITS 36
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+enum latency_op {
+    LATENCY_GET = 0,
+    LATENCY_SET,
+    LATENCY_DELETE,
+    LATENCY_META,
+    LATENCY_OPS,
+    LATENCY_NONE = LATENCY_OPS /* not timed */
+};
+
+enum latency_transport {
+    LATENCY_TCP = 0,
+    LATENCY_UDP,
+    LATENCY_UNIX,
+    LATENCY_RDMA,
+    LATENCY_TLS,
+    LATENCY_TRANSPORTS
+};
+
+struct latency_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[LATENCY_BUCKETS];
+};
+
+struct latency_stats {
+    struct latency_hist service[LATENCY_TRANSPORTS][LATENCY_OPS];
+    struct latency_hist queue[LATENCY_TRANSPORTS][LATENCY_OPS];
+};
+
+/* Monotonic clock in nanoseconds */
+uint64_t latency_now(void);
+
+/* Kind of command a text or binary protocol request is, LATENCY_NONE for the
+ * ones not timed */
+enum latency_op latency_op_ascii(const char *command);
+enum latency_op latency_op_binary(const uint8_t opcode);
+
+void latency_stats_merge(struct latency_stats *out, const struct latency_stats *in);
+
+#endif
@@ -272,7 +272,7 @@ static int _logger_parse_cne(logentry *e, char *scratch) {
     unsigned short rport;
     char rip[64];
     struct logentry_conn_event *le = (struct logentry_conn_event *) e->data;
-    const char * const transport_map[] = { "local", "tcp", "udp" };
+    const char * const transport_map[] = { "local", "tcp", "udp", "rdma", "rdma_ud" };
 
     _logger_util_addr_endpoint(&le->addr, rip, sizeof(rip), &rport);
 
@@ -289,7 +289,7 @@ static int _logger_parse_cce(logentry *e, char *scratch) {
     unsigned short rport;
     char rip[64];
     struct logentry_conn_event *le = (struct logentry_conn_event *) e->data;
-    const char * const transport_map[] = { "local", "tcp", "udp" };
+    const char * const transport_map[] = { "local", "tcp", "udp", "rdma", "rdma_ud" };
     const char * const reason_map[] = { "error", "normal", "idle_timeout", "shutdown" };
 
     _logger_util_addr_endpoint(&le->addr, rip, sizeof(rip), &rport);
@@ -10,10 +10,518 @@
 #include "mcrdma_utils.h"
 #include <poll.h>
 #include "proto_text.h"
+#include "mcrdma_proto.h"
+#include "mcrdma_index.h"
+#include "mcrdma_ud.h"
+#include <endian.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 // State of dispatcher connection
 static struct mcrdma_state disp;
+// Connection requests on disp.id, handled by the main thread
+static struct event listen_event;
+
+// A chunk of slab memory, registered with the PD of every device
+struct mcrdma_mem_region {
+    char *base;
+    size_t len;
+    struct ibv_mr **mrs; // indexed by device id
+    uint32_t pending;    // devices it still has to be registered with
+};
+
+// Registry of the slab memory, so that responses can be sent from it
+static struct {
+    pthread_rwlock_t lock;
+    struct mcrdma_mem_region *regions; // sorted by base address
+    int count;
+    int size;
+    struct ibv_pd *pds[MCRDMA_MAX_DEVICES]; // indexed by device id
+} mem_reg = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+// MR of the preallocated slab memory on each device, read without locking
+static struct ibv_mr *mem_fixed[MCRDMA_MAX_DEVICES];
+
+// Devices in use, never released
+static struct {
+    pthread_mutex_t lock;
+    struct mcrdma_device *list;
+    int count;
+} devices = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// What memory registration costs, broken down by what gets registered
+enum mcrdma_mr_kind {
+    MCRDMA_MR_SEND_BUF,
+    MCRDMA_MR_ITEMS,
+    MCRDMA_MR_RECV,
+    MCRDMA_MR_INDEX,
+    MCRDMA_MR_KINDS
+};
+
+static const char *mr_kind_names[MCRDMA_MR_KINDS] = {
+    [MCRDMA_MR_SEND_BUF] = "send_buf",
+    [MCRDMA_MR_ITEMS] = "items",
+    [MCRDMA_MR_RECV] = "recv",
+    [MCRDMA_MR_INDEX] = "index",
+};
+
+static struct {
+    pthread_mutex_t lock;
+    uint64_t count[MCRDMA_MR_KINDS];
+    uint64_t bytes[MCRDMA_MR_KINDS];
+    uint64_t usec[MCRDMA_MR_KINDS];
+    uint64_t buf_hits;   // send buffers reused from a device cache
+    uint64_t buf_misses; // ...versus allocated and registered
+    int buf_cached;      // send buffers sitting in the caches
+} reg_stats = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void mcrdma_cq_handler(evutil_socket_t fd, short which, void *arg);
+static void mcrdma_cm_handler(evutil_socket_t fd, short which, void *arg);
+static ssize_t mcrdma_read(conn *c, void *buf, size_t count);
+static ssize_t mcrdma_sendmsg(conn *c, struct msghdr *msg, int flags);
+
+static uint64_t mr_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void mr_account(enum mcrdma_mr_kind kind, size_t len, uint64_t start) {
+    uint64_t usec = mr_clock() - start;
+    pthread_mutex_lock(&reg_stats.lock);
+    reg_stats.count[kind]++;
+    reg_stats.bytes[kind] += len;
+    reg_stats.usec[kind] += usec;
+    pthread_mutex_unlock(&reg_stats.lock);
+}
+
+// ibv_reg_mr(), keeping track of the time spent pinning pages
+static struct ibv_mr *reg_mr(enum mcrdma_mr_kind kind, struct ibv_pd *pd,
+        void *addr, size_t len, int access) {
+    uint64_t start = mr_clock();
+    struct ibv_mr *mr = ibv_reg_mr(pd, addr, len, access);
+    if(mr) {
+        mr_account(kind, len, start);
+    }
+    return mr;
+}
+
+/*
+ * Slab memory registry.
+ * Lock order is slabs lock, then mem_reg.lock: the slab allocator calls the
+ * hooks below while holding its own lock. Those only record the regions,
+ * pinning them with ibv_reg_mr() happens later without either lock held:
+ * up front for the memory there is when a device shows up, on first use for
+ * pages malloc'ed afterwards. Preallocated memory is a single region which
+ * never goes away, its MRs are looked up without locking at all.
+ */
+
+// Index of the region containing ptr or, if none, of where it would go
+static int mem_region_search(const char *ptr) {
+    int lo = 0, hi = mem_reg.count;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(ptr >= mem_reg.regions[mid].base + mem_reg.regions[mid].len) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static struct mcrdma_mem_region *mem_region_get(char *base, size_t len) {
+    int i = mem_region_search(base);
+    if(i < mem_reg.count && mem_reg.regions[i].base == base) {
+        return &mem_reg.regions[i];
+    }
+
+    if(mem_reg.count == mem_reg.size) {
+        int new_size = mem_reg.size ? mem_reg.size * 2 : 64;
+        struct mcrdma_mem_region *n = realloc(mem_reg.regions,
+                new_size * sizeof(struct mcrdma_mem_region));
+        if(!n) {
+            return NULL;
+        }
+        mem_reg.regions = n;
+        mem_reg.size = new_size;
+    }
+
+    struct ibv_mr **mrs = calloc(MCRDMA_MAX_DEVICES, sizeof(struct ibv_mr *));
+    if(!mrs) {
+        return NULL;
+    }
+
+    memmove(&mem_reg.regions[i + 1], &mem_reg.regions[i],
+            (mem_reg.count - i) * sizeof(struct mcrdma_mem_region));
+    mem_reg.regions[i].base = base;
+    mem_reg.regions[i].len = len;
+    mem_reg.regions[i].mrs = mrs;
+    mem_reg.regions[i].pending = 0;
+    mem_reg.count++;
+    return &mem_reg.regions[i];
+}
+
+// Registers a pending region with a device. Called without mem_reg.lock
+// held; returns the region's MR, NULL if registration failed (which is
+// not retried) or the region went away meanwhile.
+static struct ibv_mr *mem_region_register(char *base, size_t len, int id) {
+    // Read by the HCA, by clients doing one-sided GETs and written by the
+    // ones doing write sets. A failure just means responses from this region
+    // get copied into the send buffer instead.
+    int access = IBV_ACCESS_LOCAL_WRITE;
+    if(mcrdma_index_enabled()) {
+        access |= IBV_ACCESS_REMOTE_READ;
+    }
+    if(settings.rdma_write_sets) {
+        access |= IBV_ACCESS_REMOTE_WRITE;
+    }
+
+    pthread_rwlock_rdlock(&mem_reg.lock);
+    struct ibv_pd *pd = mem_reg.pds[id];
+    pthread_rwlock_unlock(&mem_reg.lock);
+    struct ibv_mr *mr = reg_mr(MCRDMA_MR_ITEMS, pd, base, len, access);
+    if(!mr && settings.verbose > 0) {
+        mcrdma_error("Failed to register slab memory region");
+    }
+
+    // Another thread may have beaten us to it
+    struct ibv_mr *ret = NULL;
+    pthread_rwlock_wrlock(&mem_reg.lock);
+    int i = mem_region_search(base);
+    if(i < mem_reg.count && mem_reg.regions[i].base == base) {
+        struct mcrdma_mem_region *r = &mem_reg.regions[i];
+        if(r->pending & (1U << id)) {
+            r->pending &= ~(1U << id);
+            r->mrs[id] = mr;
+            mr = NULL;
+        }
+        ret = r->mrs[id];
+    }
+    pthread_rwlock_unlock(&mem_reg.lock);
+    if(mr) {
+        ibv_dereg_mr(mr);
+    }
+    return ret;
+}
+
+// Slab allocator hook: a new page was malloc'ed
+static void mem_alloc_hook(void *ptr, size_t len, void *arg) {
+    pthread_rwlock_wrlock(&mem_reg.lock);
+    struct mcrdma_mem_region *r = mem_region_get(ptr, len);
+    if(r) {
+        for(int id = 0; id < MCRDMA_MAX_DEVICES; id++) {
+            if(mem_reg.pds[id]) {
+                r->pending |= 1U << id;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&mem_reg.lock);
+}
+
+// Slab allocator hook: a page is about to be freed
+static void mem_release_hook(void *ptr, size_t len, void *arg) {
+    pthread_rwlock_wrlock(&mem_reg.lock);
+    int i = mem_region_search(ptr);
+    if(i < mem_reg.count && mem_reg.regions[i].base == ptr) {
+        struct mcrdma_mem_region *r = &mem_reg.regions[i];
+        for(int id = 0; id < MCRDMA_MAX_DEVICES; id++) {
+            if(r->mrs[id]) {
+                ibv_dereg_mr(r->mrs[id]);
+            }
+        }
+        free(r->mrs);
+        memmove(&mem_reg.regions[i], &mem_reg.regions[i + 1],
+                (mem_reg.count - i - 1) * sizeof(struct mcrdma_mem_region));
+        mem_reg.count--;
+    }
+    pthread_rwlock_unlock(&mem_reg.lock);
+}
+
+// slabs_mem_foreach callback queueing what already exists for a new PD
+static void mem_register_existing(void *ptr, size_t len, void *arg) {
+    struct mcrdma_device *dev = arg;
+    pthread_rwlock_wrlock(&mem_reg.lock);
+    struct mcrdma_mem_region *r = mem_region_get(ptr, len);
+    if(r && !r->mrs[dev->id]) {
+        r->pending |= 1U << dev->id;
+    }
+    pthread_rwlock_unlock(&mem_reg.lock);
+}
+
+static void mem_registry_add_pd(struct mcrdma_device *dev) {
+    int id = dev->id;
+    pthread_rwlock_wrlock(&mem_reg.lock);
+    mem_reg.pds[id] = dev->pd;
+    pthread_rwlock_unlock(&mem_reg.lock);
+
+    // Pages allocated from now on are queued by the alloc hook, the ones
+    // that came before are picked up here and registered right away.
+    slabs_mem_foreach(mem_register_existing, dev);
+    char *next = NULL;
+    for(;;) {
+        char *base = NULL;
+        size_t len = 0;
+        pthread_rwlock_rdlock(&mem_reg.lock);
+        for(int i = mem_region_search(next); i < mem_reg.count; i++) {
+            if(mem_reg.regions[i].pending & (1U << id)) {
+                base = mem_reg.regions[i].base;
+                len = mem_reg.regions[i].len;
+                break;
+            }
+        }
+        pthread_rwlock_unlock(&mem_reg.lock);
+        if(!base) {
+            break;
+        }
+        struct ibv_mr *mr = mem_region_register(base, len, id);
+        if(mr && slabs_mem_prealloc()) {
+            __atomic_store_n(&mem_fixed[id], mr, __ATOMIC_RELEASE);
+        }
+        next = base + len;
+    }
+}
+
+// Returns the MR covering [ptr, ptr + len) on the thread's PD, if any
+static struct ibv_mr *mem_lookup(struct mcrdma_thread *t, const char *ptr, size_t len) {
+    int id = t->dev->id;
+    struct ibv_mr *mr = __atomic_load_n(&mem_fixed[id], __ATOMIC_ACQUIRE);
+    if(mr) {
+        char *base = mr->addr;
+        return ptr >= base && ptr + len <= base + mr->length ? mr : NULL;
+    }
+
+    char *base = NULL;
+    size_t rlen = 0;
+    pthread_rwlock_rdlock(&mem_reg.lock);
+    int i = mem_region_search(ptr);
+    if(i < mem_reg.count) {
+        struct mcrdma_mem_region *r = &mem_reg.regions[i];
+        if(ptr >= r->base && ptr + len <= r->base + r->len) {
+            mr = r->mrs[id];
+            if(r->pending & (1U << id)) {
+                base = r->base;
+                rlen = r->len;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&mem_reg.lock);
+    if(base) {
+        // First use of a page malloc'ed since the device showed up
+        mr = mem_region_register(base, rlen, id);
+    }
+    return mr;
+}
+
+// Remote key of the slab memory for one-sided reads, which needs it to be a
+// single region. 0 if it isn't registered (yet).
+static uint32_t mem_rkey(struct mcrdma_thread *t) {
+    struct ibv_mr *mr = __atomic_load_n(&mem_fixed[t->dev->id], __ATOMIC_ACQUIRE);
+    if(mr) {
+        return mr->rkey;
+    }
+
+    uint32_t rkey = 0;
+    pthread_rwlock_rdlock(&mem_reg.lock);
+    if(mem_reg.count == 1 && mem_reg.regions[0].mrs[t->dev->id]) {
+        rkey = mem_reg.regions[0].mrs[t->dev->id]->rkey;
+    }
+    pthread_rwlock_unlock(&mem_reg.lock);
+    return rkey;
+}
+
+/*
+ * Send buffer cache.
+ * Registering a buffer pins its pages, which takes long enough to stall
+ * connection storms. Buffers are rather kept registered once their
+ * connection is gone and handed to the next one of the same size.
+ */
+
+// Size class of a send buffer, i.e. the smallest one holding size
+static int buf_class(size_t size) {
+    int cls = 0;
+    while(((size_t)MCRDMA_BUF_MIN << cls) < size && cls < MCRDMA_BUF_CLASSES - 1) {
+        cls++;
+    }
+    return cls;
+}
+
+// Round a send buffer size to its class, without going past the limit
+static size_t buf_size(size_t size) {
+    int cls = buf_class(size);
+    if(((size_t)MCRDMA_BUF_MIN << cls) > settings.rdma_buf_max && cls > 0) {
+        cls--;
+    }
+    return (size_t)MCRDMA_BUF_MIN << cls;
+}
+
+// Large buffers are backed by transparent hugepages, sparing the HCA most
+// of its address translations
+static void *buf_mem_alloc(size_t size) {
+    void *ptr = NULL;
+    size_t align = sysconf(_SC_PAGESIZE);
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if(size % MCRDMA_HUGEPAGE_SIZE == 0) {
+        align = MCRDMA_HUGEPAGE_SIZE;
+    }
+#endif
+    if(posix_memalign(&ptr, align, size) != 0) {
+        return NULL;
+    }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    // Only a hint, regular pages do just as well
+    if(align == MCRDMA_HUGEPAGE_SIZE) {
+        madvise(ptr, size, MADV_HUGEPAGE);
+    }
+#endif
+    return ptr;
+}
+
+static struct mcrdma_buf *buf_new(struct mcrdma_device *dev, int cls) {
+    struct mcrdma_buf *b = calloc(1, sizeof(struct mcrdma_buf));
+    if(!b) {
+        return NULL;
+    }
+    b->dev = dev;
+    b->cls = cls;
+    b->size = (size_t)MCRDMA_BUF_MIN << cls;
+    b->base = buf_mem_alloc(b->size);
+    if(!b->base) {
+        free(b);
+        return NULL;
+    }
+    b->mr = reg_mr(MCRDMA_MR_SEND_BUF, dev->pd, b->base, b->size, MCRDMA_BUF_ACCESS_FLAGS);
+    if(!b->mr) {
+        free(b->base);
+        free(b);
+        return NULL;
+    }
+    return b;
+}
+
+static void buf_free(struct mcrdma_buf *b) {
+    ibv_dereg_mr(b->mr);
+    free(b->base);
+    free(b);
+}
+
+// Take a send buffer of (at least) size bytes
+static struct mcrdma_buf *buf_get(struct mcrdma_device *dev, size_t size) {
+    int cls = buf_class(size);
+
+    pthread_mutex_lock(&dev->lock);
+    struct mcrdma_buf *b = dev->bufs[cls];
+    if(b) {
+        dev->bufs[cls] = b->next;
+        dev->cached[cls]--;
+    }
+    pthread_mutex_unlock(&dev->lock);
+
+    pthread_mutex_lock(&reg_stats.lock);
+    if(b) {
+        reg_stats.buf_hits++;
+        reg_stats.buf_cached--;
+    } else {
+        reg_stats.buf_misses++;
+    }
+    pthread_mutex_unlock(&reg_stats.lock);
+
+    if(!b) {
+        b = buf_new(dev, cls);
+    }
+    return b;
+}
+
+// Give a send buffer back, it is kept registered if the cache has room
+static void buf_put(struct mcrdma_buf *b) {
+    struct mcrdma_device *dev = b->dev;
+    bool cached = false;
+
+    pthread_mutex_lock(&dev->lock);
+    if(dev->cached[b->cls] < settings.rdma_buf_cache) {
+        b->next = dev->bufs[b->cls];
+        dev->bufs[b->cls] = b;
+        dev->cached[b->cls]++;
+        cached = true;
+    }
+    pthread_mutex_unlock(&dev->lock);
+
+    if(cached) {
+        pthread_mutex_lock(&reg_stats.lock);
+        reg_stats.buf_cached++;
+        pthread_mutex_unlock(&reg_stats.lock);
+    } else {
+        buf_free(b);
+    }
+}
+
+// The device verbs belongs to, set up on first use: its PD, the registration
+// of the slab memory and of the index, and the send buffers of the default
+// size.
+struct mcrdma_device *mcrdma_device_get(struct ibv_context *verbs) {
+    struct mcrdma_device *dev;
+
+    pthread_mutex_lock(&devices.lock);
+    for(dev = devices.list; dev; dev = dev->next) {
+        if(dev->verbs == verbs) {
+            pthread_mutex_unlock(&devices.lock);
+            return dev;
+        }
+    }
+
+    if(devices.count == MCRDMA_MAX_DEVICES) {
+        mcrdma_log("Too many rdma devices\n");
+        pthread_mutex_unlock(&devices.lock);
+        return NULL;
+    }
+
+    dev = calloc(1, sizeof(struct mcrdma_device));
+    if(!dev) {
+        pthread_mutex_unlock(&devices.lock);
+        return NULL;
+    }
+    dev->verbs = verbs;
+    dev->pd = ibv_alloc_pd(verbs);
+    if(!dev->pd) {
+        mcrdma_error("Failed to allocate PD");
+        free(dev);
+        pthread_mutex_unlock(&devices.lock);
+        return NULL;
+    }
+
+    if(mcrdma_index_enabled()) {
+        uint64_t start = mr_clock();
+        dev->index_mr = mcrdma_index_register(dev->pd);
+        if(!dev->index_mr) {
+            mcrdma_error("Failed to register the one-sided index");
+            ibv_dealloc_pd(dev->pd);
+            free(dev);
+            pthread_mutex_unlock(&devices.lock);
+            return NULL;
+        }
+        mr_account(MCRDMA_MR_INDEX, mcrdma_index_size() * sizeof(struct mcrdma_index_entry), start);
+    }
+
+    pthread_mutex_init(&dev->lock, NULL);
+    dev->id = devices.count++;
+    mem_registry_add_pd(dev);
+
+    int cls = buf_class(buf_size(settings.rdma_buf_size));
+    for(int i = 0; i < settings.rdma_buf_cache; i++) {
+        struct mcrdma_buf *b = buf_new(dev, cls);
+        if(!b) {
+            break;
+        }
+        buf_put(b);
+    }
+
+    dev->next = devices.list;
+    devices.list = dev;
+    pthread_mutex_unlock(&devices.lock);
+    return dev;
+}
 
 int mcrdma_init(const char *interface, int port) {
     // safety check. With the appropriate measures could be removed to allow for rdma servers on multiple interfaces/ports
@@ -23,240 +531,1227 @@ int mcrdma_init(const char *interface, int port) {
         exit(EXIT_FAILURE);
     }
 
-    struct sockaddr_in sockaddr = {0};
-    sockaddr.sin_family = AF_INET;
-    sockaddr.sin_port = htons(port);
+    struct sockaddr_in sockaddr = {0};
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_port = htons(port);
+
+    // Select the interface
+    if(interface) {
+        if(!inet_pton(AF_INET, interface, &sockaddr.sin_addr)) {
+            mcrdma_log("Invalid interface address: %s\n", interface);
+            return -1;
+        }
+    } else {
+        sockaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+
+    disp.echannel = rdma_create_event_channel();
+    if(!disp.echannel) {
+        mcrdma_error("cm channel creation error");
+        return -1;
+    }
+
+    if(rdma_create_id(disp.echannel, &disp.id, NULL, RDMA_PS_TCP)) {
+        mcrdma_error("rdma id creationg error");
+        return -1;
+    }
+
+    if(rdma_bind_addr(disp.id, (struct sockaddr*) &sockaddr)) {
+        mcrdma_error("cannot bind address");
+        return -1;
+    }
+
+    if(rdma_listen(disp.id, MCRDMA_BACKLOG)) {
+        mcrdma_error("rdma_listen failed");
+        return -1;
+    }
+
+    // Keep track of slab memory so it can be registered with the workers'
+    // PDs, responses are then sent without copying values around
+    slabs_set_mem_hooks(mem_alloc_hook, mem_release_hook, NULL);
+
+    // Bound to the address of a single device: pay for its registrations
+    // now rather than with the first connection
+    if(disp.id->verbs && !mcrdma_device_get(disp.id->verbs)) {
+        return -1;
+    }
+
+    if(settings.rdma_ud && mcrdma_ud_init((struct sockaddr *)&sockaddr) != 0) {
+        return -1;
+    }
+
+    fprintf(stderr, "rdma server will listen for connections on %s:%d\n", inet_ntoa(sockaddr.sin_addr), port);
+
+    return 0;
+}
+
+// Buffer sizes a connection gets, settled by the listener and handed to the
+// worker through the context of the new cm id
+struct mcrdma_conn_request {
+    uint32_t send_max;
+    uint32_t sbuf_size;
+};
+
+// Size the buffers of a connection after what the client asked for, within
+// the server limits. Return NULL if the client can't be served.
+static struct mcrdma_conn_request *conn_request_new(struct rdma_cm_event *cm_event) {
+    // Clients not telling anything receive in buffers of the old fixed size
+    uint32_t recv_size = MCRDMA_BUF_SIZE;
+    uint32_t send_buf_size = 0;
+
+    if(cm_event->param.conn.private_data_len >= sizeof(struct mcrdma_connect_data)) {
+        const struct mcrdma_connect_data *data = cm_event->param.conn.private_data;
+        if(data->recv_size) {
+            recv_size = ntohl(data->recv_size);
+        }
+        send_buf_size = ntohl(data->send_buf_size);
+    }
+    if(recv_size < MCRDMA_BUF_MIN) {
+        mcrdma_log("client receive size %u is too small\n", recv_size);
+        return NULL;
+    }
+
+    if(send_buf_size == 0) {
+        send_buf_size = settings.rdma_buf_size;
+    } else if(send_buf_size < MCRDMA_BUF_MIN) {
+        send_buf_size = MCRDMA_BUF_MIN;
+    } else if(send_buf_size > settings.rdma_buf_max) {
+        send_buf_size = settings.rdma_buf_max;
+    }
+
+    struct mcrdma_conn_request *req = malloc(sizeof(*req));
+    if(!req) {
+        return NULL;
+    }
+    // Rounded to a size class, so that the buffer can be recycled
+    req->sbuf_size = buf_size(send_buf_size);
+    // No point in messages larger than the buffer they are copied into
+    req->send_max = recv_size < req->sbuf_size ? recv_size : req->sbuf_size;
+    return req;
+}
+
+// Accept every connection request queued on the listening id. The channel is
+// non-blocking, so this returns as soon as it's drained.
+static void listen_handler(evutil_socket_t fd, short which, void *arg) {
+    struct rdma_cm_event *cm_event = NULL;
+
+    while(rdma_get_cm_event(disp.echannel, &cm_event) == 0) {
+        if(cm_event->event != RDMA_CM_EVENT_CONNECT_REQUEST
+                || cm_event->status != 0) {
+            mcrdma_log("ignoring cm event %s, status %d\n",
+                    rdma_event_str(cm_event->event), cm_event->status);
+            rdma_ack_cm_event(cm_event);
+            continue;
+        }
+        mcrdma_log("client establishing a connection\n");
+
+        // The new cm id outlives the event, the worker thread picked by
+        // the dispatcher takes ownership of it.
+        struct rdma_cm_id *id = cm_event->id;
+        id->context = conn_request_new(cm_event);
+
+        if(rdma_ack_cm_event(cm_event)) {
+            mcrdma_error("Failed to acknowledge cm event\n");
+            free(id->context);
+            rdma_reject(id, NULL, 0);
+            rdma_destroy_id(id);
+            continue;
+        }
+        if(!id->context) {
+            rdma_reject(id, NULL, 0);
+            rdma_destroy_id(id);
+            continue;
+        }
+
+        dispatch_rdma_conn_new(id, conn_new_cmd, MCRDMA_BUF_SIZE);
+    }
+
+    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+        mcrdma_error("Failed to retrieve a cm event");
+    }
+}
+
+int mcrdma_listen(struct event_base *base) {
+    int flags = fcntl(disp.echannel->fd, F_GETFL);
+    if(flags < 0 || fcntl(disp.echannel->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        mcrdma_error("cannot make the cm channel non-blocking");
+        return -1;
+    }
+
+    event_set(&listen_event, disp.echannel->fd, EV_READ | EV_PERSIST,
+            listen_handler, NULL);
+    event_base_set(base, &listen_event);
+    if(event_add(&listen_event, 0) == -1) {
+        mcrdma_error("cannot add the cm channel to the event base");
+        return -1;
+    }
+
+    if(settings.rdma_ud) {
+        return mcrdma_ud_listen(base);
+    }
+    return 0;
+}
+
+/*
+ * Post free slabs back to the SRQ, chaining up to MCRDMA_SRQ_REFILL_BATCH
+ * receive WRs per doorbell. Unless forced, a partial batch is kept around
+ * until more slabs get released.
+ */
+static int srq_refill(struct mcrdma_thread *t, bool force) {
+    struct ibv_recv_wr wrs[MCRDMA_SRQ_REFILL_BATCH];
+    struct ibv_sge sges[MCRDMA_SRQ_REFILL_BATCH];
+    struct ibv_recv_wr *bad_wr = NULL;
+    int refills = 0;
+    int refilled = 0;
+
+    while(t->free_count >= MCRDMA_SRQ_REFILL_BATCH
+            || (force && t->free_count > 0)) {
+        int n = 0;
+        struct mcrdma_recv_slab *slab = t->free_slabs;
+        while(slab && n < MCRDMA_SRQ_REFILL_BATCH) {
+            sges[n].addr = (uintptr_t)slab->buf;
+            sges[n].length = MCRDMA_RECV_SLAB_SIZE;
+            sges[n].lkey = t->slab_mr->lkey;
+            wrs[n].wr_id = (uintptr_t)slab;
+            wrs[n].sg_list = &sges[n];
+            wrs[n].num_sge = 1;
+            wrs[n].next = NULL;
+            if(n > 0) {
+                wrs[n - 1].next = &wrs[n];
+            }
+            slab = slab->next;
+            n++;
+        }
+
+        if(ibv_post_srq_recv(t->srq, wrs, &bad_wr)) {
+            mcrdma_error("Failed to post receive slabs to the SRQ");
+            return -1;
+        }
+        t->free_slabs = slab;
+        t->free_count -= n;
+        t->srq_depth += n;
+        refills++;
+        refilled += n;
+    }
+
+    if(refills) {
+        pthread_mutex_lock(&t->stats_lock);
+        t->stats.refills += refills;
+        t->stats.refilled += refilled;
+        t->stats.depth = t->srq_depth;
+        t->stats.held = MCRDMA_SRQ_SIZE - t->srq_depth - t->free_count;
+        pthread_mutex_unlock(&t->stats_lock);
+    }
+
+    return 0;
+}
+
+static inline void slab_release(struct mcrdma_thread *t, struct mcrdma_recv_slab *slab) {
+    slab->next = t->free_slabs;
+    t->free_slabs = slab;
+    t->free_count++;
+    srq_refill(t, false);
+}
+
+static inline bool wr_is_recv(struct mcrdma_thread *t, uint64_t wr_id) {
+    return wr_id >= (uintptr_t)t->slabs
+        && wr_id < (uintptr_t)(t->slabs + MCRDMA_SRQ_SIZE);
+}
+
+static void qp_table_add(struct mcrdma_thread *t, conn *c) {
+    conn **bucket = &t->qp_table[c->rdma->qp_num % MCRDMA_QP_TABLE_SIZE];
+    c->rdma->qp_next = *bucket;
+    *bucket = c;
+}
+
+static void qp_table_remove(struct mcrdma_thread *t, conn *c) {
+    conn **pos = &t->qp_table[c->rdma->qp_num % MCRDMA_QP_TABLE_SIZE];
+    while(*pos) {
+        if(*pos == c) {
+            *pos = c->rdma->qp_next;
+            break;
+        }
+        pos = &(*pos)->rdma->qp_next;
+    }
+    c->rdma->qp_next = NULL;
+}
+
+static conn *qp_table_find(struct mcrdma_thread *t, uint32_t qp_num) {
+    conn *c = t->qp_table[qp_num % MCRDMA_QP_TABLE_SIZE];
+    while(c && c->rdma->qp_num != qp_num) {
+        c = c->rdma->qp_next;
+    }
+    return c;
+}
+
+/*
+ * Lazily set up the RDMA resources of a worker thread. This can only happen
+ * once the first connection shows up, since that's when we learn which
+ * device the clients are coming from.
+ */
+static struct mcrdma_thread *mcrdma_thread_init(LIBEVENT_THREAD *me, struct ibv_context *verbs) {
+    struct mcrdma_thread *t = calloc(1, sizeof(struct mcrdma_thread));
+    if(!t) {
+        mcrdma_error("Failed to allocate rdma thread state");
+        return NULL;
+    }
+    t->thread = me;
+    for(int i = 0; i < settings.num_threads; i++) {
+        if(get_worker_thread(i) == me) {
+            t->id = i;
+            break;
+        }
+    }
+
+    // Workers on the same device share its PD and registrations
+    t->dev = mcrdma_device_get(verbs);
+    if(!t->dev) {
+        goto err;
+    }
+
+    t->comp_channel = ibv_create_comp_channel(verbs);
+    if(!t->comp_channel) {
+        mcrdma_error("Failed to create IO completion event channel");
+        goto err;
+    }
+
+    int flags = fcntl(t->comp_channel->fd, F_GETFL, 0);
+    fcntl(t->comp_channel->fd, F_SETFL, flags | O_NONBLOCK);
+
+    t->cq = ibv_create_cq(verbs, MCRDMA_CQ_SIZE, t, t->comp_channel, 0);
+    if(!t->cq) {
+        mcrdma_error("Failed to create CQ");
+        goto err;
+    }
+
+    if(ibv_req_notify_cq(t->cq, 0)) {
+        mcrdma_error("Failed to request notifications");
+        goto err;
+    }
+
+    struct ibv_srq_init_attr srq_init_attr = {0};
+    srq_init_attr.srq_context = t;
+    srq_init_attr.attr.max_wr = MCRDMA_SRQ_SIZE;
+    srq_init_attr.attr.max_sge = 1;
+    t->srq = ibv_create_srq(t->dev->pd, &srq_init_attr);
+    if(!t->srq) {
+        mcrdma_error("Failed to create SRQ");
+        goto err;
+    }
+
+    t->slab_mem = malloc((size_t)MCRDMA_SRQ_SIZE * MCRDMA_RECV_SLAB_SIZE);
+    t->slabs = calloc(MCRDMA_SRQ_SIZE, sizeof(struct mcrdma_recv_slab));
+    if(!t->slab_mem || !t->slabs) {
+        mcrdma_error("Failed to allocate receive slabs");
+        goto err;
+    }
+    t->slab_mr = reg_mr(MCRDMA_MR_RECV, t->dev->pd, t->slab_mem,
+            (size_t)MCRDMA_SRQ_SIZE * MCRDMA_RECV_SLAB_SIZE, MCRDMA_BUF_ACCESS_FLAGS);
+    if(!t->slab_mr) {
+        mcrdma_error("Failed to register receive slabs memory region");
+        goto err;
+    }
+
+    for(int i = 0; i < MCRDMA_SRQ_SIZE; i++) {
+        t->slabs[i].buf = t->slab_mem + (size_t)i * MCRDMA_RECV_SLAB_SIZE;
+        t->slabs[i].next = t->free_slabs;
+        t->free_slabs = &t->slabs[i];
+    }
+    t->free_count = MCRDMA_SRQ_SIZE;
+
+    pthread_mutex_init(&t->stats_lock, NULL);
+
+    if(srq_refill(t, true) != 0) {
+        goto err;
+    }
+
+    event_set(&t->cq_event, t->comp_channel->fd, EV_READ | EV_PERSIST,
+            mcrdma_cq_handler, t);
+    event_base_set(me->base, &t->cq_event);
+    if(event_add(&t->cq_event, 0) == -1) {
+        mcrdma_error("Failed to monitor the completion channel");
+        goto err;
+    }
+
+    return t;
+err:
+    if(t->srq)
+        ibv_destroy_srq(t->srq);
+    if(t->slab_mr)
+        ibv_dereg_mr(t->slab_mr);
+    free(t->slabs);
+    free(t->slab_mem);
+    if(t->cq)
+        ibv_destroy_cq(t->cq);
+    if(t->comp_channel)
+        ibv_destroy_comp_channel(t->comp_channel);
+    free(t);
+    return NULL;
+}
+
+// Prepare a connection state and resources prior to accepting an incoming client
+static int prepare_connection(conn* c) {
+    struct mcrdma_state* s = c->rdma;
+    struct mcrdma_thread* t = c->rdma->thread;
+    s->outstanding = 0;
+
+    // Allocate send buffer
+    s->sbuf_head = 0;
+    s->sbuf_tail = 0;
+    s->send_head = 0;
+    s->send_tail = 0;
+    s->unsignaled = 0;
+    s->send_blocked = false;
+    s->write_state = MCRDMA_WRITE_NONE;
+    s->send_buf = buf_get(t->dev, s->sbuf_size);
+    if(!s->send_buf) {
+        mcrdma_error("Failed to allocate rdma send buffer");
+        return -1;
+    }
+    s->sbuf = s->send_buf->base;
+    s->sbuf_mr = s->send_buf->mr;
+
+    // Receives are served by the thread's SRQ
+    s->recv_head = NULL;
+    s->recv_tail = NULL;
+    s->recv_off = 0;
+
+    // Create Queue Pair on the CQ shared by the worker thread
+    struct ibv_qp_init_attr qp_init_attr = {0};
+    qp_init_attr.cap.max_send_sge = MCRDMA_MAX_SEND_SGE;
+    // Every slot of the send ring, plus a credit update and a drain
+    qp_init_attr.cap.max_send_wr = MCRDMA_SEND_RING_SIZE + 2;
+    qp_init_attr.qp_type = IBV_QPT_RC;
+
+    qp_init_attr.recv_cq = t->cq;
+    qp_init_attr.send_cq = t->cq;
+    qp_init_attr.srq = t->srq;
+
+    if (rdma_create_qp(s->id, t->dev->pd, &qp_init_attr)) {
+        mcrdma_error("Failed to create QP");
+        return -1;
+    }
+    s->qp_num = s->id->qp->qp_num;
+    qp_table_add(t, c);
+
+    return 0;
+}
+
+// Completed sends are done with the oldest count pinned items
+static void send_release(struct mcrdma_state *s, int count) {
+    for(int i = 0; i < count; i++) {
+        item_remove(s->pinned[i]);
+    }
+    s->pinned_count -= count;
+    if(s->pinned_count > 0) {
+        memmove(s->pinned, s->pinned + count, s->pinned_count * sizeof(item *));
+    }
+    s->pinned_released += count;
+}
+
+// The oldest send of the ring completed
+static void send_slot_release(struct mcrdma_state *s) {
+    struct mcrdma_send_slot *slot = &s->send_ring[s->send_tail % MCRDMA_SEND_RING_SIZE];
+
+    send_release(s, slot->pinned_end - s->pinned_released);
+    s->sbuf_tail = slot->sbuf_end;
+    s->send_tail++;
+
+    if(s->send_tail == s->send_head) {
+        // Nothing in flight, start over from the beginning of the buffer
+        s->sbuf_head = 0;
+        s->sbuf_tail = 0;
+    }
+}
+
+static void resources_destroy(struct mcrdma_state* s) {
+    mcrdma_log("Destroying resources\n");
+    send_release(s, s->pinned_count);
+    free(s->pinned);
+    free(s->write_line);
+    if(s->id && s->id->qp)
+        rdma_destroy_qp(s->id);
+    if(s->send_buf)
+        buf_put(s->send_buf);
+    if(s->id)
+        rdma_destroy_id(s->id);
+    if(s->echannel)
+        rdma_destroy_event_channel(s->echannel);
+    memset(s, 0, sizeof(*s));
+}
+
+// Hand the slabs a connection didn't get to read back to the SRQ
+static void recv_slabs_release(conn *c) {
+    struct mcrdma_state *s = c->rdma;
+    while(s->recv_head) {
+        struct mcrdma_recv_slab *slab = s->recv_head;
+        s->recv_head = slab->next;
+        slab_release(c->rdma->thread, slab);
+    }
+    s->recv_tail = NULL;
+    s->recv_off = 0;
+}
+
+conn *mcrdma_conn_new(struct rdma_cm_id *id, enum conn_states init_state,
+        const int read_buffer_size, LIBEVENT_THREAD *thread) {
+    conn *c;
+    struct mcrdma_state *s;
+    struct mcrdma_conn_request req = *(struct mcrdma_conn_request *)id->context;
+
+    free(id->context);
+    id->context = NULL;
+
+    // Connections are dispatched regardless of their device, the worker
+    // sets up its resources on each device it gets a connection from
+    struct mcrdma_thread *t = thread->rdma;
+    while(t && t->dev->verbs != id->verbs) {
+        t = t->next;
+    }
+    if(!t) {
+        t = mcrdma_thread_init(thread, id->verbs);
+        if(!t) {
+            rdma_reject(id, NULL, 0);
+            rdma_destroy_id(id);
+            return NULL;
+        }
+        t->next = thread->rdma;
+        thread->rdma = t;
+    }
+
+    // Every connection gets its own cm event channel, which both delivers
+    // disconnections to the owning worker and gives us a descriptor to index
+    // the conns array with.
+    struct rdma_event_channel *echannel = rdma_create_event_channel();
+    if(!echannel) {
+        mcrdma_error("Failed to create new event channel to migrate to");
+        rdma_reject(id, NULL, 0);
+        rdma_destroy_id(id);
+        return NULL;
+    }
+    int flags = fcntl(echannel->fd, F_GETFL, 0);
+    fcntl(echannel->fd, F_SETFL, flags | O_NONBLOCK);
+
+    if(rdma_migrate_id(id, echannel)) {
+        mcrdma_error("Failed to migrate to new event channel");
+        rdma_reject(id, NULL, 0);
+        rdma_destroy_id(id);
+        rdma_destroy_event_channel(echannel);
+        return NULL;
+    }
+
+    int sfd = echannel->fd;
+    if(sfd >= max_fds) {
+        // Same as running out of file descriptors on accept()
+        STATS_LOCK();
+        stats.rejected_conns++;
+        STATS_UNLOCK();
+        rdma_reject(id, NULL, 0);
+        rdma_destroy_id(id);
+        rdma_destroy_event_channel(echannel);
+        return NULL;
+    }
+    c = conns[sfd];
+
+    if(!c) {
+        c = calloc(1, sizeof(conn));
+        if(!c) {
+            STATS_LOCK();
+            stats.malloc_fails++;
+            STATS_UNLOCK();
+            mcrdma_log("Failed to allocate connection object\n");
+            rdma_reject(id, NULL, 0);
+            rdma_destroy_id(id);
+            rdma_destroy_event_channel(echannel);
+            return NULL;
+        }
+        MEMCACHED_CONN_CREATE(c);
+
+        STATS_LOCK();
+        stats_state.conn_structs++;
+        STATS_UNLOCK();
+
+        c->sfd = sfd;
+        conns[sfd] = c;
+    }
+
+    if(!c->rdma) {
+        c->rdma = calloc(1, sizeof(struct mcrdma_state));
+        if(!c->rdma) {
+            STATS_LOCK();
+            stats.malloc_fails++;
+            STATS_UNLOCK();
+            rdma_reject(id, NULL, 0);
+            rdma_destroy_id(id);
+            rdma_destroy_event_channel(echannel);
+            return NULL;
+        }
+    }
+    s = c->rdma;
+    s->id = id;
+    s->echannel = echannel;
+    s->thread = t;
+    s->sbuf_size = req.sbuf_size;
+    s->send_max = req.send_max;
+
+    c->thread = thread;
+    c->rsize = read_buffer_size;
+    c->rbytes = 0;
+    c->rbuf = (char *)malloc((size_t)c->rsize);
+    if(!c->rbuf) {
+        STATS_LOCK();
+        stats.malloc_fails++;
+        STATS_UNLOCK();
+        fprintf(stderr, "Failed to allocate buffers for connection\n");
+        rdma_reject(id, NULL, 0);
+        resources_destroy(s);
+        return NULL;
+    }
+    // Not from the thread's rbuf cache, make sure a generic close frees it
+    c->rbuf_malloced = true;
+    c->rcurr = c->rbuf;
+
+    c->transport = rdma_transport;
+    c->protocol = settings.binding_protocol;
+
+    struct sockaddr *peer = rdma_get_peer_addr(id);
+    if(peer->sa_family == AF_INET6) {
+        c->request_addr_size = sizeof(struct sockaddr_in6);
+    } else {
+        c->request_addr_size = sizeof(struct sockaddr_in);
+    }
+    memcpy(&c->request_addr, peer, c->request_addr_size);
+
+    c->read = mcrdma_read;
+    c->sendmsg = mcrdma_sendmsg;
+    c->write = NULL;
+
+    c->state = init_state;
+    c->rlbytes = 0;
+    c->cmd = -1;
+    c->ritem = 0;
+    c->item = 0;
+    c->item_malloced = false;
+    c->set_stale = false;
+    c->mset_res = false;
+    c->close_after_write = false;
+    c->noreply = false;
+    c->last_cmd_time = current_time;
+    c->recv_time = 0;
+    c->latency_op = LATENCY_NONE;
+    memset(c->io_queues, 0, sizeof(c->io_queues));
+    c->io_queues_submitted = 0;
+
+    // Same parsers as TCP: ascii, meta or binary as negotiated by the
+    // first byte, unless -B pins one
+    c->authenticated = false;
+    conn_init_protocol(c);
+
+    if(prepare_connection(c)) {
+        mcrdma_log("Connection preparation failed\n");
+        goto err;
+    }
+
+    event_set(&c->event, sfd, EV_READ | EV_PERSIST, mcrdma_cm_handler, (void *)c);
+    event_base_set(thread->base, &c->event);
+    c->ev_flags = EV_READ | EV_PERSIST;
+    if(event_add(&c->event, 0) == -1) {
+        perror("event_add");
+        goto err;
+    }
+
+    // Let the client know how much it can send at once
+    struct mcrdma_accept_data accept_data;
+    accept_data.version = htonl(MCRDMA_PROTO_VERSION);
+    accept_data.recv_size = htonl(MCRDMA_RECV_SLAB_SIZE);
+    accept_data.credits = htonl(MCRDMA_RECV_CREDITS);
+    accept_data.index_size = 0;
+    accept_data.index_addr = 0;
+    accept_data.index_rkey = 0;
+    accept_data.mem_rkey = 0;
+    accept_data.send_size = htonl(s->send_max);
+    accept_data.send_buf_size = htonl(s->sbuf_size);
+    uint32_t rkey = mcrdma_index_enabled() ? mem_rkey(t) : 0;
+    if(rkey) {
+        accept_data.index_size = htonl(mcrdma_index_size());
+        accept_data.index_addr = htobe64((uintptr_t)mcrdma_index_base());
+        accept_data.index_rkey = htonl(t->dev->index_mr->rkey);
+        accept_data.mem_rkey = htonl(rkey);
+    }
+
+    struct rdma_conn_param conn_param = {0};
+    conn_param.initiator_depth = 1;
+    // One-sided GETs issue RDMA READs against us
+    conn_param.responder_resources = rkey ? MCRDMA_MAX_READS : 1;
+    // The SRQ may be briefly empty under bursts, retry instead of failing
+    conn_param.rnr_retry_count = 7;
+    conn_param.private_data = &accept_data;
+    conn_param.private_data_len = sizeof(accept_data);
+
+    mcrdma_log("Accepting connection.\n");
+
+    if(rdma_accept(s->id, &conn_param) == -1) {
+        mcrdma_error("Cannot accept client");
+        event_del(&c->event);
+        goto err;
+    }
+
+    STATS_LOCK();
+    stats_state.curr_conns++;
+    stats.total_conns++;
+    STATS_UNLOCK();
+
+    if (settings.verbose > 1) {
+        fprintf(stderr, "<%d new rdma client connection.\n", sfd);
+    }
+
+    LOGGER_LOG(NULL, LOG_CONNEVENTS, LOGGER_CONNECTION_NEW, NULL,
+            &c->request_addr, c->request_addr_size, c->transport, 0, sfd);
+
+    MEMCACHED_CONN_ALLOCATE(c->sfd);
+
+    return c;
+err:
+    rdma_reject(id, NULL, 0);
+    // Nothing completed yet, the QP can go right away.
+    if(s->qp_num) {
+        qp_table_remove(t, c);
+    }
+    free(c->rbuf);
+    c->rbuf = NULL;
+    c->rsize = 0;
+    conn_set_state(c, conn_closed);
+    resources_destroy(s);
+    return NULL;
+}
+
+// Send WRs only carrying credits are told apart by the low bit of wr_id,
+// signaled response sends by the next one, drains by both. Unsignaled sends
+// only complete in error, and aren't counted as outstanding.
+#define CREDIT_UPDATE_WR_ID(c) ((uintptr_t)(c) | 1)
+#define SIGNALED_WR_ID(c) ((uintptr_t)(c) | 2)
+#define DRAIN_WR_ID(c) ((uintptr_t)(c) | 3)
+#define WR_ID_FLAGS 3
+
+// Posted once the QP is in the error state, flushed right away. Completions
+// of a QP come in order, so once the drain's is reaped no other one of the
+// connection is left on the CQ, unsignaled sends flushed along included.
+static bool post_drain(conn *c) {
+    struct mcrdma_state *s = c->rdma;
+    struct ibv_send_wr wr = {0};
+    struct ibv_send_wr *bad_wr = NULL;
+
+    wr.wr_id = DRAIN_WR_ID(c);
+    wr.opcode = IBV_WR_SEND;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.num_sge = 0;
+
+    if(ibv_post_send(s->id->qp, &wr, &bad_wr)) {
+        mcrdma_error("Failed posting drain");
+        return false;
+    }
+    s->outstanding++;
+    return true;
+}
+
+/*
+ * Tear a connection down. Work requests still in flight are flushed once the
+ * QP enters the error state, followed by a drain work request. Their
+ * completions go through the shared CQ and the drain's releases the
+ * connection resources.
+ */
+static void mcrdma_conn_close(conn *c) {
+    struct mcrdma_state *s = c->rdma;
+
+    LOGGER_LOG(c->thread->l, LOG_CONNEVENTS, LOGGER_CONNECTION_CLOSE, NULL,
+            &c->request_addr, c->request_addr_size, c->transport,
+            c->close_reason, c->sfd);
+
+    event_del(&c->event);
+
+    if (settings.verbose > 1)
+        fprintf(stderr, "<%d rdma connection closed.\n", c->sfd);
+
+    conn_release_items(c);
+
+    c->rbytes = 0;
+    if(c->rbuf) {
+        free(c->rbuf);
+        c->rbuf = NULL;
+        c->rcurr = NULL;
+        c->rsize = 0;
+        c->rbuf_malloced = false;
+    }
+
+    // Stop routing receive completions here, whatever is still queued on
+    // the SRQ for this QP gets recycled as it completes.
+    qp_table_remove(c->rdma->thread, c);
+    recv_slabs_release(c);
+
+    MEMCACHED_CONN_RELEASE(c->sfd);
+    conn_set_state(c, conn_closed);
+    c->close_reason = 0;
+
+    struct ibv_qp_attr attr = {0};
+    attr.qp_state = IBV_QPS_ERR;
+    if(s->id->qp) {
+        if(ibv_modify_qp(s->id->qp, &attr, IBV_QP_STATE)) {
+            mcrdma_error("Failed to move QP to the error state");
+        } else {
+            post_drain(c);
+        }
+    }
+    rdma_disconnect(s->id);
+
+    if(s->outstanding == 0) {
+        resources_destroy(s);
+    }
+
+    STATS_LOCK();
+    stats_state.curr_conns--;
+    STATS_UNLOCK();
+}
+
+// Connection management events of a single connection, e.g. disconnection
+static void mcrdma_cm_handler(evutil_socket_t fd, short which, void *arg) {
+    conn *c = arg;
+    struct mcrdma_state *s = c->rdma;
+    struct rdma_cm_event *cm_event = NULL;
+
+    while(c->state != conn_closed && rdma_get_cm_event(s->echannel, &cm_event) == 0) {
+        enum rdma_cm_event_type type = cm_event->event;
+        rdma_ack_cm_event(cm_event);
+
+        mcrdma_log("A new %s type event is received\n", rdma_event_str(type));
+        switch(type) {
+            case RDMA_CM_EVENT_ESTABLISHED:
+                break;
+            case RDMA_CM_EVENT_DISCONNECTED:
+                c->close_reason = NORMAL_CLOSE;
+                conn_set_state(c, conn_closing);
+                mcrdma_state_machine(c);
+                break;
+            case RDMA_CM_EVENT_DEVICE_REMOVAL:
+                // The QP is unusable from now on, whatever it was doing
+                c->close_reason = ERROR_CLOSE;
+                conn_set_state(c, conn_closing);
+                mcrdma_state_machine(c);
+                break;
+            case RDMA_CM_EVENT_TIMEWAIT_EXIT:
+                break;
+            default:
+                if(settings.verbose > 0) {
+                    fprintf(stderr, "<%d unexpected rdma cm event: %s\n", c->sfd,
+                            rdma_event_str(type));
+                }
+                break;
+        }
+    }
+
+    // Woken up after the state machine yielded rather than by a CM event
+    if(c->state == conn_new_cmd) {
+        mcrdma_state_machine(c);
+    }
+}
+
+void mcrdma_conn_readd(conn *c) {
+    c->ev_flags = EV_READ | EV_PERSIST;
+    if(event_add(&c->event, 0) == -1) {
+        perror("event_add");
+    }
 
-    // Select the interface
-    if(interface) {
-        if(!inet_pton(AF_INET, interface, &sockaddr.sin_addr)) {
-            mcrdma_log("Invalid interface address: %s\n", interface);
-            return -1;
-        }
+    if(c->state == conn_closing || c->state == conn_io_queue) {
+        mcrdma_state_machine(c);
     } else {
-        sockaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    }
-    
-    disp.echannel = rdma_create_event_channel();
-    if(!disp.echannel) {
-        mcrdma_error("cm channel creation error");
-        return -1;
+        conn_set_state(c, conn_new_cmd);
     }
+}
 
-    if(rdma_create_id(disp.echannel, &disp.id, NULL, RDMA_PS_TCP)) {
-        mcrdma_error("rdma id creationg error");
-        return -1;
-    }
+// Return the credits of consumed slabs without waiting for a response to
+// piggyback them on. Being signaled, its completion also accounts for the
+// sends posted before it, which is how a connection out of room to send gets
+// its unsignaled sends reaped (force).
+static void post_credit_update(conn *c, bool force) {
+    struct mcrdma_state *s = c->rdma;
+    struct mcrdma_thread *t = c->rdma->thread;
+    struct ibv_send_wr wr = {0};
+    struct ibv_send_wr *bad_wr = NULL;
 
-    if(rdma_bind_addr(disp.id, (struct sockaddr*) &sockaddr)) {
-        mcrdma_error("cannot bind address");
-        return -1;
+    if(s->credit_update_posted || (!force && s->credits_pending == 0)) {
+        return;
     }
 
-    if(rdma_listen(disp.id, MCRDMA_BACKLOG)) {
-        mcrdma_error("rdma_listen failed");
-        return -1;
+    wr.wr_id = CREDIT_UPDATE_WR_ID(c);
+    wr.opcode = IBV_WR_SEND_WITH_IMM;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.imm_data = htonl(s->credits_pending);
+    wr.num_sge = 0;
+
+    if(ibv_post_send(s->id->qp, &wr, &bad_wr)) {
+        mcrdma_error("Failed posting credit update");
+        return;
     }
-    
-    fprintf(stderr, "rdma server will listen for connections on %s:%d\n", inet_ntoa(sockaddr.sin_addr), port);
+    s->credits_pending = 0;
+    s->credit_update_posted = true;
+    s->credit_update_fence = s->send_head;
+    s->unsignaled = 0;
+    s->outstanding++;
+
+    pthread_mutex_lock(&t->stats_lock);
+    t->stats.credit_updates++;
+    pthread_mutex_unlock(&t->stats_lock);
+}
 
-    return 0;
+// A slab was fully read, the client gets to send another message
+static inline void slab_consumed(conn *c, struct mcrdma_recv_slab *slab) {
+    slab_release(c->rdma->thread, slab);
+    c->rdma->credits_pending++;
+}
+
+// The connection waits for side threads (e.g. extstore reads) and must not be
+// driven until conn_worker_readd() brings it back. Work completions are only
+// accounted for meanwhile: errors leave the QP broken, which the response
+// transmission then runs into.
+static inline bool io_queue_pending(conn *c) {
+    return c->state == conn_io_queue;
 }
 
-int mcrdma_listen() {
-    struct pollfd pfd;
-    pfd.fd = disp.echannel->fd;
-    pfd.events = POLLIN;
+// The client is done writing the value of a write set
+static void write_set_done(conn *c, uint32_t token) {
+    struct mcrdma_state *s = c->rdma;
+    struct mcrdma_thread *t = c->rdma->thread;
 
-    int res = poll(&pfd, 1, MCRDMA_DISPATCHER_POLL_TIMEOUT_MS);
-    if(res > 0) {
-        struct rdma_cm_event *cm_event = NULL;
-        if(mcrdma_process_event(disp.echannel, 
-                RDMA_CM_EVENT_CONNECT_REQUEST, &cm_event)) {
-            mcrdma_error("failed to process cm event");
-            return -errno;
+    if(s->write_state != MCRDMA_WRITE_WAIT || token != s->write_token) {
+        if(settings.verbose > 0) {
+            fprintf(stderr, "<%d unexpected rdma write\n", c->sfd);
         }
-        mcrdma_log("client establishing a connection\n");
+        if(io_queue_pending(c)) {
+            c->close_after_write = true;
+            return;
+        }
+        c->close_reason = ERROR_CLOSE;
+        conn_set_state(c, conn_closing);
+        mcrdma_state_machine(c);
+        return;
+    }
 
+    pthread_mutex_lock(&t->stats_lock);
+    t->stats.write_sets++;
+    t->stats.write_set_bytes += c->rlbytes;
+    pthread_mutex_unlock(&t->stats_lock);
 
-        conn *c = mcrdma_conn_new(conn_read, MCRDMA_BUF_SIZE);
-        c->thread = calloc(1, sizeof(LIBEVENT_THREAD));
-        mcrdma_libevent_thread_init(c->thread);
-        c->rdma->id = cm_event->id;
+    s->write_state = MCRDMA_WRITE_NONE;
+    c->rlbytes = 0;
+    mcrdma_state_machine(c);
+}
 
-        if (rdma_ack_cm_event(cm_event)) {
-		    mcrdma_error("Failed to acknowledge cm event\n");
-		    return 0;
-	    }
+static void handle_recv_wc(struct mcrdma_thread *t, struct ibv_wc *wc) {
+    struct mcrdma_recv_slab *slab = (struct mcrdma_recv_slab*)(uintptr_t) wc->wr_id;
+    conn *c = qp_table_find(t, wc->qp_num);
 
-        pthread_create(&c->thread->thread_id, NULL, mcrdma_worker, c);
+    t->srq_depth--;
+    if(t->srq_depth == 0) {
+        pthread_mutex_lock(&t->stats_lock);
+        t->stats.empty++;
+        pthread_mutex_unlock(&t->stats_lock);
     }
-    return res;
-}
-
-// Prepare a connection state and resources prior to accepting an incoming client
-static int prepare_connection(conn* c) {
-    struct mcrdma_state* s = c->rdma;
-    s->pinged = false;
 
-    // Create a Protection Domain
-    s->pd = ibv_alloc_pd(s->id->verbs);
-	if (!s->pd) {
-		mcrdma_error("Failed to allocate PD");
-		return -1;
-	}
+    if(!c || c->state == conn_closed) {
+        slab_release(t, slab);
+        return;
+    }
 
-    // Allocate send buffer
-    s->sbuf = malloc(MCRDMA_BUF_SIZE);
-    if(!s->sbuf) {
-        mcrdma_error("Failed to allocate rdma send buffer");
-        return -1;
+    if(wc->status != IBV_WC_SUCCESS) {
+        slab_release(t, slab);
+        if(settings.verbose > 0) {
+            fprintf(stderr, "<%d receive completion error: %s\n", c->sfd,
+                    ibv_wc_status_str(wc->status));
+        }
+        if(io_queue_pending(c)) {
+            return;
+        }
+        c->close_reason = ERROR_CLOSE;
+        conn_set_state(c, conn_closing);
+        mcrdma_state_machine(c);
+        return;
     }
-    s->sbuf_size = MCRDMA_BUF_SIZE;
-    s->sbuf_mr = ibv_reg_mr(s->pd, s->sbuf, s->sbuf_size, MCRDMA_BUF_ACCESS_FLAGS);
-    if(!s->sbuf_mr) {
-        mcrdma_error("Failed to register send buffer memory region");
-        return -1;
+
+    struct mcrdma_state *s = c->rdma;
+    if(wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+        // The value of a write set landed in its item, the slab itself
+        // holds nothing
+        slab_consumed(c, slab);
+        write_set_done(c, ntohl(wc->imm_data));
+        return;
     }
 
-    // Allocate receive buffer
-    s->rbuf_posted = false;
-    s->rbuf_size = MCRDMA_BUF_SIZE;
-    s->rbuf = malloc(MCRDMA_BUF_SIZE);
-    if(!s->rbuf) {
-        mcrdma_error("Failed to allocate rdma receive buffer");
-        return -1;
+    slab->len = wc->byte_len;
+    slab->next = NULL;
+    if(s->recv_tail) {
+        s->recv_tail->next = slab;
+    } else {
+        s->recv_head = slab;
     }
-    s->rbuf_mr = ibv_reg_mr(s->pd, s->rbuf, s->rbuf_size, MCRDMA_BUF_ACCESS_FLAGS);
-    if(!s->rbuf_mr) {
-        mcrdma_error("Failed to register receive buffer memory region");
-        return -1;
+    s->recv_tail = slab;
+    mcrdma_log("Received %d bytes\n", wc->byte_len);
+
+    if(!io_queue_pending(c)) {
+        mcrdma_state_machine(c);
     }
+}
 
-    // Create Completion Queue
-	s->comp_channel = ibv_create_comp_channel(s->id->verbs);
-	if (!s->comp_channel) {
-		mcrdma_error("Failed to create IO completion event channel");
-	    return -1;
-	}
-    
-    int flags = fcntl(s->comp_channel->fd, F_GETFL, 0);
-    fcntl(s->comp_channel->fd, F_SETFL, flags | O_NONBLOCK);
-
-    s->client_cq = ibv_create_cq(s->id->verbs, 16, NULL, s->comp_channel, 0);
-	if (!s->client_cq) {
-		mcrdma_error("Failed to create CQ");
-		return -1;
-	}
-
-	// if (ibv_req_notify_cq(s->client_cq, 0)) {
-	// 	mcrdma_error("Failed to request notifications");
-	// 	return -1;
-	// }
-
-    // Create Queue Pair
-    struct ibv_qp_init_attr qp_init_attr = {0};
-    qp_init_attr.cap.max_recv_sge = 16;
-    qp_init_attr.cap.max_send_sge = 16;
-    qp_init_attr.cap.max_recv_wr = 32;
-    qp_init_attr.cap.max_send_wr = 32;
-    qp_init_attr.qp_type = IBV_QPT_RC;
+static void handle_wc(struct mcrdma_thread *t, struct ibv_wc *wc) {
+    if(wr_is_recv(t, wc->wr_id)) {
+        handle_recv_wc(t, wc);
+        return;
+    }
 
-    qp_init_attr.recv_cq = s->client_cq;
-    qp_init_attr.send_cq = s->client_cq;
+    uint64_t flags = wc->wr_id & WR_ID_FLAGS;
+    conn *c = (conn*)(uintptr_t)(wc->wr_id & ~(uint64_t)WR_ID_FLAGS);
+    struct mcrdma_state *s = c->rdma;
+    bool credit_update = wc->wr_id == CREDIT_UPDATE_WR_ID(c);
+
+    // Sends complete in order, flushed or not: a signaled completion also
+    // stands for every send posted before it. Unsignaled sends only show up
+    // here in error, their slots are left to the next signaled completion.
+    if(credit_update) {
+        s->outstanding--;
+        s->credit_update_posted = false;
+        while(s->send_tail != s->credit_update_fence) {
+            send_slot_release(s);
+        }
+    } else if(wc->wr_id == DRAIN_WR_ID(c)) {
+        // Drained, everything posted before is done with
+        s->outstanding--;
+        while(s->send_tail != s->send_head) {
+            send_slot_release(s);
+        }
+    } else if(flags != 0) {
+        s->outstanding--;
+        bool signaled;
+        do {
+            signaled = s->send_ring[s->send_tail % MCRDMA_SEND_RING_SIZE].signaled;
+            send_slot_release(s);
+        } while(!signaled && s->send_tail != s->send_head);
+    }
+    if(c->state == conn_closed) {
+        // Flushed work request of a connection that is already gone
+        if(flags != 0 && s->outstanding == 0) {
+            resources_destroy(s);
+        }
+        return;
+    }
 
-	if (rdma_create_qp(s->id, s->pd, &qp_init_attr)) {
-		mcrdma_error("Failed to create QP");
-	    return -1;
-	}
+    if(wc->status != IBV_WC_SUCCESS) {
+        if(settings.verbose > 0) {
+            fprintf(stderr, "<%d work completion error: %s\n", c->sfd,
+                    ibv_wc_status_str(wc->status));
+        }
+        if(io_queue_pending(c)) {
+            return;
+        }
+        c->close_reason = ERROR_CLOSE;
+        conn_set_state(c, conn_closing);
+        mcrdma_state_machine(c);
+        return;
+    }
 
-    // Create new Event Channel and migrate
-    struct rdma_event_channel *echannel = rdma_create_event_channel();
-    if(!echannel) {
-        mcrdma_error("Failed to create new event channel to migrate to");
-        return -1;
+    // More slabs may have been consumed meanwhile
+    if(credit_update && s->credits_pending >= MCRDMA_CREDIT_UPDATE_THRESHOLD) {
+        post_credit_update(c, false);
     }
-    flags = fcntl(echannel->fd, F_GETFL, 0);
-    fcntl(echannel->fd, F_SETFL, flags | O_NONBLOCK);
 
+    if(s->send_blocked) {
+        s->send_blocked = false;
+        mcrdma_state_machine(c);
+    }
+}
 
-    if(rdma_migrate_id(s->id, echannel)) {
-        mcrdma_error("Failed to migrate to new event channel");
-        return -1;
+// Reap all the work completions available on the CQ of a worker thread
+static void mcrdma_cq_handler(evutil_socket_t fd, short which, void *arg) {
+    struct mcrdma_thread *t = arg;
+    struct ibv_cq *ev_cq;
+    void *ev_ctx;
+    struct ibv_wc wc[MCRDMA_WC_BATCH];
+    int n;
+    bool woken = false;
+    bool armed = false;
+    int budget = MCRDMA_POLL_BUDGET;
+    uint64_t poll_hits = 0;
+
+    if(ibv_get_cq_event(t->comp_channel, &ev_cq, &ev_ctx) == 0) {
+        ibv_ack_cq_events(ev_cq, 1);
+        woken = true;
     }
 
-    s->echannel = echannel;
+    /*
+     * Reap completions, then keep polling the CQ for rdma_poll_us after the
+     * last one before going back to sleep: a busy connection is served
+     * without paying for interrupts and wakeups, an idle one costs nothing.
+     * Polling goes through the event loop, the handler activating itself
+     * again after each empty poll, so the other events of the thread aren't
+     * held up meanwhile.
+     * Notifications are only armed when going to sleep. After arming, the
+     * CQ is checked once more so that a completion landing in between is
+     * either reaped or wakes us up again.
+     */
+    while(true) {
+        n = ibv_poll_cq(t->cq, MCRDMA_WC_BATCH, wc);
+        if(n < 0) {
+            mcrdma_error("Failed to poll CQ for WC");
+            break;
+        }
 
+        if(n > 0) {
+            for(int i = 0; i < n; i++) {
+                handle_wc(t, &wc[i]);
+            }
+            if(t->idle_since != 0) {
+                poll_hits++;
+                t->idle_since = 0;
+            }
+            if(!armed && --budget == 0) {
+                // Let the other events of the thread through, we're
+                // called again right away
+                event_active(&t->cq_event, EV_READ, 1);
+                break;
+            }
+            continue;
+        }
 
-    return 0;
-}
+        if(armed) {
+            break;
+        }
 
-static void resources_destroy(struct mcrdma_state* s) {
-    mcrdma_log("Destroying resources\n");
-    rdma_destroy_qp(s->id);
-    ibv_destroy_cq(s->client_cq);
-    ibv_destroy_comp_channel(s->comp_channel);
-    ibv_dereg_mr(s->rbuf_mr);
-    free(s->rbuf);
-    ibv_dereg_mr(s->sbuf_mr);
-    free(s->sbuf);
-    ibv_dealloc_pd(s->pd);
-    rdma_destroy_event_channel(s->echannel);
-    rdma_destroy_id(s->id);
+        if(settings.rdma_poll_us > 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            uint64_t now = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+            if(t->idle_since == 0) {
+                t->idle_since = now;
+            }
+            if(now - t->idle_since < (uint64_t)settings.rdma_poll_us) {
+                event_active(&t->cq_event, EV_READ, 1);
+                break;
+            }
+        }
+
+        if(ibv_req_notify_cq(t->cq, 0)) {
+            mcrdma_error("Failed to request notifications");
+        }
+        t->idle_since = 0;
+        armed = true;
+    }
+
+    srq_refill(t, t->srq_depth < MCRDMA_SRQ_LOW_WATERMARK);
+
+    pthread_mutex_lock(&t->stats_lock);
+    t->stats.depth = t->srq_depth;
+    t->stats.held = MCRDMA_SRQ_SIZE - t->srq_depth - t->free_count;
+    if(woken) {
+        t->stats.cq_wakeups++;
+    }
+    t->stats.cq_poll_hits += poll_hits;
+    pthread_mutex_unlock(&t->stats_lock);
 }
 
-static inline int post_rbuf(conn *c, size_t count) {
-    return rdma_post_recv(c->rdma->id, NULL, c->rdma->rbuf, count, c->rdma->rbuf_mr);
+/*
+ * Write sets. The value of "set <key> <flags> <exptime> <bytes> rdma" isn't
+ * sent after the command: the item is allocated right away and the client
+ * is told where it goes with
+ *
+ * WRITE <token> <addr> <rkey> <len>[ <addr> <rkey> <len>...]\r\n
+ *
+ * one segment per chunk of the item. The client RDMA writes the value and
+ * its "\r\n" over the segments in order, the last write carrying the token
+ * as immediate, and the set completes as usual.
+ */
+
+static int write_set_segment(conn *c, char *ptr, size_t len) {
+    struct mcrdma_state *s = c->rdma;
+    struct ibv_mr *mr = mem_lookup(c->rdma->thread, ptr, len);
+    if(!mr) {
+        return -1;
+    }
+    s->write_len += snprintf(s->write_line + s->write_len,
+            MCRDMA_WRITE_LINE_SIZE - s->write_len, " %llu %u %zu",
+            (unsigned long long)(uintptr_t)ptr, mr->rkey, len);
+    return 0;
 }
 
-void *mcrdma_worker(void* arg) {
-    mcrdma_log("Started worker thread.\n");
-    conn *c = (conn*) arg;
+int mcrdma_write_set(conn *c) {
     struct mcrdma_state *s = c->rdma;
+    item *it = c->item;
 
-    // Final LIBEVENT_THREAD initialization
-    c->thread->l = logger_create();
-    c->thread->lru_bump_buf = item_lru_bump_buf_create();
-    if (c->thread->l == NULL || c->thread->lru_bump_buf == NULL) {
-        abort();
+    if(!s->write_line) {
+        s->write_line = malloc(MCRDMA_WRITE_LINE_SIZE);
+        if(!s->write_line) {
+            return -1;
+        }
     }
 
-    if(prepare_connection(c)) {
-        mcrdma_log("Connection preparation failed\n");
-        return (void*) -1;
+    if(++s->write_token == 0) {
+        s->write_token = 1;
     }
+    s->write_len = snprintf(s->write_line, MCRDMA_WRITE_LINE_SIZE, "WRITE %u", s->write_token);
 
-    mcrdma_log("Pre-posting recv buffer\n");
-    if(post_rbuf(c, s->rbuf_size)) {
-        mcrdma_error("Failed to pre-post recv buffer");
-        return (void*) -1;
+    if((it->it_flags & ITEM_CHUNKED) == 0) {
+        if(write_set_segment(c, c->ritem, c->rlbytes) != 0) {
+            return -1;
+        }
+    } else {
+        // Allocate every chunk upfront, like read_into_chunked_item() does
+        // while reading
+        item_chunk *ch = (item_chunk *)c->ritem;
+        int remaining = c->rlbytes;
+        int nsegs = 0;
+        while(remaining > 0) {
+            if(ch->size == ch->used) {
+                ch = do_item_alloc_chunk(ch, remaining);
+                if(!ch) {
+                    return -1;
+                }
+            }
+            int len = ch->size - ch->used;
+            if(len > remaining) {
+                len = remaining;
+            }
+            if(nsegs++ == MCRDMA_WRITE_MAX_SEGS
+                    || write_set_segment(c, ch->data + ch->used, len) != 0) {
+                return -1;
+            }
+            ch->used += len;
+            remaining -= len;
+        }
+        // complete_nread() looks for the "\r\n" in the last chunk
+        c->ritem = (char *)ch;
     }
-    s->rbuf_posted = true;
 
-    struct rdma_conn_param conn_param = {0};
-	conn_param.initiator_depth = 1;
-	conn_param.responder_resources = 1;
-
-    mcrdma_log("Accepting connection.\n");
+    s->write_len += snprintf(s->write_line + s->write_len,
+            MCRDMA_WRITE_LINE_SIZE - s->write_len, "\r\n");
+    s->write_state = MCRDMA_WRITE_ANNOUNCE;
+    return 0;
+}
 
-    if(rdma_accept(s->id, &conn_param) == -1) {
-        mcrdma_error("Cannot accept client");
-        return (void*) -1;
+// Tell the client where to write, once there's room to send
+static int write_set_announce(conn *c) {
+    struct mcrdma_state *s = c->rdma;
+    if(s->write_state != MCRDMA_WRITE_ANNOUNCE) {
+        return 0;
     }
 
-    struct rdma_cm_event *cm_event = NULL;
-    if(mcrdma_process_event(s->echannel, 
-            RDMA_CM_EVENT_ESTABLISHED, &cm_event)) {
-        mcrdma_error("Failed to process cm event");
-        return (void*) -1;
+    struct iovec iov[1];
+    iov[0].iov_base = s->write_line;
+    iov[0].iov_len = s->write_len;
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    if(c->sendmsg(c, &msg, 0) < 0) {
+        // The send completion brings us back here
+        return errno == EAGAIN ? 0 : -1;
     }
 
-    mcrdma_log("Connection established!\n");
-
-    mcrdma_state_machine(c);
-
-    mcrdma_conn_destroy(c);
-    return NULL;
+    s->write_state = MCRDMA_WRITE_WAIT;
+    return 0;
 }
 
 // This is a modified version of the drive_machine() function in memcached.c
@@ -265,6 +1760,7 @@ void mcrdma_state_machine(conn* c) {
     bool stop = false;
     //struct ibv_wc wc = {0};
     ssize_t res = 0;
+    int nreqs = settings.reqs_per_event;
 
 
     while(!stop) {
@@ -274,8 +1770,11 @@ void mcrdma_state_machine(conn* c) {
             // States ignored: conn_listening
 
             case conn_waiting:
+                // Nothing to read yet, the next receive completion will bring
+                // us back here.
                 conn_set_state(c, conn_read);
-                //break;
+                stop = true;
+                break;
 
             case conn_read:
 
@@ -283,7 +1782,7 @@ void mcrdma_state_machine(conn* c) {
 
                 switch (res) {
                     case READ_NO_DATA_RECEIVED:
-                        conn_set_state(c, conn_read);
+                        conn_set_state(c, conn_waiting);
                         break;
                     case READ_DATA_RECEIVED:
                         conn_set_state(c, conn_parse_cmd);
@@ -308,23 +1807,48 @@ void mcrdma_state_machine(conn* c) {
                         conn_set_state(c, conn_mwrite);
                     } else {
                         mcrdma_log("Go read more\n");
-                        conn_set_state(c, conn_read);
+                        conn_set_state(c, conn_waiting);
                     }
                 }
                 break;
 
             case conn_new_cmd:
-                // We don't care about starving other connections or interfacing with Libevent,
-                // we never yield
-                reset_cmd_handler(c);
+                // Only process nreqs at a time, the worker's other
+                // connections, TCP or RDMA, get their turn in between
+                --nreqs;
+                if(nreqs >= 0) {
+                    reset_cmd_handler(c);
+                } else if(c->resp_head) {
+                    // flush response pipe on yield.
+                    conn_set_state(c, conn_mwrite);
+                } else {
+                    pthread_mutex_lock(&c->thread->stats.mutex);
+                    c->thread->stats.conn_yields++;
+                    pthread_mutex_unlock(&c->thread->stats.mutex);
+                    // No receive completion may be coming for what is
+                    // already buffered, come back through the CM handler
+                    event_active(&c->event, EV_READ, 1);
+                    stop = true;
+                }
                 break;
-                
+
             case conn_nread:
                 if (c->rlbytes == 0) {
                     complete_nread(c);
                     break;
                 }
 
+                if (c->rdma->write_state != MCRDMA_WRITE_NONE) {
+                    // The client writes the value itself, its write with
+                    // immediate brings rlbytes down to 0
+                    if (write_set_announce(c) != 0) {
+                        conn_set_state(c, conn_closing);
+                        break;
+                    }
+                    stop = true;
+                    break;
+                }
+
                 /* Check if rbytes < 0, to prevent crash */
                 if (c->rlbytes < 0) {
                     if (settings.verbose) {
@@ -374,7 +1898,8 @@ void mcrdma_state_machine(conn* c) {
                 }
 
                 if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                    conn_set_state(c, conn_closing);
+                    // Wait for the rest of the value to arrive
+                    stop = true;
                     break;
                 }
 
@@ -433,7 +1958,7 @@ void mcrdma_state_machine(conn* c) {
                     break;
                 }
                 if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                    conn_set_state(c, conn_closing);
+                    stop = true;
                     break;
                 }
                 /* otherwise we have a real error, on which we close the connection */
@@ -458,7 +1983,11 @@ void mcrdma_state_machine(conn* c) {
                     }
                 }
                 if (c->io_queues_submitted != 0) {
+                    // Completions keep coming in meanwhile, see
+                    // io_queue_pending(). CM events wait for the IOs to be
+                    // back, just like socket events do.
                     conn_set_state(c, conn_io_queue);
+                    event_del(&c->event);
                     stop = true;
                     break;
                 }
@@ -484,6 +2013,8 @@ void mcrdma_state_machine(conn* c) {
                         break;                   /* Continue in state machine. */
 
                     case TRANSMIT_SOFT_ERROR:
+                        // The send buffer is still in flight, the send
+                        // completion resumes the transmission
                         stop = true;
                         break;
                 }
@@ -491,7 +2022,7 @@ void mcrdma_state_machine(conn* c) {
 
             case conn_closing:
                 mcrdma_log("CLOSING\n");
-                conn_set_state(c, conn_closed);
+                mcrdma_conn_close(c);
                 stop = true;
                 break;
 
@@ -522,177 +2053,487 @@ void mcrdma_state_machine(conn* c) {
 
 static ssize_t mcrdma_read(conn *c, void *buf, size_t count) {
     assert (c != NULL);
-    struct ibv_wc wc = {0};
-    if(!c->rdma->rbuf_posted) {
-        if(post_rbuf(c, count)) {
-            mcrdma_error("Failed to post non pre-posted recv\n");
-            return -1;
-        }
-    }
-    
-    if(poll_wce(c->rdma, &wc, 1) == -1) {
-        return 0;
+    struct mcrdma_state *s = c->rdma;
+
+    if(!s->recv_head) {
+        errno = EAGAIN;
+        return -1;
     }
-    
 
-    // Check for PING PONG
-    if(c->rdma->rbuf[0] == 'P') {
-        // Pre-post for next request
-        if(post_rbuf(c, count)) {
-            mcrdma_error("Failed to pre-post recv\n");
-            c->rdma->rbuf_posted = false;
-            return -1;
+    // Put read data in destination, slabs are recycled as soon as they're
+    // drained, the rest is kept for the next read
+    size_t copied = 0;
+    while(copied < count && s->recv_head) {
+        struct mcrdma_recv_slab *slab = s->recv_head;
+        size_t len = slab->len - s->recv_off;
+        if(len > count - copied) {
+            len = count - copied;
         }
+        memcpy((char*)buf + copied, slab->buf + s->recv_off, len);
+        copied += len;
+        s->recv_off += len;
+
+        if(s->recv_off == slab->len) {
+            s->recv_head = slab->next;
+            if(!s->recv_head) {
+                s->recv_tail = NULL;
+            }
+            s->recv_off = 0;
+            slab_consumed(c, slab);
+        }
+    }
 
-        struct iovec iov[1];
-        iov[0].iov_base = "PONG\r\n";
-        iov[0].iov_len = 6;
-        struct msghdr msg;
-        msg.msg_name = NULL;
-        msg.msg_namelen = 0;
-        msg.msg_iov = iov;
-        msg.msg_iovlen = 1;
-        msg.msg_control = NULL;
-        msg.msg_controllen = 0;
-        msg.msg_flags = 0;
-        c->sendmsg(c, &msg, 0);
+    // Don't leave a client doing a large upload starved of credits
+    if(s->credits_pending >= MCRDMA_CREDIT_UPDATE_THRESHOLD) {
+        post_credit_update(c, false);
+    }
 
-        c->rdma->pinged = true;
+    return copied;
+}
 
-        return wc.byte_len;
+// Take a reference on every item the responses being sent point at
+static int send_pin_items(conn *c) {
+    struct mcrdma_state *s = c->rdma;
+    for(mc_resp *resp = c->resp_head; resp; resp = resp->next) {
+        if(!resp->item) {
+            continue;
+        }
+        if(s->pinned_count == s->pinned_size) {
+            int new_size = s->pinned_size ? s->pinned_size * 2 : 16;
+            item **n = realloc(s->pinned, new_size * sizeof(item *));
+            if(!n) {
+                return -1;
+            }
+            s->pinned = n;
+            s->pinned_size = new_size;
+        }
+        refcount_incr(resp->item);
+        s->pinned[s->pinned_count++] = resp->item;
     }
+    return 0;
+}
 
-    // Put read data in destination
-    memcpy(buf, c->rdma->rbuf, wc.byte_len);
-    
-    // Pre-post for next request
-    if(post_rbuf(c, count)) {
-        mcrdma_error("Failed to pre-post recv\n");
-        c->rdma->rbuf_posted = false;
-        return -1;
+// Whether response data can be sent from where it is. Values fetched from
+// extstore are owned by their IO object, which is gone once the response
+// completes, so those are always copied.
+static bool send_zero_copy_ok(conn *c) {
+    for(mc_resp *resp = c->resp_head; resp; resp = resp->next) {
+        if(resp->io_pending) {
+            return false;
+        }
     }
+    return true;
+}
 
-    mcrdma_log("Received %d bytes\n", wc.byte_len);
-
-    return wc.byte_len;
+// No room left to send. The last send may well be unsignaled, in which case
+// nothing would ever complete without asking for it.
+static void send_wait(conn *c) {
+    struct mcrdma_state *s = c->rdma;
+    s->send_blocked = true;
+    if(s->unsignaled > 0) {
+        post_credit_update(c, true);
+    }
 }
 
+/*
+ * Response data living in registered slab memory is sent as is: its SGE
+ * points straight at the item and the item is pinned until the send
+ * completes. Everything else (headers, small values, ...) is copied into the
+ * send buffer.
+ *
+ * Sends don't wait for each other: each one takes a slot of the send ring
+ * and a contiguous chunk of the send buffer, both given back once a later
+ * signaled send completes. Only when there's no room left is EAGAIN
+ * returned, the state machine then waits for a send completion.
+ *
+ * A send carries at most what the client can receive at once, what fits in
+ * the send buffer and MCRDMA_MAX_SEND_SGE pieces. Whatever is left is
+ * flagged with MCRDMA_IMM_MORE and goes with the next send. Up to
+ * MCRDMA_SEND_BATCH such sends are chained and posted at once, so that a
+ * multiget of many items rings the doorbell once rather than once per
+ * handful of SGEs. What still doesn't fit is sent next, as for a short
+ * write on a socket.
+ */
 static ssize_t mcrdma_sendmsg(conn *c, struct msghdr *msg, int flags) {
+    struct mcrdma_state *s = c->rdma;
+    struct mcrdma_thread *t = c->rdma->thread;
+    struct ibv_send_wr wrs[MCRDMA_SEND_BATCH];
+    struct ibv_sge sges[MCRDMA_SEND_BATCH][MCRDMA_MAX_SEND_SGE];
+    uint64_t sbuf_ends[MCRDMA_SEND_BATCH];
+    struct ibv_mr *zc_mrs[MCRDMA_SEND_BATCH * MCRDMA_MAX_SEND_SGE];
+    int zc_iovs[MCRDMA_SEND_BATCH * MCRDMA_MAX_SEND_SGE];
+    int nzc = 0;
+    int nwr = 0;
+    size_t to_copy = 0;
+    size_t first_copy = 0;
+    size_t copied = 0;
+    size_t zero_copy = 0;
+    bool more = false;
     ssize_t len = 0;
-    for(int i = 0; i < msg->msg_iovlen; i++) {
-        struct iovec iov = msg->msg_iov[i];
-        int off = len;
-        len += iov.iov_len;
 
+    int max_wr = MCRDMA_SEND_RING_SIZE - (s->send_head - s->send_tail);
+    if(max_wr == 0) {
+        send_wait(c);
+        errno = EAGAIN;
+        return -1;
+    }
+    if(max_wr > MCRDMA_SEND_BATCH) {
+        max_wr = MCRDMA_SEND_BATCH;
+    }
 
-        if(len > c->rdma->sbuf_size) {
-            fprintf(stderr, "1\n");
-            mcrdma_log("Scatter-gather sendmsg does not fit the rdma send buffer!\n");
-            return -1;
+    // Find out what can be sent in place first, so that the copied part
+    // is known before taking room in the send buffer. This is an upper
+    // bound, the sends may end up carrying less.
+    bool zc_ok = send_zero_copy_ok(c);
+    size_t budget = s->send_max * max_wr;
+    for(int i = 0; i < msg->msg_iovlen && budget > 0; i++) {
+        struct iovec *iov = &msg->msg_iov[i];
+        struct ibv_mr *mr = NULL;
+        size_t iov_len = iov->iov_len < budget ? iov->iov_len : budget;
+
+        if(zc_ok && nzc < MCRDMA_SEND_BATCH * MCRDMA_MAX_SEND_SGE
+                && iov_len >= MCRDMA_ZERO_COPY_MIN) {
+            mr = mem_lookup(t, iov->iov_base, iov_len);
         }
+        if(mr) {
+            zc_mrs[nzc] = mr;
+            zc_iovs[nzc] = i;
+            nzc++;
+        } else {
+            to_copy += iov_len;
+            if(budget > s->send_max * (max_wr - 1)) {
+                // Within the first send
+                size_t first = budget - s->send_max * (max_wr - 1);
+                first_copy += iov_len < first ? iov_len : first;
+            }
+        }
+        budget -= iov_len;
+    }
 
-        memcpy(c->rdma->sbuf + off, iov.iov_base, iov.iov_len);
-
-        mcrdma_log("out: %.*s", (int)iov.iov_len, (char*)iov.iov_base);
+    // The copied part must be contiguous, skip the end of the buffer if it
+    // is too short. If the first send doesn't fit either way, wait for the
+    // sends in flight and then split it over the larger of the two. The
+    // chain stops wherever the room does.
+    uint64_t head = s->sbuf_head;
+    size_t pos = head % s->sbuf_size;
+    size_t avail = s->sbuf_size - (head - s->sbuf_tail);
+    size_t room = avail < s->sbuf_size - pos ? avail : s->sbuf_size - pos;
+    size_t wrap_room = avail - room;
+    bool idle = head == s->sbuf_tail;
+    bool wrap = false;
+    if(to_copy > room) {
+        if(to_copy <= wrap_room) {
+            wrap = true;
+        } else if(first_copy > room) {
+            if(first_copy <= wrap_room || (idle && wrap_room > room)) {
+                wrap = true;
+            } else if(!idle) {
+                send_wait(c);
+                errno = EAGAIN;
+                return -1;
+            }
+        }
     }
-    
-    if(rdma_post_send(c->rdma->id, NULL, c->rdma->sbuf, len, c->rdma->sbuf_mr, IBV_SEND_SIGNALED)) {
-        fprintf(stderr, "2\n");
-        mcrdma_error("Failed posting send");
-        return -1;
+    if(wrap) {
+        head += s->sbuf_size - pos;
+        pos = 0;
+        room = wrap_room;
     }
 
-    struct ibv_wc wc = {0};
-
-    int num_wc = poll_wce(c->rdma, &wc, 1);
-    if(num_wc < 0) {
-        fprintf(stderr, "3\n");
-        mcrdma_error("Failed to process work completion events. Returned with value %d", num_wc);
-        return -1;
-    }
+    char *dst = s->sbuf + pos;
+    int i = 0, zc = 0;
+    size_t off = 0; // bytes of iov i already sent
+    bool full = false;
+    while(nwr < max_wr && !full) {
+        struct ibv_sge *sg = sges[nwr];
+        int nsge = 0;
+        size_t wr_len = 0;
+
+        budget = s->send_max;
+        for(; i < msg->msg_iovlen; i++, off = 0) {
+            struct iovec iov = msg->msg_iov[i];
+            bool is_zc = zc < nzc && zc_iovs[zc] == i;
+
+            if(off == iov.iov_len) {
+                zc += is_zc;
+                continue;
+            }
+            if(budget == 0) {
+                break;
+            }
+            size_t n = iov.iov_len - off < budget ? iov.iov_len - off : budget;
 
-    mcrdma_log("Recieved %d WCs\n", num_wc);
+            if(is_zc) {
+                if(nsge == MCRDMA_MAX_SEND_SGE) {
+                    break;
+                }
+                sg[nsge].addr = (uintptr_t)iov.iov_base + off;
+                sg[nsge].length = n;
+                sg[nsge].lkey = zc_mrs[zc]->lkey;
+                nsge++;
+                zero_copy += n;
+            } else {
+                if(n > room - copied) {
+                    n = room - copied;
+                }
+                // Grow the previous SGE if it covers the bytes copied just before
+                bool grow = nsge > 0 && sg[nsge - 1].lkey == s->sbuf_mr->lkey
+                    && sg[nsge - 1].addr + sg[nsge - 1].length == (uintptr_t)(dst + copied);
+                if(n == 0) {
+                    full = true;
+                    break;
+                }
+                if(!grow && nsge == MCRDMA_MAX_SEND_SGE) {
+                    break;
+                }
 
-    return len;
-}
+                memcpy(dst + copied, (char *)iov.iov_base + off, n);
+                mcrdma_log("out: %.*s", (int)n, (char*)iov.iov_base + off);
+                if(grow) {
+                    sg[nsge - 1].length += n;
+                } else {
+                    sg[nsge].addr = (uintptr_t)(dst + copied);
+                    sg[nsge].length = n;
+                    sg[nsge].lkey = s->sbuf_mr->lkey;
+                    nsge++;
+                }
+                copied += n;
+            }
 
+            wr_len += n;
+            budget -= n;
+            off += n;
+            if(off < iov.iov_len) {
+                break;
+            }
+            zc += is_zc;
+        }
 
-conn *mcrdma_conn_new(enum conn_states init_state, const int read_buffer_size) {
-    conn *c = calloc(1, sizeof(conn));
-    if(!c) {
-        STATS_LOCK();
-        stats.malloc_fails++;
-        STATS_UNLOCK();
-        mcrdma_log("Failed to allocate connection object\n");
-        return NULL;
+        if(nsge == 0) {
+            break;
+        }
+        memset(&wrs[nwr], 0, sizeof(wrs[nwr]));
+        wrs[nwr].wr_id = (uintptr_t)c;
+        wrs[nwr].opcode = IBV_WR_SEND_WITH_IMM;
+        wrs[nwr].sg_list = sg;
+        wrs[nwr].num_sge = nsge;
+        if(nwr > 0) {
+            wrs[nwr - 1].next = &wrs[nwr];
+        }
+        sbuf_ends[nwr] = head + copied;
+        len += wr_len;
+        nwr++;
     }
-    MEMCACHED_CONN_CREATE(c);
-
-    c->rsize = read_buffer_size;
-    c->rbytes = 0;
 
-    if (c->rsize) {
-        c->rbuf = (char *)malloc((size_t)c->rsize);
+    // Anything left goes with the next call
+    while(i < msg->msg_iovlen && off == msg->msg_iov[i].iov_len) {
+        i++;
+        off = 0;
     }
-
-    if (c->rsize && c->rbuf == NULL) {
-        mcrdma_conn_destroy(c);
-        STATS_LOCK();
-        stats.malloc_fails++;
-        STATS_UNLOCK();
-        fprintf(stderr, "Failed to allocate buffers for connection\n");
-        return NULL;
+    more = i < msg->msg_iovlen;
+    if(nwr == 0) {
+        if(more) {
+            // Out of room in the send buffer
+            send_wait(c);
+            errno = EAGAIN;
+            return -1;
+        }
+        return 0;
     }
 
-    
-    STATS_LOCK();
-    stats_state.conn_structs++;
-    STATS_UNLOCK();
-
-    c->transport = rdma_transport;
-    c->protocol = ascii_prot;
-
-    if (settings.verbose > 1) {
-        mcrdma_log("<new rdma client connection.\n")
+    int pinned_before = s->pinned_count;
+    if(zero_copy && send_pin_items(c) != 0) {
+        while(s->pinned_count > pinned_before) {
+            item_remove(s->pinned[--s->pinned_count]);
+        }
+        errno = ENOMEM;
+        return -1;
     }
 
-    c->read = mcrdma_read;
-    c->sendmsg = mcrdma_sendmsg;
+    // Ask for a completion every now and then, or when no more requests
+    // are queued up: the worker may go idle and sends left unreaped would
+    // keep their items pinned. Only the last send of the chain needs it.
+    bool signaled = s->unsignaled + nwr >= MCRDMA_SEND_SIGNAL_INTERVAL
+        || s->send_head - s->send_tail + nwr == MCRDMA_SEND_RING_SIZE
+        || s->recv_head == NULL;
+
+    // Credits of the slabs consumed so far go back with the response, every
+    // send but the last one of a response is flagged
+    for(int w = 0; w < nwr; w++) {
+        bool last = w == nwr - 1;
+        uint32_t imm = w == 0 ? s->credits_pending : 0;
+        if(!last || more) {
+            imm |= MCRDMA_IMM_MORE;
+        }
+        wrs[w].imm_data = htonl(imm);
+        wrs[w].send_flags = last && signaled ? IBV_SEND_SIGNALED : 0;
+        wrs[w].wr_id = last && signaled ? SIGNALED_WR_ID(c) : (uintptr_t)c;
+    }
 
-    c->state = init_state;
-    c->cmd = -1;
-    c->last_cmd_time = current_time;
-    
-    c->authenticated = true;
-    c->try_read_command = try_read_command_ascii;
+    struct ibv_send_wr *bad_wr = NULL;
+    if(ibv_post_send(s->id->qp, &wrs[0], &bad_wr)) {
+        mcrdma_error("Failed posting send");
+        if(bad_wr != &wrs[0]) {
+            // Part of the chain made it, the connection is beyond repair
+            // but those sends still complete and account for their slots
+            nwr = bad_wr - wrs;
+            signaled = false;
+        } else {
+            while(s->pinned_count > pinned_before) {
+                item_remove(s->pinned[--s->pinned_count]);
+            }
+            return -1;
+        }
+    }
+    s->credits_pending = 0;
+    if(signaled) {
+        s->outstanding++;
+    }
 
-    c->rdma = malloc(sizeof(struct mcrdma_state));
+    for(int w = 0; w < nwr; w++) {
+        struct mcrdma_send_slot *slot = &s->send_ring[s->send_head % MCRDMA_SEND_RING_SIZE];
+        bool last = w == nwr - 1;
+        slot->sbuf_end = sbuf_ends[w];
+        slot->pinned_end = s->pinned_released + (last ? s->pinned_count : pinned_before);
+        slot->signaled = last && signaled;
+        s->send_head++;
+    }
+    s->sbuf_head = sbuf_ends[nwr - 1];
+    s->unsignaled = signaled ? 0 : s->unsignaled + nwr;
+
+    pthread_mutex_lock(&t->stats_lock);
+    t->stats.send_zero_copy_bytes += zero_copy;
+    t->stats.send_copy_bytes += copied;
+    t->stats.sends += nwr;
+    t->stats.send_doorbells++;
+    if(signaled) {
+        t->stats.sends_signaled++;
+    }
+    t->stats.send_fragments += more ? nwr : nwr - 1;
+    pthread_mutex_unlock(&t->stats_lock);
 
-    STATS_LOCK();
-    stats_state.curr_conns++;
-    stats.total_conns++;
-    STATS_UNLOCK();
+    return bad_wr ? -1 : len;
+}
 
-    MEMCACHED_CONN_ALLOCATE(c->sfd);
+void mcrdma_destroy() {
+    mcrdma_ud_destroy();
+    event_del(&listen_event);
+    rdma_destroy_id(disp.id);
+    rdma_destroy_event_channel(disp.echannel);
+}
 
-    return c;
+static void thread_stats_add(struct mcrdma_thread_stats *to,
+        const struct mcrdma_thread_stats *from) {
+    to->depth += from->depth;
+    to->refills += from->refills;
+    to->refilled += from->refilled;
+    to->empty += from->empty;
+    to->held += from->held;
+    to->send_zero_copy_bytes += from->send_zero_copy_bytes;
+    to->send_copy_bytes += from->send_copy_bytes;
+    to->credit_updates += from->credit_updates;
+    to->sends += from->sends;
+    to->sends_signaled += from->sends_signaled;
+    to->write_sets += from->write_sets;
+    to->write_set_bytes += from->write_set_bytes;
+    to->cq_wakeups += from->cq_wakeups;
+    to->cq_poll_hits += from->cq_poll_hits;
+    to->send_fragments += from->send_fragments;
+    to->send_doorbells += from->send_doorbells;
 }
 
-void mcrdma_conn_destroy(conn* c) {
-    if (c) {
-        MEMCACHED_CONN_DESTROY(c);
-        if (c->rbuf)
-            free(c->rbuf);
-        if(c->rdma) {
-            resources_destroy(c->rdma);
-            free(c->rdma);
+void process_rdma_stats(ADD_STAT add_stats, conn *c) {
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    int klen = 0, vlen = 0;
+    struct mcrdma_thread_stats totals = {0};
+    int threads = 0;
+
+    assert(add_stats);
+
+    for(int i = 0; i < settings.num_threads; i++) {
+        struct mcrdma_thread *t = get_worker_thread(i)->rdma;
+        struct mcrdma_thread_stats st = {0};
+        if(t == NULL) {
+            // No rdma connection ever made it to this worker
+            continue;
         }
 
-        free(c);
+        // Add up the worker's resources on every device
+        for(; t; t = t->next) {
+            pthread_mutex_lock(&t->stats_lock);
+            thread_stats_add(&st, &t->stats);
+            pthread_mutex_unlock(&t->stats_lock);
+            threads++;
+        }
+
+        APPEND_NUM_STAT(i, "srq_depth", "%d", st.depth);
+        APPEND_NUM_STAT(i, "srq_refills", "%llu", (unsigned long long)st.refills);
+        APPEND_NUM_STAT(i, "srq_refilled", "%llu", (unsigned long long)st.refilled);
+        APPEND_NUM_STAT(i, "srq_empty", "%llu", (unsigned long long)st.empty);
+        APPEND_NUM_STAT(i, "recv_slabs_held", "%d", st.held);
+        APPEND_NUM_STAT(i, "send_zero_copy_bytes", "%llu", (unsigned long long)st.send_zero_copy_bytes);
+        APPEND_NUM_STAT(i, "send_copy_bytes", "%llu", (unsigned long long)st.send_copy_bytes);
+        APPEND_NUM_STAT(i, "credit_updates", "%llu", (unsigned long long)st.credit_updates);
+        APPEND_NUM_STAT(i, "sends", "%llu", (unsigned long long)st.sends);
+        APPEND_NUM_STAT(i, "sends_signaled", "%llu", (unsigned long long)st.sends_signaled);
+        APPEND_NUM_STAT(i, "write_sets", "%llu", (unsigned long long)st.write_sets);
+        APPEND_NUM_STAT(i, "write_set_bytes", "%llu", (unsigned long long)st.write_set_bytes);
+        APPEND_NUM_STAT(i, "cq_wakeups", "%llu", (unsigned long long)st.cq_wakeups);
+        APPEND_NUM_STAT(i, "cq_poll_hits", "%llu", (unsigned long long)st.cq_poll_hits);
+        APPEND_NUM_STAT(i, "send_fragments", "%llu", (unsigned long long)st.send_fragments);
+        APPEND_NUM_STAT(i, "send_doorbells", "%llu", (unsigned long long)st.send_doorbells);
+
+        thread_stats_add(&totals, &st);
     }
-}
 
-void mcrdma_destroy() {
-    rdma_destroy_event_channel(disp.echannel);
-    rdma_destroy_id(disp.id);
-}
\ No newline at end of file
+    APPEND_STAT("recv_slab_size", "%d", MCRDMA_RECV_SLAB_SIZE);
+    APPEND_STAT("srq_size", "%d", threads * MCRDMA_SRQ_SIZE);
+    APPEND_STAT("srq_depth", "%d", totals.depth);
+    APPEND_STAT("srq_refills", "%llu", (unsigned long long)totals.refills);
+    APPEND_STAT("srq_refilled", "%llu", (unsigned long long)totals.refilled);
+    APPEND_STAT("srq_empty", "%llu", (unsigned long long)totals.empty);
+    APPEND_STAT("recv_slabs_held", "%d", totals.held);
+    APPEND_STAT("send_zero_copy_bytes", "%llu", (unsigned long long)totals.send_zero_copy_bytes);
+    APPEND_STAT("send_copy_bytes", "%llu", (unsigned long long)totals.send_copy_bytes);
+    APPEND_STAT("credit_updates", "%llu", (unsigned long long)totals.credit_updates);
+    APPEND_STAT("sends", "%llu", (unsigned long long)totals.sends);
+    APPEND_STAT("sends_signaled", "%llu", (unsigned long long)totals.sends_signaled);
+    APPEND_STAT("send_fragments", "%llu", (unsigned long long)totals.send_fragments);
+    APPEND_STAT("send_doorbells", "%llu", (unsigned long long)totals.send_doorbells);
+    APPEND_STAT("send_buf_size", "%u", settings.rdma_buf_size);
+    APPEND_STAT("send_buf_max", "%u", settings.rdma_buf_max);
+    APPEND_STAT("write_sets", "%llu", (unsigned long long)totals.write_sets);
+    APPEND_STAT("write_set_bytes", "%llu", (unsigned long long)totals.write_set_bytes);
+    APPEND_STAT("cq_wakeups", "%llu", (unsigned long long)totals.cq_wakeups);
+    APPEND_STAT("cq_poll_hits", "%llu", (unsigned long long)totals.cq_poll_hits);
+    APPEND_STAT("poll_us", "%d", settings.rdma_poll_us);
+    APPEND_STAT("recv_credits", "%d", MCRDMA_RECV_CREDITS);
+
+    pthread_rwlock_rdlock(&mem_reg.lock);
+    APPEND_STAT("mem_regions", "%d", mem_reg.count);
+    pthread_rwlock_unlock(&mem_reg.lock);
+
+    pthread_mutex_lock(&devices.lock);
+    APPEND_STAT("devices", "%d", devices.count);
+    pthread_mutex_unlock(&devices.lock);
+
+    pthread_mutex_lock(&reg_stats.lock);
+    for(int k = 0; k < MCRDMA_MR_KINDS; k++) {
+        char name[32];
+        snprintf(name, sizeof(name), "reg_%s_count", mr_kind_names[k]);
+        APPEND_STAT(name, "%llu", (unsigned long long)reg_stats.count[k]);
+        snprintf(name, sizeof(name), "reg_%s_bytes", mr_kind_names[k]);
+        APPEND_STAT(name, "%llu", (unsigned long long)reg_stats.bytes[k]);
+        snprintf(name, sizeof(name), "reg_%s_us", mr_kind_names[k]);
+        APPEND_STAT(name, "%llu", (unsigned long long)reg_stats.usec[k]);
+    }
+    APPEND_STAT("send_buf_cache", "%d", settings.rdma_buf_cache);
+    APPEND_STAT("send_buf_hits", "%llu", (unsigned long long)reg_stats.buf_hits);
+    APPEND_STAT("send_buf_misses", "%llu", (unsigned long long)reg_stats.buf_misses);
+    APPEND_STAT("send_bufs_cached", "%d", reg_stats.buf_cached);
+    pthread_mutex_unlock(&reg_stats.lock);
+
+    mcrdma_index_stats(add_stats, c);
+    mcrdma_ud_stats(add_stats, c);
+}
@@ -2,53 +2,269 @@
 #define MCRDMA_H
 
 #include "memcached.h"
+#include <rdma/rdma_cma.h>
+
+// Do not remove
+typedef struct conn conn;
 
 // backlog of incoming connection requests, used during rdma_listen
 #define MCRDMA_BACKLOG 16
-#define MCRDMA_DISPATCHER_POLL_TIMEOUT_MS 1000
-    
+
+// Capacity of the completion queue shared by all the connections of a worker
+#define MCRDMA_CQ_SIZE 4096
+// Max number of work completions reaped with a single ibv_poll_cq call
+#define MCRDMA_WC_BATCH 32
+// Batches of work completions handled before letting the other events of
+// the worker through, when completions keep coming
+#define MCRDMA_POLL_BUDGET 64
+
+// Receive slabs owned by each worker, all of them posted to its SRQ
+#define MCRDMA_SRQ_SIZE 512
+// Size of a receive slab, i.e. the largest message a client may send
+#define MCRDMA_RECV_SLAB_SIZE 16384
+// Released slabs are posted back to the SRQ in chains of this many WRs...
+#define MCRDMA_SRQ_REFILL_BATCH 32
+// ...unless the SRQ runs this low, in which case every free slab goes back
+#define MCRDMA_SRQ_LOW_WATERMARK 64
+// Messages a connection may have sitting in receive slabs at once. This is
+// flow control, not a reservation: credits of all the connections of a
+// worker may add up to more than its SRQ holds.
+#define MCRDMA_RECV_CREDITS 16
+// Credits are returned along with responses, or on their own once this
+// many piled up
+#define MCRDMA_CREDIT_UPDATE_THRESHOLD (MCRDMA_RECV_CREDITS / 2)
+
+// RDMA READs a client may have in flight against a connection, i.e. the
+// one-sided GETs it is pipelining
+#define MCRDMA_MAX_READS 4
+
+// Most segments the value of a write set may be split over, i.e. chunks of
+// a large item
+#define MCRDMA_WRITE_MAX_SEGS 32
+// "WRITE <token>" then " <addr> <rkey> <len>" per segment
+#define MCRDMA_WRITE_LINE_SIZE (32 + MCRDMA_WRITE_MAX_SEGS * 48)
+
+// Send buffer of a connection whose client doesn't ask for a size, and
+// receive buffer assumed for clients that don't tell. -o rdma_buf_size
+// changes the former.
+#define MCRDMA_BUF_SIZE (1000000 * 2)
+// Send buffers are sized per connection, between this and -o rdma_buf_max.
+// Also the smallest message a client may ask for: anything the server sends
+// on its own, e.g. the line of a write set, fits.
+#define MCRDMA_BUF_MIN 4096
+#define MCRDMA_BUF_MAX_DEFAULT (16 * 1024 * 1024)
+// Send buffers come in powers of two times MCRDMA_BUF_MIN, so that they can
+// be recycled across connections
+#define MCRDMA_BUF_CLASSES 16
+#define MCRDMA_BUF_MAX_LIMIT ((size_t)MCRDMA_BUF_MIN << (MCRDMA_BUF_CLASSES - 1))
+// Send buffers of each size kept registered once their connection is gone,
+// as many of the default size are registered upfront
+#define MCRDMA_BUF_CACHE_DEFAULT 8
+// Buffers of a multiple of this are backed by transparent hugepages
+#define MCRDMA_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+// Distinct RDMA devices connections may come from
+#define MCRDMA_MAX_DEVICES 16
+
+// Buckets of the table mapping QP numbers to connections
+#define MCRDMA_QP_TABLE_SIZE 1024
+
+// Sends a connection may have posted and not reaped yet
+#define MCRDMA_SEND_RING_SIZE 64
+// Most sends chained together and posted with a single doorbell, e.g. the
+// pieces of a multiget response
+#define MCRDMA_SEND_BATCH 16
+// Sends are unsignaled, except every this many while requests keep coming
+// in. The completion of a signaled send accounts for all the ones before it.
+#define MCRDMA_SEND_SIGNAL_INTERVAL 8
+
+// Max SGEs of a send WR. Response data living in registered slab memory
+// takes one each, everything else is copied into the send buffer.
+#define MCRDMA_MAX_SEND_SGE 16
+// Smaller iovecs are cheaper to copy than to look up
+#define MCRDMA_ZERO_COPY_MIN 1024
+
+// A receive buffer carved from the worker's slab arena
+struct mcrdma_recv_slab {
+    struct mcrdma_recv_slab *next;
+    char *buf;
+    uint32_t len; // bytes received, valid once completed
+};
+
+struct mcrdma_thread_stats {
+    uint64_t refills;      // ibv_post_srq_recv calls
+    uint64_t refilled;     // receive WRs posted by those calls
+    uint64_t empty;        // times a completion left the SRQ with nothing posted
+    int depth;             // receive WRs currently posted
+    int held;              // slabs holding data not yet read by a connection
+    uint64_t send_zero_copy_bytes; // sent straight from slab memory
+    uint64_t send_copy_bytes;      // copied into send buffers first
+    uint64_t credit_updates;       // sends carrying credits only
+    uint64_t sends;                // responses posted
+    uint64_t sends_signaled;       // ...out of which asked for a completion
+    uint64_t write_sets;           // values RDMA written by clients
+    uint64_t write_set_bytes;
+    uint64_t cq_wakeups;   // times the CQ handler was woken up by the HCA
+    uint64_t cq_poll_hits; // ...versus times busy polling found completions
+    uint64_t send_fragments;       // sends holding part of a response only
+    uint64_t send_doorbells;       // ibv_post_send calls posting those sends
+};
+
+// A registered send buffer, recycled across the connections of a device
+struct mcrdma_buf {
+    struct mcrdma_buf *next;
+    struct mcrdma_device *dev;
+    char *base;
+    size_t size;
+    int cls; // size class
+    struct ibv_mr *mr;
+};
+
+/*
+ * An RDMA device and what all the workers using it share: a single PD, so
+ * that slab memory and the one-sided index get registered once per device,
+ * and a cache of registered send buffers.
+ */
+struct mcrdma_device {
+    struct mcrdma_device *next;
+    struct ibv_context *verbs;
+    struct ibv_pd *pd;
+    int id; // index in the slab memory registry
+    struct ibv_mr *index_mr; // one-sided GET index, if enabled
+
+    pthread_mutex_t lock; // protects the cache
+    struct mcrdma_buf *bufs[MCRDMA_BUF_CLASSES];
+    int cached[MCRDMA_BUF_CLASSES];
+};
+
+// A response posted to the send queue
+struct mcrdma_send_slot {
+    uint64_t sbuf_end;   // sbuf_head right after this send was copied
+    uint64_t pinned_end; // pinned items up to the last one it points at
+    bool signaled;
+};
+
+/*
+ * RDMA resources owned by a worker thread on one device, set up the first
+ * time a connection from that device is assigned to the worker.
+ * Every such connection creates its QP on the same CQ, so a single
+ * completion channel registered with the thread's event base is enough to
+ * multiplex all of them.
+ * Incoming messages land in a pool of small slabs posted to a shared receive
+ * queue; a connection only holds slabs for data it hasn't consumed yet.
+ */
+struct mcrdma_thread {
+    LIBEVENT_THREAD *thread;
+    int id; // index of the worker thread
+    struct mcrdma_device *dev;
+    struct mcrdma_thread *next; // the worker's resources on other devices
+    struct ibv_comp_channel *comp_channel;
+    struct ibv_cq *cq;
+    struct event cq_event;
+
+    // Shared receive queue
+    struct ibv_srq *srq;
+    char *slab_mem;
+    struct ibv_mr *slab_mr;
+    struct mcrdma_recv_slab *slabs;
+    struct mcrdma_recv_slab *free_slabs;
+    int free_count;
+    int srq_depth;
+
+    // Receive completions only carry the QP number
+    conn *qp_table[MCRDMA_QP_TABLE_SIZE];
+
+    // When busy polling found the CQ empty, 0 if it didn't
+    uint64_t idle_since;
+
+    pthread_mutex_t stats_lock;
+    struct mcrdma_thread_stats stats;
+};
+
+// Progress of a SET whose value the client RDMA writes into the item
+enum mcrdma_write_state {
+    MCRDMA_WRITE_NONE = 0,
+    MCRDMA_WRITE_ANNOUNCE, // where to write still has to be sent
+    MCRDMA_WRITE_WAIT,     // waiting for the write with immediate
+};
+
 struct mcrdma_state {
     // Connection Management
     struct rdma_event_channel *echannel;
     struct rdma_cm_id *id;
+    struct mcrdma_thread *thread; // worker resources on the conn's device
 
-    // Resources
-    struct ibv_pd *pd;
-    struct ibv_comp_channel *comp_channel;
-    struct ibv_cq *client_cq;
-
+    // Signaled send work requests posted and not completed yet. Their
+    // completions still point at this connection, so resources can't be
+    // released before this drops to zero.
+    int outstanding;
 
-    // Send Buffer
+    // Send Buffer, used as a ring: responses are copied at sbuf_head and
+    // given back at sbuf_tail as their sends complete. Both only grow, the
+    // position in the buffer is taken modulo sbuf_size.
+    struct mcrdma_buf *send_buf; // taken from the device cache
     char* sbuf;
     size_t sbuf_size;
     struct ibv_mr* sbuf_mr;
+    size_t send_max; // largest message the client can receive
+    uint64_t sbuf_head;
+    uint64_t sbuf_tail;
+    // Sends not known to be complete yet, oldest first
+    struct mcrdma_send_slot send_ring[MCRDMA_SEND_RING_SIZE];
+    uint32_t send_head;
+    uint32_t send_tail;
+    int unsignaled; // sends posted since the last signaled one
+    bool send_blocked; // the state machine waits for room to send
+    // Items referenced by the sends in flight, oldest first
+    item **pinned;
+    int pinned_count;
+    int pinned_size;
+    uint64_t pinned_released; // items released since the connection started
+
+    // Received slabs not yet consumed by the state machine, oldest first
+    struct mcrdma_recv_slab *recv_head;
+    struct mcrdma_recv_slab *recv_tail;
+    size_t recv_off; // bytes of recv_head already consumed
+    uint32_t credits_pending; // slabs consumed, not yet returned to the client
+    bool credit_update_posted;
+    uint32_t credit_update_fence; // send_head when it was posted
 
-    // Recv Buffer
-    char* rbuf;
-    size_t rbuf_size;
-    struct ibv_mr* rbuf_mr;
-    bool rbuf_posted;
+    // Write set in progress, see mcrdma_write_set()
+    enum mcrdma_write_state write_state;
+    uint32_t write_token;
+    char *write_line;
+    int write_len;
 
-    // Not important, used with the PING_PONG benchmark
-    bool pinged;
+    uint32_t qp_num;
+    conn *qp_next; // chain of the thread's QP table
 };
 
-// Do not remove
-typedef struct conn conn;
 
 // Return 0 on success, 1 on failure
 int mcrdma_init(const char *interface, int port);
 
-void mcrdma_destroy(void);
+// The device verbs belongs to, set up on first use. NULL on failure.
+struct mcrdma_device *mcrdma_device_get(struct ibv_context *verbs);
 
-int mcrdma_listen(void);
+void mcrdma_destroy(void);
 
-void *mcrdma_worker(void*);
+// Accept connections from the given event base, i.e. the main thread's one
+// next to the TCP/UDP listeners. Return 0 on success, -1 on failure.
+int mcrdma_listen(struct event_base *base);
 
 void mcrdma_state_machine(conn* c);
 
-conn* mcrdma_conn_new(enum conn_states init_state, const int read_buffer_size);
+// Resume a connection once the IOs it handed to side threads are back, see
+// conn_worker_readd()
+void mcrdma_conn_readd(conn *c);
+
+void process_rdma_stats(ADD_STAT add_stats, conn *c);
+
+// Let the client RDMA write the value of the item being set (c->item) instead
+// of sending it. Return 0 on success, -1 if the value has to be sent as usual.
+int mcrdma_write_set(conn *c);
 
-void mcrdma_conn_destroy(conn* c);
+conn *mcrdma_conn_new(struct rdma_cm_id *id, enum conn_states init_state,
+        const int read_buffer_size, LIBEVENT_THREAD *thread);
 
-#endif // MCRDMA_H
\ No newline at end of file
+#endif // MCRDMA_H
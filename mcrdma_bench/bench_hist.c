@@ -0,0 +1,76 @@
+#include "bench_hist.h"
+#include <stdio.h>
+
+static int bucket_of(uint64_t ns) {
+    if(ns < 2 * BENCH_HIST_SUB) {
+        return ns;
+    }
+    int shift = 63 - __builtin_clzll(ns) - BENCH_HIST_SUB_BITS;
+    int top = ns >> shift; // BENCH_HIST_SUB up to 2 * BENCH_HIST_SUB - 1
+    return 2 * BENCH_HIST_SUB + (shift - 1) * BENCH_HIST_SUB + (top - BENCH_HIST_SUB);
+}
+
+// Largest value falling into the bucket
+static uint64_t bucket_value(int bucket) {
+    if(bucket < 2 * BENCH_HIST_SUB) {
+        return bucket;
+    }
+    int shift = (bucket - 2 * BENCH_HIST_SUB) / BENCH_HIST_SUB + 1;
+    uint64_t top = (bucket - 2 * BENCH_HIST_SUB) % BENCH_HIST_SUB + BENCH_HIST_SUB;
+    return ((top + 1) << shift) - 1;
+}
+
+void bench_hist_record(struct bench_hist* hist, uint64_t ns) {
+    hist->counts[bucket_of(ns)]++;
+    hist->total++;
+    hist->sum += ns;
+    if(hist->min == 0 || ns < hist->min) {
+        hist->min = ns;
+    }
+    if(ns > hist->max) {
+        hist->max = ns;
+    }
+}
+
+void bench_hist_merge(struct bench_hist* dst, const struct bench_hist* src) {
+    for(int i = 0; i < BENCH_HIST_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if(dst->min == 0 || (src->min != 0 && src->min < dst->min)) {
+        dst->min = src->min;
+    }
+    if(src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+uint64_t bench_hist_percentile(const struct bench_hist* hist, double percentile) {
+    if(hist->total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * hist->total + 0.5);
+    if(rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for(int i = 0; i < BENCH_HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if(seen >= rank) {
+            uint64_t value = bucket_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+void bench_hist_print(const struct bench_hist* hist, const char* op) {
+    printf("Final p50 time %s: %llu\n", op, (unsigned long long)bench_hist_percentile(hist, 50));
+    printf("Final p99 time %s: %llu\n", op, (unsigned long long)bench_hist_percentile(hist, 99));
+    printf("Final p99.9 time %s: %llu\n", op, (unsigned long long)bench_hist_percentile(hist, 99.9));
+    printf("Final p99.99 time %s: %llu\n", op, (unsigned long long)bench_hist_percentile(hist, 99.99));
+    printf("Final max time %s: %llu\n", op, (unsigned long long)hist->max);
+}
@@ -0,0 +1,31 @@
+#ifndef BENCH_HIST_H
+#define BENCH_HIST_H
+
+#include <stdint.h>
+
+// Latencies are recorded in log-linear buckets, like HDR histograms do: exact
+// below 2^(BENCH_HIST_SUB_BITS + 1) ns, within 1/2^BENCH_HIST_SUB_BITS of
+// the value above.
+#define BENCH_HIST_SUB_BITS 7
+#define BENCH_HIST_SUB (1 << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_BUCKETS (2 * BENCH_HIST_SUB + (63 - BENCH_HIST_SUB_BITS) * BENCH_HIST_SUB)
+
+struct bench_hist {
+    uint64_t counts[BENCH_HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+};
+
+void bench_hist_record(struct bench_hist* hist, uint64_t ns);
+void bench_hist_merge(struct bench_hist* dst, const struct bench_hist* src);
+
+// Smallest recorded latency that percentile% of the samples don't exceed,
+// within the bucket precision
+uint64_t bench_hist_percentile(const struct bench_hist* hist, double percentile);
+
+// Print the "Final <stat> time <op>: <ns>" lines of the merged results
+void bench_hist_print(const struct bench_hist* hist, const char* op);
+
+#endif // BENCH_HIST_H
@@ -0,0 +1,145 @@
+#include "bench_output.h"
+#include <stdio.h>
+
+const char* test_names[] = { "set-get", "ping-pong", "ycsb-a", "ycsb-b", "ycsb-c" };
+
+static const char* value_dist_names[] = { "fixed", "uniform", "pareto" };
+
+void bench_summary_add(struct bench_summary* summary, const struct client_result* res) {
+    switch(res->status) {
+        case CLIENT_OK:
+            summary->ok++;
+            break;
+        case CLIENT_FAILED_CMP:
+            summary->failed_cmp++;
+            break;
+        default:
+            summary->err++;
+            break;
+    }
+
+    for(int op = 0; op < op_types; op++) {
+        bench_hist_merge(&summary->hists[op], &res->hists[op]);
+    }
+    summary->values += res->values;
+    if(res->elapsed_time / 1e9 > summary->elapsed) {
+        summary->elapsed = res->elapsed_time / 1e9;
+    }
+}
+
+static double throughput(const struct bench_summary* summary, int op) {
+    return summary->elapsed > 0 ? summary->hists[op].total / summary->elapsed : 0;
+}
+
+static unsigned long long int mean(const struct bench_summary* summary, int op) {
+    const struct bench_hist* hist = &summary->hists[op];
+    return hist->total ? hist->sum / hist->total : 0;
+}
+
+// Values received out of the keys GETs asked for, -1 if unknown
+static double hit_ratio(const struct bench_summary* summary) {
+    unsigned long long int keys = summary->hists[op_get].total * workload.multiget;
+    if(!summary->count_values || keys == 0) {
+        return -1;
+    }
+    return (double)summary->values / keys;
+}
+
+void bench_output_text(const struct bench_summary* summary) {
+    for(int op = 0; op < op_types; op++) {
+        if(summary->hists[op].total == 0) {
+            continue;
+        }
+        printf("Final requests %s: %llu\n", op_names[op], (unsigned long long)summary->hists[op].total);
+        printf("Final rate %s: %.0f\n", op_names[op], throughput(summary, op));
+        printf("Final mean time %s: %llu\n", op_names[op], mean(summary, op));
+        bench_hist_print(&summary->hists[op], op_names[op]);
+    }
+    if(hit_ratio(summary) >= 0) {
+        printf("Final hit ratio: %.4f\n", hit_ratio(summary));
+    }
+}
+
+int bench_output_csv(const char* path, const struct bench_summary* summary) {
+    FILE* f = fopen(path, "a");
+    if(!f) {
+        perror("Cannot open the CSV output");
+        return -1;
+    }
+
+    if(ftell(f) == 0) {
+        fprintf(f, "net,test,clients,iters,payload_size,rate,depth,keys,key_dist,zipf_theta,"
+                "multiget,miss_ratio,value_dist,ok,err,failed_cmp,op,requests,throughput,"
+                "hit_ratio,mean,p50,p99,p99.9,p99.99,max\n");
+    }
+
+    for(int op = 0; op < op_types; op++) {
+        const struct bench_hist* hist = &summary->hists[op];
+        if(hist->total == 0) {
+            continue;
+        }
+        fprintf(f, "%s,%s,%d,%d,%zu,%.0f,%d,%llu,%s,%.2f,%d,%.4f,%s,%d,%d,%d,%s,%llu,%.0f,",
+                tcp ? "tcp" : "rdma", test_names[ttype], clients, iterations_per_client,
+                get_payload_len(), rate, depth, (unsigned long long)workload.keys.n,
+                workload.keys.zipf ? "zipf" : "uniform", workload.keys.theta,
+                workload.multiget, workload.miss_ratio, value_dist_names[workload.values],
+                summary->ok, summary->err, summary->failed_cmp,
+                op_names[op], (unsigned long long)hist->total, throughput(summary, op));
+        if(op == op_get && hit_ratio(summary) >= 0) {
+            fprintf(f, "%.4f", hit_ratio(summary));
+        }
+        fprintf(f, ",%llu,%llu,%llu,%llu,%llu,%llu\n", mean(summary, op),
+                (unsigned long long)bench_hist_percentile(hist, 50),
+                (unsigned long long)bench_hist_percentile(hist, 99),
+                (unsigned long long)bench_hist_percentile(hist, 99.9),
+                (unsigned long long)bench_hist_percentile(hist, 99.99),
+                (unsigned long long)hist->max);
+    }
+
+    fclose(f);
+    return 0;
+}
+
+int bench_output_json(const char* path, const struct bench_summary* summary) {
+    FILE* f = fopen(path, "a");
+    if(!f) {
+        perror("Cannot open the JSON output");
+        return -1;
+    }
+
+    fprintf(f, "{\"net\":\"%s\",\"test\":\"%s\",\"clients\":%d,\"iters\":%d,\"payload_size\":%zu,"
+            "\"rate\":%.0f,\"depth\":%d,\"keys\":%llu,\"key_dist\":\"%s\",\"zipf_theta\":%.2f,"
+            "\"multiget\":%d,\"miss_ratio\":%.4f,\"value_dist\":\"%s\","
+            "\"ok\":%d,\"err\":%d,\"failed_cmp\":%d,\"elapsed\":%.6f",
+            tcp ? "tcp" : "rdma", test_names[ttype], clients, iterations_per_client,
+            get_payload_len(), rate, depth, (unsigned long long)workload.keys.n,
+            workload.keys.zipf ? "zipf" : "uniform", workload.keys.theta,
+            workload.multiget, workload.miss_ratio, value_dist_names[workload.values],
+            summary->ok, summary->err, summary->failed_cmp, summary->elapsed);
+    if(hit_ratio(summary) >= 0) {
+        fprintf(f, ",\"hit_ratio\":%.4f", hit_ratio(summary));
+    }
+
+    fprintf(f, ",\"ops\":{");
+    bool first = true;
+    for(int op = 0; op < op_types; op++) {
+        const struct bench_hist* hist = &summary->hists[op];
+        if(hist->total == 0) {
+            continue;
+        }
+        fprintf(f, "%s\"%s\":{\"requests\":%llu,\"throughput\":%.0f,\"mean\":%llu,"
+                "\"p50\":%llu,\"p99\":%llu,\"p99.9\":%llu,\"p99.99\":%llu,\"max\":%llu}",
+                first ? "" : ",", op_names[op], (unsigned long long)hist->total,
+                throughput(summary, op), mean(summary, op),
+                (unsigned long long)bench_hist_percentile(hist, 50),
+                (unsigned long long)bench_hist_percentile(hist, 99),
+                (unsigned long long)bench_hist_percentile(hist, 99.9),
+                (unsigned long long)bench_hist_percentile(hist, 99.99),
+                (unsigned long long)hist->max);
+        first = false;
+    }
+    fprintf(f, "}}\n");
+
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef BENCH_OUTPUT_H
+#define BENCH_OUTPUT_H
+
+#include "main.h"
+
+// Results of all the clients put together
+struct bench_summary {
+    int ok;
+    int err;
+    int failed_cmp;
+    double elapsed; // seconds taken by the slowest client
+    unsigned long long int values;
+    bool count_values; // whether values were counted, see client_result
+    struct bench_hist hists[op_types];
+};
+
+extern const char* test_names[];
+
+void bench_summary_add(struct bench_summary* summary, const struct client_result* res);
+
+// Print the latencies of every operation that took place
+void bench_output_text(const struct bench_summary* summary);
+
+// Append a row per operation to a CSV file, along with the parameters of the
+// run. The header is written to new files only.
+int bench_output_csv(const char* path, const struct bench_summary* summary);
+
+// Append the run as a single line JSON object
+int bench_output_json(const char* path, const struct bench_summary* summary);
+
+#endif // BENCH_OUTPUT_H
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <strings.h>
 #include "bench_utils.h"
+#include "bench_workload.h"
 #include <unistd.h>
 
 int bench_rdma_init(union client_handle *handle, int tid, struct sockaddr_in addr) {
@@ -116,6 +117,8 @@ static void work_set_get(struct client_result* res, struct mcrdma_client* client
 
         res->set_time = new_set_time;
         res->get_time = new_get_time;
+        bench_hist_record(&res->hists[op_set], curr_set_time);
+        bench_hist_record(&res->hists[op_get], curr_get_time);
 
         // Update max times
         res->max_set_time = res->max_set_time < curr_set_time ? curr_set_time : res->max_set_time;
@@ -132,14 +135,6 @@ static void work_set_get(struct client_result* res, struct mcrdma_client* client
         } else {
             res->min_get_time = res->min_get_time > curr_get_time ? curr_get_time : res->min_get_time;
         }
-<<<<<<< HEAD
-=======
-
-        if(print_all) {
-            cprintf("set time: %llu\n", curr_set_time);
-            cprintf("get time: %llu\n", curr_get_time);
-        }
->>>>>>> be1279740cc73bf58cff91e542b80f47e2e2e34a
     }
 
     free(set_req);
@@ -154,11 +149,11 @@ static void work_ping_pong(struct client_result* res, struct mcrdma_client* clie
     res->max_ping_time = 0;
     res->min_ping_time = 0;
 
-    char* msg = "PING\r\n";
-    int msg_len = 6;
+    char* msg = "mn\r\n";
+    int msg_len = 4;
     for(int i = 0; i < iterations_per_client; i++) {
         
-        // Perform PING
+        // Perform PING, i.e. a meta no-op
         struct timespec ping_start, ping_end;
 
         clock_gettime(CLOCK_MONOTONIC, &ping_start);
@@ -167,7 +162,7 @@ static void work_ping_pong(struct client_result* res, struct mcrdma_client* clie
         int resp_len = mcrdma_client_ascii_recv(client);
         clock_gettime(CLOCK_MONOTONIC, &ping_end);
 
-        CMP(client->rbuf, "PONG\r\n", resp_len);
+        CMP(client->rbuf, "MN\r\n", resp_len);
         
         // Sum time taken (with overflow check)
         unsigned long long int new_ping_time = res->ping_time;
@@ -177,6 +172,7 @@ static void work_ping_pong(struct client_result* res, struct mcrdma_client* clie
         assert(new_ping_time > res->ping_time);
 
         res->ping_time = new_ping_time;
+        bench_hist_record(&res->hists[op_ping], curr_ping_time);
 
         // Update max times
         res->max_ping_time = res->max_ping_time < curr_ping_time ? curr_ping_time : res->max_ping_time;
@@ -191,7 +187,102 @@ static void work_ping_pong(struct client_result* res, struct mcrdma_client* clie
     res->status = CLIENT_OK;
 }
 
+// Open loop and YCSB-like tests: requests are sent as they arrive, batched
+// with the ones that arrived while waiting for the previous batch, up to
+// depth. Latencies are taken from the time a request should have been sent,
+// so that a slow response delaying the following requests shows in their
+// latency too. Without a rate, requests arrive as soon as there is room.
+static void work_requests(struct client_result* res, struct mcrdma_client* client, int tid) {
+    uint64_t rng = 0x9E3779B97F4A7C15ull * (tid + 1);
+    double client_rate = rate / clients / 1e9;
+    uint64_t* intended = calloc(depth, sizeof(uint64_t));
+    enum op_type* ops = calloc(depth, sizeof(enum op_type));
+    struct resp_parser parser;
+
+    uint64_t next = now_ns();
+    if(rate > 0) {
+        next += poisson_gap(&rng, client_rate);
+    }
+    int sent = 0;
+    while(sent < iterations_per_client) {
+        wait_until_ns(next);
+        uint64_t now = now_ns();
+
+        size_t len = 0;
+        int batch = 0;
+        while(batch < depth && sent + batch < iterations_per_client && next <= now) {
+            len += workload_next(client->sbuf + len, &ops[batch], &rng);
+            if(rate > 0) {
+                intended[batch++] = next;
+                next += poisson_gap(&rng, client_rate);
+            } else {
+                intended[batch++] = now;
+            }
+        }
+
+        if(mcrdma_client_ascii_send(client, len)) {
+            cprintf("Failed to send requests\n");
+            res->status = CLIENT_ERR;
+            break;
+        }
+
+        // The responses of a batch may come back over several messages
+        resp_parser_init(&parser);
+        int done = 0;
+        while(done < batch) {
+            int resp_len = mcrdma_client_ascii_recv(client);
+            if(resp_len < 0) {
+                cprintf("Failed to receive responses\n");
+                res->status = CLIENT_ERR;
+                break;
+            }
+            int count = resp_parser_feed(&parser, client->rbuf, resp_len);
+            uint64_t end = now_ns();
+            for(int i = done; i < done + count && i < batch; i++) {
+                bench_hist_record(&res->hists[ops[i]], end - intended[i]);
+            }
+            done += count;
+        }
+        if(done < batch) {
+            break;
+        }
+        res->values += parser.values;
+        sent += batch;
+    }
+
+    free(intended);
+    free(ops);
+    if(res->status != CLIENT_ERR) {
+        res->status = CLIENT_OK;
+    }
+}
+
+int bench_rdma_preload(union client_handle *handle, int tid) {
+    struct mcrdma_client* client = &handle->client;
+
+    // Keys are split among the clients
+    uint64_t rng = 0x2545F4914F6CDD1Dull * (tid + 1);
+    for(uint64_t key = tid; key < workload.keys.n; key += clients) {
+        int len = fill_set_key(client->sbuf, key, workload_value_size(&rng));
+        if(mcrdma_client_ascii_send(client, len)) {
+            cprintf("Failed to send key %llu\n", (unsigned long long)key);
+            return 1;
+        }
+        int resp_len = mcrdma_client_ascii_recv(client);
+        if(resp_len != 8 || memcmp(client->rbuf, "STORED\r\n", 8)) {
+            cprintf("Failed to store key %llu\n", (unsigned long long)key);
+            return 1;
+        }
+    }
+    return 0;
+}
+
 void bench_rdma_worker(struct client_result* res, union client_handle *handle, int tid) {
+    if(run_workload()) {
+        work_requests(res, &handle->client, tid);
+        return;
+    }
+
     switch(ttype) {
         case set_get:
             work_set_get(res, &handle->client, tid);
@@ -7,6 +7,9 @@
 int bench_rdma_init(union client_handle *handle, int tid, struct sockaddr_in addr);
 void bench_rdma_destroy(union client_handle *handle, int tid);
 
+// SET the keys of the workload this client is in charge of
+int bench_rdma_preload(union client_handle *handle, int tid);
+
 void bench_rdma_worker(struct client_result* res, union client_handle *handle, int tid);
 
 #endif // BENCH_RDMA_H
\ No newline at end of file
@@ -2,7 +2,9 @@
 #include <time.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include "bench_utils.h"
+#include "bench_workload.h"
 
 int bench_tcp_init(union client_handle *handle, int tid, struct sockaddr_in addr) {
     handle->sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -101,6 +103,8 @@ static void work_set_get(struct client_result* res, int sockfd, int tid) {
 
         res->set_time = new_set_time;
         res->get_time = new_get_time;
+        bench_hist_record(&res->hists[op_set], curr_set_time);
+        bench_hist_record(&res->hists[op_get], curr_get_time);
 
         // Update max times
         res->max_set_time = res->max_set_time < curr_set_time ? curr_set_time : res->max_set_time;
@@ -132,12 +136,12 @@ static void work_ping_pong(struct client_result* res, int sockfd, int tid) {
     res->max_ping_time = 0;
     res->min_ping_time = 0;
 
-    char* msg = "PING\r\n";
-    int msg_len = 6;
+    char* msg = "mn\r\n";
+    int msg_len = 4;
     char* recv_buf = calloc(SAFE_BUF_SIZE, 1);
 
     for(int i = 0; i < iterations_per_client; i++) {
-        // Perform PING
+        // Perform PING, i.e. a meta no-op
         struct timespec ping_start, ping_end;
 
         clock_gettime(CLOCK_MONOTONIC, &ping_start);
@@ -146,7 +150,7 @@ static void work_ping_pong(struct client_result* res, int sockfd, int tid) {
         int resp_len = recv(sockfd, recv_buf, 65536, 0);
         clock_gettime(CLOCK_MONOTONIC, &ping_end);
 
-        CMP(recv_buf, "PONG\r\n", resp_len);
+        CMP(recv_buf, "MN\r\n", resp_len);
         
         // Sum time taken (with overflow check)
         unsigned long long int new_ping_time = res->ping_time;
@@ -156,6 +160,7 @@ static void work_ping_pong(struct client_result* res, int sockfd, int tid) {
         assert(new_ping_time > res->ping_time);
 
         res->ping_time = new_ping_time;
+        bench_hist_record(&res->hists[op_ping], curr_ping_time);
 
         // Update max times
         res->max_ping_time = res->max_ping_time < curr_ping_time ? curr_ping_time : res->max_ping_time;
@@ -166,13 +171,6 @@ static void work_ping_pong(struct client_result* res, int sockfd, int tid) {
         } else {
             res->min_ping_time = res->min_ping_time > curr_ping_time ? curr_ping_time : res->min_ping_time;
         }
-<<<<<<< HEAD
-=======
-
-        if(print_all) {
-            cprintf("ping time: %llu\n", curr_ping_time);
-        }
->>>>>>> be1279740cc73bf58cff91e542b80f47e2e2e34a
     }
 
     free(recv_buf);
@@ -181,7 +179,115 @@ static void work_ping_pong(struct client_result* res, int sockfd, int tid) {
 }
 
 
+// See work_requests() in bench_rdma.c
+static void work_requests(struct client_result* res, int sockfd, int tid) {
+    uint64_t rng = 0x9E3779B97F4A7C15ull * (tid + 1);
+    double client_rate = rate / clients / 1e9;
+    uint64_t* intended = calloc(depth, sizeof(uint64_t));
+    enum op_type* ops = calloc(depth, sizeof(enum op_type));
+    struct resp_parser parser;
+
+    char* send_buf = calloc(depth, workload_max_request());
+    char* recv_buf = calloc(SAFE_BUF_SIZE, 1);
+
+    uint64_t next = now_ns();
+    if(rate > 0) {
+        next += poisson_gap(&rng, client_rate);
+    }
+    int sent = 0;
+    while(sent < iterations_per_client) {
+        wait_until_ns(next);
+        uint64_t now = now_ns();
+
+        size_t len = 0;
+        int batch = 0;
+        while(batch < depth && sent + batch < iterations_per_client && next <= now) {
+            len += workload_next(send_buf + len, &ops[batch], &rng);
+            if(rate > 0) {
+                intended[batch++] = next;
+                next += poisson_gap(&rng, client_rate);
+            } else {
+                intended[batch++] = now;
+            }
+        }
+
+        if(send(sockfd, send_buf, len, 0) != (ssize_t)len) {
+            cprintf("Failed to send requests\n");
+            res->status = CLIENT_ERR;
+            break;
+        }
+
+        resp_parser_init(&parser);
+        int done = 0;
+        while(done < batch) {
+            ssize_t resp_len = recv(sockfd, recv_buf, SAFE_BUF_SIZE, 0);
+            if(resp_len <= 0) {
+                cprintf("Failed to receive responses\n");
+                res->status = CLIENT_ERR;
+                break;
+            }
+            int count = resp_parser_feed(&parser, recv_buf, resp_len);
+            uint64_t end = now_ns();
+            for(int i = done; i < done + count && i < batch; i++) {
+                bench_hist_record(&res->hists[ops[i]], end - intended[i]);
+            }
+            done += count;
+        }
+        if(done < batch) {
+            break;
+        }
+        res->values += parser.values;
+        sent += batch;
+    }
+
+    free(intended);
+    free(ops);
+    free(send_buf);
+    free(recv_buf);
+    if(res->status != CLIENT_ERR) {
+        res->status = CLIENT_OK;
+    }
+}
+
+int bench_tcp_preload(union client_handle *handle, int tid) {
+    size_t buf_size = 100 + get_payload_len();
+    char* buf = calloc(buf_size, 1);
+    int ret = 0;
+
+    // Keys are split among the clients
+    uint64_t rng = 0x2545F4914F6CDD1Dull * (tid + 1);
+    for(uint64_t key = tid; key < workload.keys.n; key += clients) {
+        int len = fill_set_key(buf, key, workload_value_size(&rng));
+        if(send(handle->sockfd, buf, len, 0) != len) {
+            cprintf("Failed to send key %llu\n", (unsigned long long)key);
+            ret = 1;
+            break;
+        }
+        int resp_len = 0;
+        while(resp_len < 8) {
+            ssize_t n = recv(handle->sockfd, buf + resp_len, 8 - resp_len, 0);
+            if(n <= 0) {
+                break;
+            }
+            resp_len += n;
+        }
+        if(resp_len != 8 || memcmp(buf, "STORED\r\n", 8)) {
+            cprintf("Failed to store key %llu\n", (unsigned long long)key);
+            ret = 1;
+            break;
+        }
+    }
+
+    free(buf);
+    return ret;
+}
+
 void bench_tcp_worker(struct client_result* res, union client_handle *handle, int tid) {
+    if(run_workload()) {
+        work_requests(res, handle->sockfd, tid);
+        return;
+    }
+
     switch(ttype) {
         case set_get:
             work_set_get(res, handle->sockfd, tid);
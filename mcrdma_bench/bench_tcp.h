@@ -6,6 +6,9 @@
 
 int bench_tcp_init(union client_handle *handle, int tid, struct sockaddr_in addr);
 
+// SET the keys of the workload this client is in charge of
+int bench_tcp_preload(union client_handle *handle, int tid);
+
 void bench_tcp_worker(struct client_result* res, union client_handle *handle, int tid);
 
 #endif // BENCH_TCP_H
\ No newline at end of file
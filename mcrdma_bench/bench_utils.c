@@ -1,6 +1,8 @@
 #include "bench_utils.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
+#include <time.h>
 
 char* payload = NULL;
 size_t payload_len = 0;
@@ -42,4 +44,78 @@ int fill_expected_get_resp(char* buf, int tid, int iter) {
 
 size_t get_payload_len(void) {
     return payload_len;
-}
\ No newline at end of file
+}
+int fill_set_key(char* buf, uint64_t key, size_t len) {
+    return sprintf(buf, "set key%010llu 0 0 %lu\r\n%.*s\r\n", (unsigned long long)key, len, (int)len, payload);
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void wait_until_ns(uint64_t ns) {
+    uint64_t now = now_ns();
+    // Sleeping is too coarse for short waits, spin through those
+    if(ns > now + 100000) {
+        uint64_t sleep_ns = ns - now - 50000;
+        struct timespec ts = { sleep_ns / 1000000000ull, sleep_ns % 1000000000ull };
+        nanosleep(&ts, NULL);
+    }
+    while(now_ns() < ns);
+}
+
+uint64_t rand_next(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+double rand_double(uint64_t* state) {
+    return (rand_next(state) >> 11) * (1.0 / (1ull << 53));
+}
+
+uint64_t poisson_gap(uint64_t* state, double rate) {
+    return (uint64_t)(-log(1.0 - rand_double(state)) / rate);
+}
+
+static double zeta(uint64_t n, double theta) {
+    double sum = 0;
+    for(uint64_t i = 1; i <= n; i++) {
+        sum += 1.0 / pow(i, theta);
+    }
+    return sum;
+}
+
+void key_dist_init(struct key_dist* dist, uint64_t n, bool zipf, double theta) {
+    dist->n = n;
+    dist->zipf = zipf;
+    dist->theta = theta;
+    if(!zipf) {
+        return;
+    }
+    dist->zetan = zeta(n, theta);
+    dist->alpha = 1.0 / (1.0 - theta);
+    dist->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta(2, theta) / dist->zetan);
+}
+
+uint64_t key_dist_next(const struct key_dist* dist, uint64_t* state) {
+    if(!dist->zipf) {
+        return rand_next(state) % dist->n;
+    }
+
+    double u = rand_double(state);
+    double uz = u * dist->zetan;
+    if(uz < 1.0) {
+        return 0;
+    }
+    if(uz < 1.0 + pow(0.5, dist->theta)) {
+        return 1;
+    }
+    uint64_t key = dist->n * pow(dist->eta * u - dist->eta + 1.0, dist->alpha);
+    return key < dist->n ? key : dist->n - 1;
+}
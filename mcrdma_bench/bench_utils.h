@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #define MAX_PAYLOAD_SIZE 1000000
 #define SAFE_BUF_SIZE MAX_PAYLOAD_SIZE * 2
@@ -15,5 +16,35 @@ void init_payload(size_t len);
 
 size_t get_payload_len(void);
 
+// Keys shared by all the clients, numbered from 0. SETs take the first len
+// bytes of the payload.
+int fill_set_key(char* buf, uint64_t key, size_t len);
+
+uint64_t now_ns(void);
+void wait_until_ns(uint64_t ns);
+
+// xorshift64*, state must not be 0
+uint64_t rand_next(uint64_t* state);
+// Uniform in [0, 1)
+double rand_double(uint64_t* state);
+
+// Gap in ns before the next request of a Poisson process of rate per ns
+uint64_t poisson_gap(uint64_t* state, double rate);
+
+// Key popularity, uniform or zipfian over n keys. Zipfian keys are drawn as
+// YCSB does (Gray et al., "Quickly Generating Billion-Record Synthetic
+// Databases"), key 0 being the most popular.
+struct key_dist {
+    uint64_t n;
+    bool zipf;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+};
+
+void key_dist_init(struct key_dist* dist, uint64_t n, bool zipf, double theta);
+uint64_t key_dist_next(const struct key_dist* dist, uint64_t* state);
+
 
 #endif // BENCH_UTILS_H
\ No newline at end of file
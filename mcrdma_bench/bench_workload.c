@@ -0,0 +1,126 @@
+#include "bench_workload.h"
+#include "main.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct workload workload = {
+    .read_ratio = 1,
+    .multiget = 1,
+    .miss_ratio = 0,
+    .values = value_fixed,
+    .value_min = 1,
+};
+
+const char* op_names[op_types] = { "get", "set", "ping" };
+
+// Atikoglu et al., "Workload Analysis of a Large-Scale Key-Value Store"
+#define PARETO_SCALE 214.476
+#define PARETO_SHAPE 0.348238
+
+size_t workload_value_size(uint64_t* rng) {
+    size_t max = get_payload_len();
+    size_t size;
+
+    switch(workload.values) {
+        case value_uniform:
+            size = workload.value_min + rand_next(rng) % (max - workload.value_min + 1);
+            break;
+        case value_pareto:
+            size = PARETO_SCALE * (pow(1.0 - rand_double(rng), -PARETO_SHAPE) - 1.0) / PARETO_SHAPE;
+            if(size < 1) {
+                size = 1;
+            }
+            break;
+        default:
+            size = max;
+            break;
+    }
+    return size < max ? size : max;
+}
+
+static uint64_t next_get_key(uint64_t* rng) {
+    uint64_t key = key_dist_next(&workload.keys, rng);
+    if(workload.miss_ratio > 0 && rand_double(rng) < workload.miss_ratio) {
+        // Same popularity, past the keys SET beforehand
+        key += workload.keys.n;
+    }
+    return key;
+}
+
+int workload_next(char* buf, enum op_type* op, uint64_t* rng) {
+    if(ttype == ping_pong) {
+        *op = op_ping;
+        memcpy(buf, "mn\r\n", 4);
+        return 4;
+    }
+
+    if(workload.read_ratio < 1 && rand_double(rng) >= workload.read_ratio) {
+        *op = op_set;
+        uint64_t key = key_dist_next(&workload.keys, rng);
+        return fill_set_key(buf, key, workload_value_size(rng));
+    }
+
+    *op = op_get;
+    int len = sprintf(buf, "get");
+    for(int i = 0; i < workload.multiget; i++) {
+        len += sprintf(buf + len, " key%010llu", (unsigned long long)next_get_key(rng));
+    }
+    len += sprintf(buf + len, "\r\n");
+    return len;
+}
+
+size_t workload_max_request(void) {
+    size_t get = 8 + workload.multiget * 24;
+    size_t set = 64 + get_payload_len();
+    return get > set ? get : set;
+}
+
+size_t workload_max_response(void) {
+    return workload.multiget * (64 + get_payload_len()) + 8;
+}
+
+void resp_parser_init(struct resp_parser* parser) {
+    parser->line_len = 0;
+    parser->skip = 0;
+    parser->values = 0;
+}
+
+int resp_parser_feed(struct resp_parser* parser, const char* buf, size_t len) {
+    int count = 0;
+    size_t i = 0;
+
+    while(i < len) {
+        if(parser->skip) {
+            size_t n = len - i < parser->skip ? len - i : parser->skip;
+            parser->skip -= n;
+            i += n;
+            continue;
+        }
+
+        // Lines may be split across reads, only their beginning matters
+        const char* nl = memchr(buf + i, '\n', len - i);
+        size_t n = nl ? (size_t)(nl - (buf + i)) + 1 : len - i;
+        size_t room = sizeof(parser->line) - 1 - parser->line_len;
+        memcpy(parser->line + parser->line_len, buf + i, n < room ? n : room);
+        parser->line_len += n < room ? n : room;
+        i += n;
+        if(!nl) {
+            break;
+        }
+        parser->line[parser->line_len] = '\0';
+        parser->line_len = 0;
+
+        // VALUE <key> <flags> <bytes>\r\n<data>\r\n
+        size_t bytes;
+        if(strncmp(parser->line, "VALUE ", 6) == 0
+                && sscanf(parser->line, "VALUE %*s %*u %zu", &bytes) == 1) {
+            parser->skip = bytes + 2;
+            parser->values++;
+        } else {
+            count++;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,62 @@
+#ifndef BENCH_WORKLOAD_H
+#define BENCH_WORKLOAD_H
+
+#include "bench_utils.h"
+#include <stdint.h>
+
+enum op_type {
+    op_get,
+    op_set,
+    op_ping,
+    op_types
+};
+
+enum value_dist {
+    value_fixed,    // PAYLOAD_SIZE bytes
+    value_uniform,  // from value_min up to PAYLOAD_SIZE bytes
+    value_pareto    // generalized Pareto fitted on Facebook's ETC pool
+};
+
+/*
+ * What the requests of the open loop and the YCSB-like tests are made of.
+ * Keys of keys are SET before the clients start, GETs may also ask for keys
+ * past them, which always miss.
+ */
+struct workload {
+    double read_ratio; // GETs out of the requests, SETs otherwise
+    int multiget;      // keys per GET
+    double miss_ratio; // GET keys never SET
+    struct key_dist keys;
+    enum value_dist values;
+    size_t value_min;
+};
+
+extern struct workload workload;
+
+extern const char* op_names[op_types];
+
+// Size of the next value SET
+size_t workload_value_size(uint64_t* rng);
+
+// Append the next request to buf, tell which kind it is in op. Return its
+// length.
+int workload_next(char* buf, enum op_type* op, uint64_t* rng);
+
+// Bounds of a request and of its response
+size_t workload_max_request(void);
+size_t workload_max_response(void);
+
+// Counts the responses in a stream and the values they hold. Any line other
+// than a VALUE one ends a response.
+struct resp_parser {
+    char line[256];
+    int line_len;
+    size_t skip; // bytes of the current value still to come, "\r\n" included
+    uint64_t values;
+};
+
+void resp_parser_init(struct resp_parser* parser);
+// Return the number of responses completed by buf
+int resp_parser_feed(struct resp_parser* parser, const char* buf, size_t len);
+
+#endif // BENCH_WORKLOAD_H
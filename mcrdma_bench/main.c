@@ -12,6 +12,7 @@
 #include "bench_rdma.h"
 #include "bench_tcp.h"
 #include "bench_utils.h"
+#include "bench_output.h"
 
 bool tcp = false;
 enum test_type ttype = set_get;
@@ -21,6 +22,12 @@ int iterations_per_client = 0;
 char* host = NULL;
 int port = 0;
 
+double rate = 0;
+int depth = 1;
+
+static const char* csv_path = NULL;
+static const char* json_path = NULL;
+
 pthread_barrier_t barrier;
 
 static void* single_client(void* arg) {
@@ -28,7 +35,7 @@ static void* single_client(void* arg) {
     int tid = args->tid;
     union client_handle client;
 
-    struct client_result* res = malloc(sizeof(struct client_result));
+    struct client_result* res = calloc(1, sizeof(struct client_result));
     res->status = CLIENT_UNKNOWN;
 
     if(tcp) {
@@ -45,13 +52,24 @@ static void* single_client(void* arg) {
 
     cprintf("Connection established!\n");
 
+    if(run_workload() && ttype != ping_pong) {
+        if(tcp ? bench_tcp_preload(&client, tid) : bench_rdma_preload(&client, tid)) {
+            res->status = CLIENT_ERR;
+            return res;
+        }
+    }
+
     // Wait for all clients to connect before blasting all the requests at once
     pthread_barrier_wait(&barrier);
 
+    uint64_t start = now_ns();
     if(tcp) {
         bench_tcp_worker(res, &client, tid);
     } else {
         bench_rdma_worker(res, &client, tid);
+    }
+    res->elapsed_time = now_ns() - start;
+    if(!tcp) {
         bench_rdma_destroy(&client, tid);
     }
 
@@ -61,15 +79,34 @@ static void* single_client(void* arg) {
 }
 
 int main(int argc, char** argv) {
-    if(argc != 8) {
-        printf("Usage: rdma_client NET TEST HOST PORT CLIENTS ITERS PAYLOAD_SIZE\n");
+    if(argc < 8) {
+        printf("Usage: rdma_client NET TEST HOST PORT CLIENTS ITERS PAYLOAD_SIZE [OPTIONS]\n");
         printf("\nNET:\n");
         printf("\t-r --rdma : benchmark rdma\n");
         printf("\t-t --tcp  : benchmark tcp\n");
         printf("\nTEST:\n");
         printf("\t-s --set-get    : SET_GET test\n");
         printf("\t-p --ping-pong  : PING_PONG test\n");
+        printf("\t-a --ycsb-a     : YCSB A, 50%% GETs and 50%% SETs\n");
+        printf("\t-b --ycsb-b     : YCSB B, 95%% GETs and 5%% SETs\n");
+        printf("\t-c --ycsb-c     : YCSB C, GETs only\n");
         printf("\nPAYLOAD_SIZE: size of the payload in bytes as a number. The maximum value is %d\n", MAX_PAYLOAD_SIZE);
+        printf("\nOPTIONS:\n");
+        printf("\t--rate=N    : open loop, N requests per second in total arriving as a Poisson\n");
+        printf("\t              process. ITERS becomes the requests of each client, GETs of\n");
+        printf("\t              keys SET beforehand for SET_GET\n");
+        printf("\t--depth=N   : open loop and YCSB requests a client may have in flight\n");
+        printf("\t              (default: 1)\n");
+        printf("\t--keys=N    : open loop and YCSB keys (default: ITERS)\n");
+        printf("\t--uniform   : keys are equally popular (default)\n");
+        printf("\t--zipf[=T]  : key popularity is zipfian with theta T (default: 0.99)\n");
+        printf("\t--multiget=N: keys per GET (default: 1)\n");
+        printf("\t--miss-ratio=R : fraction of GET keys never SET (default: 0)\n");
+        printf("\t--values=D  : sizes of the values SET, fixed to PAYLOAD_SIZE (default),\n");
+        printf("\t              uniform[:MIN] up to PAYLOAD_SIZE or pareto, Facebook's ETC\n");
+        printf("\t              distribution capped at PAYLOAD_SIZE\n");
+        printf("\t--csv=PATH  : append the results to a CSV file\n");
+        printf("\t--json=PATH : append the results to a file as a JSON object per line\n");
         return 0;
     } else {
         if(strcmp(argv[1], "-t") == 0 || strcmp(argv[1], "--tcp") == 0) {
@@ -85,8 +122,17 @@ int main(int argc, char** argv) {
             ttype = set_get;
         } else if(strcmp(argv[2], "-p") == 0 || strcmp(argv[2], "--ping-pong") == 0) {
             ttype = ping_pong;
+        } else if(strcmp(argv[2], "-a") == 0 || strcmp(argv[2], "--ycsb-a") == 0) {
+            ttype = ycsb_a;
+            workload.read_ratio = 0.5;
+        } else if(strcmp(argv[2], "-b") == 0 || strcmp(argv[2], "--ycsb-b") == 0) {
+            ttype = ycsb_b;
+            workload.read_ratio = 0.95;
+        } else if(strcmp(argv[2], "-c") == 0 || strcmp(argv[2], "--ycsb-c") == 0) {
+            ttype = ycsb_c;
+            workload.read_ratio = 1;
         } else {
-            printf("Unknown flag: %s\n", argv[1]);
+            printf("Unknown flag: %s\n", argv[2]);
             return 0;
         }
 
@@ -100,6 +146,79 @@ int main(int argc, char** argv) {
             return 0;
         }
         init_payload(payload_len);
+
+        long long nkeys = iterations_per_client;
+        bool zipf = false;
+        double theta = 0.99;
+        for(int i = 8; i < argc; i++) {
+            if(strncmp(argv[i], "--rate=", 7) == 0) {
+                rate = atof(argv[i] + 7);
+            } else if(strncmp(argv[i], "--depth=", 8) == 0) {
+                depth = atoi(argv[i] + 8);
+            } else if(strncmp(argv[i], "--keys=", 7) == 0) {
+                nkeys = atoll(argv[i] + 7);
+            } else if(strcmp(argv[i], "--uniform") == 0) {
+                zipf = false;
+            } else if(strcmp(argv[i], "--zipf") == 0) {
+                zipf = true;
+            } else if(strncmp(argv[i], "--zipf=", 7) == 0) {
+                zipf = true;
+                theta = atof(argv[i] + 7);
+            } else if(strncmp(argv[i], "--multiget=", 11) == 0) {
+                workload.multiget = atoi(argv[i] + 11);
+            } else if(strncmp(argv[i], "--miss-ratio=", 13) == 0) {
+                workload.miss_ratio = atof(argv[i] + 13);
+            } else if(strcmp(argv[i], "--values=fixed") == 0) {
+                workload.values = value_fixed;
+            } else if(strcmp(argv[i], "--values=uniform") == 0) {
+                workload.values = value_uniform;
+            } else if(strncmp(argv[i], "--values=uniform:", 17) == 0) {
+                workload.values = value_uniform;
+                workload.value_min = atoi(argv[i] + 17);
+            } else if(strcmp(argv[i], "--values=pareto") == 0) {
+                workload.values = value_pareto;
+            } else if(strncmp(argv[i], "--csv=", 6) == 0) {
+                csv_path = argv[i] + 6;
+            } else if(strncmp(argv[i], "--json=", 7) == 0) {
+                json_path = argv[i] + 7;
+            } else {
+                printf("Unknown option: %s\n", argv[i]);
+                return 0;
+            }
+        }
+
+        if(rate < 0) {
+            printf("Invalid rate\n");
+            return 0;
+        }
+        if(workload.multiget <= 0 || workload.multiget > MAX_MULTIGET) {
+            printf("Invalid multiget size\n");
+            return 0;
+        }
+        // The requests and responses of a whole batch must fit the buffers
+        if(depth <= 0 || depth > MAX_DEPTH
+                || depth * workload_max_request() > SAFE_BUF_SIZE
+                || depth * workload_max_response() > SAFE_BUF_SIZE) {
+            printf("Invalid depth\n");
+            return 0;
+        }
+        if(workload.miss_ratio < 0 || workload.miss_ratio > 1) {
+            printf("Invalid miss ratio\n");
+            return 0;
+        }
+        if(workload.value_min <= 0 || workload.value_min > (size_t)payload_len) {
+            printf("Invalid minimum value size\n");
+            return 0;
+        }
+        if(nkeys <= 0) {
+            printf("Invalid number of keys\n");
+            return 0;
+        }
+        if(zipf && (theta <= 0 || theta >= 1)) {
+            printf("Invalid zipf theta, it must be between 0 and 1\n");
+            return 0;
+        }
+        key_dist_init(&workload.keys, nkeys, zipf, theta);
     }
 
     struct sockaddr_in addr = {0};
@@ -118,6 +237,13 @@ int main(int argc, char** argv) {
     }
 
     printf("Starting %d clients, each client will perform %d iterations\n", clients, iterations_per_client);
+    if(rate > 0) {
+        printf("Open loop at %.0f requests per second\n", rate);
+    }
+    if(run_workload()) {
+        printf("Depth %d, %llu %s keys\n", depth, (unsigned long long)workload.keys.n,
+                workload.keys.zipf ? "zipfian" : "uniform");
+    }
 
     pthread_t threads[clients];
     bzero(&threads, sizeof(pthread_t) * clients);
@@ -151,6 +277,9 @@ int main(int argc, char** argv) {
 
             case CLIENT_OK:
                 ok++;
+                if(run_workload()) {
+                    break;
+                }
                 switch(ttype) {
                     case set_get:
                         results[i]->set_time = results[i]->set_time / iterations_per_client;
@@ -180,53 +309,77 @@ int main(int argc, char** argv) {
     printf("Outcome ERR: %d\n", err);
     printf("Outcome FAILED_CMP: %d\n", failed_cmp);
 
-    switch(ttype) {
-        case set_get: {
-            unsigned long long int sum_of_mean_times_set = 0;
-            unsigned long long int sum_of_mean_times_get = 0;
-
-            for(int i = 0; i < clients; i++) {
-                if(results[i]->set_time != 0 && results[i]->get_time != 0) {
-                    sum_of_mean_times_set += results[i]->set_time;
-                    sum_of_mean_times_get += results[i]->get_time;
-                    printf("[%02d] mean time set: %llu\n", i, results[i]->set_time);
-                    printf("[%02d] max time set: %llu\n", i, results[i]->max_set_time);
-                    printf("[%02d] min time set: %llu\n", i, results[i]->min_set_time);
-                    printf("[%02d] mean time get: %llu\n", i, results[i]->get_time);
-                    printf("[%02d] max time get: %llu\n", i, results[i]->max_get_time);
-                    printf("[%02d] min time get: %llu\n", i, results[i]->min_get_time);
+    struct bench_summary* summary = calloc(1, sizeof(struct bench_summary));
+    summary->count_values = run_workload();
+    for(int i = 0; i < clients; i++) {
+        bench_summary_add(summary, results[i]);
+    }
+
+    if(run_workload()) {
+        bench_output_text(summary);
+    } else {
+        switch(ttype) {
+            case set_get: {
+                unsigned long long int sum_of_mean_times_set = 0;
+                unsigned long long int sum_of_mean_times_get = 0;
+
+                for(int i = 0; i < clients; i++) {
+                    if(results[i]->set_time != 0 && results[i]->get_time != 0) {
+                        sum_of_mean_times_set += results[i]->set_time;
+                        sum_of_mean_times_get += results[i]->get_time;
+                        printf("[%02d] mean time set: %llu\n", i, results[i]->set_time);
+                        printf("[%02d] max time set: %llu\n", i, results[i]->max_set_time);
+                        printf("[%02d] min time set: %llu\n", i, results[i]->min_set_time);
+                        printf("[%02d] mean time get: %llu\n", i, results[i]->get_time);
+                        printf("[%02d] max time get: %llu\n", i, results[i]->max_get_time);
+                        printf("[%02d] min time get: %llu\n", i, results[i]->min_get_time);
+                    }
                 }
-            }
 
-            unsigned long long int final_mean_time_set = sum_of_mean_times_set / ok;
-            unsigned long long int final_mean_time_get = sum_of_mean_times_get / ok;
+                unsigned long long int final_mean_time_set = sum_of_mean_times_set / ok;
+                unsigned long long int final_mean_time_get = sum_of_mean_times_get / ok;
 
-            printf("Final mean time set: %llu\n", final_mean_time_set);
-            printf("Final mean time get: %llu\n", final_mean_time_get);
-            break;
-        }
-        case ping_pong: {
-            unsigned long long int sum_of_mean_times_ping = 0;
+                printf("Final mean time set: %llu\n", final_mean_time_set);
+                printf("Final mean time get: %llu\n", final_mean_time_get);
 
-            for(int i = 0; i < clients; i++) {
-                if(results[i]->ping_time != 0) {
-                    sum_of_mean_times_ping += results[i]->ping_time;
-                    printf("[%02d] mean time ping: %llu\n", i, results[i]->ping_time);
-                    printf("[%02d] max time ping: %llu\n", i, results[i]->max_ping_time);
-                    printf("[%02d] min time ping: %llu\n", i, results[i]->min_ping_time);
-                }
+                bench_hist_print(&summary->hists[op_set], "set");
+                bench_hist_print(&summary->hists[op_get], "get");
+                break;
             }
+            case ping_pong: {
+                unsigned long long int sum_of_mean_times_ping = 0;
+
+                for(int i = 0; i < clients; i++) {
+                    if(results[i]->ping_time != 0) {
+                        sum_of_mean_times_ping += results[i]->ping_time;
+                        printf("[%02d] mean time ping: %llu\n", i, results[i]->ping_time);
+                        printf("[%02d] max time ping: %llu\n", i, results[i]->max_ping_time);
+                        printf("[%02d] min time ping: %llu\n", i, results[i]->min_ping_time);
+                    }
+                }
+
+                unsigned long long int final_mean_time_ping = sum_of_mean_times_ping / ok;
 
-            unsigned long long int final_mean_time_ping = sum_of_mean_times_ping / ok;
+                printf("Final mean time ping: %llu\n", final_mean_time_ping);
 
-            printf("Final mean time ping: %llu\n", final_mean_time_ping);
-            break;
+                bench_hist_print(&summary->hists[op_ping], "ping");
+                break;
+            }
+            default:
+                printf("Unknown test type\n");
+                exit(1);
         }
-        default:
-            printf("Unknown test type\n");
-            exit(1);
     }
 
+    int ret = 0;
+    if(csv_path && bench_output_csv(csv_path, summary)) {
+        ret = 1;
+    }
+    if(json_path && bench_output_json(json_path, summary)) {
+        ret = 1;
+    }
+
+    free(summary);
     pthread_barrier_destroy(&barrier);
-    return 0;
+    return ret;
 }
\ No newline at end of file
@@ -2,6 +2,9 @@
 #define _BENCH_MAIN_H
 
 #include "../mcrdma_client/mcrdma_client.h"
+#include "bench_hist.h"
+#include "bench_utils.h"
+#include "bench_workload.h"
 #include <stdio.h>
 #include <string.h>
 
@@ -24,7 +27,11 @@
 
 enum test_type {
     set_get,
-    ping_pong
+    ping_pong,
+    // YCSB-like workloads over keys SET beforehand
+    ycsb_a, // 50% GETs, 50% SETs
+    ycsb_b, // 95% GETs, 5% SETs
+    ycsb_c  // GETs only
 };
 
 struct client_args {
@@ -52,8 +59,17 @@ struct client_result {
     unsigned long long int max_ping_time;
     unsigned long long int min_ping_time;
 
+    struct bench_hist hists[op_types];
+    unsigned long long int values; // received by GETs, open loop and YCSB only
+    unsigned long long int elapsed_time;
 };
 
+// Most requests a client may have in flight
+#define MAX_DEPTH 1024
+// Most keys of a GET, keeping its line short of the 2048 bytes the server
+// takes at once
+#define MAX_MULTIGET 100
+
 
 extern bool tcp;
 extern enum test_type ttype;
@@ -63,4 +79,15 @@ extern int iterations_per_client;
 extern char* host;
 extern int port;
 
+// Open loop: requests arrive at rate per second, split among the clients,
+// whether the previous ones got a response or not. 0 for closed loop.
+extern double rate;
+extern int depth;
+
+// Clients go through the workload rather than the closed loop SET_GET and
+// PING_PONG tests
+static inline bool run_workload(void) {
+    return rate > 0 || ttype >= ycsb_a;
+}
+
 #endif // _BENCH_MAIN_H
\ No newline at end of file
@@ -0,0 +1,64 @@
+import os
+import subprocess
+import sys
+import time
+
+# Runs the YCSB-like workloads of mcrdma_bench against a memcached instance
+# started on this machine, over TCP and RDMA, and collects the results in a
+# single CSV file. Any RDMA device works, e.g. a soft-RoCE one on top of the
+# loopback or of a regular NIC:
+#   rdma link add rxe0 type rxe netdev eth0
+#
+# Usage: python3 sweep.py MEMCACHED_BIN BENCH_BIN IP [OUTPUT]
+# IP must be an address of the RDMA device, OUTPUT defaults to
+# bench_results.csv. Results are appended, so that sweeps can be resumed.
+
+PORT = 11311
+
+NETS = ["--tcp", "--rdma"]
+WORKLOADS = ["--ycsb-a", "--ycsb-b", "--ycsb-c"]
+CLIENTS_RANGE = [1, 2, 4, 8]
+VALUE_SIZE = 1024
+ITERS = 100000
+KEYS = 100000
+EXTRA_ARGS = ["--zipf", "--depth=8", "--values=pareto"]
+
+if len(sys.argv) < 4:
+    print("Usage: python3 sweep.py MEMCACHED_BIN BENCH_BIN IP [OUTPUT]")
+    sys.exit(1)
+
+memcached_bin = sys.argv[1]
+bench_bin = sys.argv[2]
+ip = sys.argv[3]
+output = sys.argv[4] if len(sys.argv) > 4 else "bench_results.csv"
+
+def start_memcached():
+    args = [memcached_bin, "-l", ip, "-p", str(PORT), "-U", "0", "--rdma"]
+    if os.geteuid() == 0:
+        args += ["-u", "root"]
+    proc = subprocess.Popen(args, stdout = subprocess.DEVNULL, stderr = subprocess.DEVNULL)
+    # Give the server time to listen
+    time.sleep(1)
+    return proc
+
+for net in NETS:
+    for workload in WORKLOADS:
+        for clients in CLIENTS_RANGE:
+            print("Benchmarking {} {} with {} clients.".format(net, workload, clients))
+
+            # A fresh instance for every run, so that runs don't see each
+            # other's keys
+            memcached_proc = start_memcached()
+            bench = subprocess.run([bench_bin, net, workload, ip, str(PORT), str(clients),
+                                    str(ITERS), str(VALUE_SIZE), "--keys={}".format(KEYS),
+                                    "--csv={}".format(output)] + EXTRA_ARGS,
+                                   stdout = subprocess.PIPE, stderr = subprocess.STDOUT)
+            memcached_proc.terminate()
+            memcached_proc.wait()
+
+            if bench.returncode != 0:
+                print("Benchmark failed, output:")
+                print(bench.stdout.decode("UTF-8"))
+                sys.exit(1)
+
+print("Results written to {}".format(output))
@@ -2,6 +2,10 @@
 #include <rdma/rdma_cma.h>
 #include <rdma/rdma_verbs.h>
 #include "mcrdma_client_utils.h"
+#include "../mcrdma_proto.h"
+#include "../crc32c.h"
+#include <endian.h>
+#include <limits.h>
 
 int mcrdma_client_init(struct mcrdma_client *client) {
     client->echannel = rdma_create_event_channel();
@@ -66,6 +70,10 @@ int mcrdma_client_alloc_resources(struct mcrdma_client* client) {
         return -1;
     }
     client->rbuf_size = MCRDMA_BUF_SIZE;
+    // Responses may come in pieces as large as the whole buffer, unless
+    // lowered before connecting
+    client->recv_size = client->rbuf_size;
+    client->server_sbuf_size = 0;
 
     client->rbuf_mr = ibv_reg_mr(client->pd, client->rbuf, client->rbuf_size, MCRDMA_BUF_ACCESS_FLAGS);
     if(!client->rbuf_mr) {
@@ -73,6 +81,7 @@ int mcrdma_client_alloc_resources(struct mcrdma_client* client) {
         return -1;
     }
     client->rbuf_posted = false;
+    client->async = false;
 
     // Allocate and register send buffer
     client->sbuf = malloc(MCRDMA_BUF_SIZE);
@@ -88,6 +97,20 @@ int mcrdma_client_alloc_resources(struct mcrdma_client* client) {
         return -1;
     }
 
+    // Allocate and register the one-sided read buffer
+    client->obuf = malloc(MCRDMA_BUF_SIZE);
+    if(!client->obuf) {
+        mcrdma_error("Failed to allocate rdma read buffer");
+        return -1;
+    }
+    client->obuf_size = MCRDMA_BUF_SIZE;
+
+    client->obuf_mr = ibv_reg_mr(client->pd, client->obuf, client->obuf_size, IBV_ACCESS_LOCAL_WRITE);
+    if(!client->obuf_mr) {
+        mcrdma_error("Failed to register buffer memory region");
+        return -1;
+    }
+
 	client->comp_channel = ibv_create_comp_channel(client->id->verbs);
 	if (!client->comp_channel) {
 		mcrdma_error("Failed to create IO completion event channel");
@@ -113,7 +136,7 @@ int mcrdma_client_alloc_resources(struct mcrdma_client* client) {
     bzero(&qp_init_attr, sizeof qp_init_attr);
     qp_init_attr.cap.max_recv_sge = MAX_SGE;
     qp_init_attr.cap.max_send_sge = MAX_SGE;
-    qp_init_attr.cap.max_recv_wr = MAX_WR;
+    qp_init_attr.cap.max_recv_wr = MAX_RECV_WR;
     qp_init_attr.cap.max_send_wr = MAX_WR;
     qp_init_attr.qp_type = IBV_QPT_RC;
 
@@ -132,11 +155,19 @@ int mcrdma_client_alloc_resources(struct mcrdma_client* client) {
 
 int mcrdma_client_connect(struct mcrdma_client* client) {
     struct rdma_conn_param conn_param;
+    struct mcrdma_connect_data connect_data;
+
+    connect_data.version = htonl(MCRDMA_PROTO_VERSION);
+    connect_data.recv_size = htonl(client->recv_size);
+    connect_data.send_buf_size = htonl(client->server_sbuf_size);
 
 	bzero(&conn_param, sizeof(conn_param));
 	conn_param.initiator_depth = 3;
 	conn_param.responder_resources = 3;
 	conn_param.retry_count = 3; // if fail, then how many times to retry
+	conn_param.rnr_retry_count = 7; // server receive queue momentarily empty, retry indefinitely
+    conn_param.private_data = &connect_data;
+    conn_param.private_data_len = sizeof(connect_data);
 
     if (rdma_connect(client->id, &conn_param)) {
 		mcrdma_error("Failed to connect to remote host");
@@ -151,6 +182,29 @@ int mcrdma_client_connect(struct mcrdma_client* client) {
         return -1;
     }
 
+    // Older servers don't advertise anything and take whole buffers
+    client->max_send_size = client->sbuf_size;
+    client->credits = INT_MAX;
+    client->index_size = 0;
+    if(cm_event->param.conn.private_data_len >= sizeof(struct mcrdma_accept_data)) {
+        const struct mcrdma_accept_data *data = cm_event->param.conn.private_data;
+        size_t recv_size = ntohl(data->recv_size);
+        if(recv_size > 0 && recv_size < client->max_send_size) {
+            client->max_send_size = recv_size;
+        }
+        client->credits = ntohl(data->credits);
+        client->index_size = ntohl(data->index_size);
+        client->index_addr = be64toh(data->index_addr);
+        client->index_rkey = ntohl(data->index_rkey);
+        client->mem_rkey = ntohl(data->mem_rkey);
+        client->server_sbuf_size = ntohl(data->send_buf_size);
+    }
+    if(client->index_size) {
+        crc32c_init();
+    }
+    client->resp_ready = false;
+    client->resp_len = 0;
+
     if(rdma_ack_cm_event(cm_event)) {
         mcrdma_error("Failed to ack cm event");
         return -1;
@@ -181,41 +235,119 @@ int mcrdma_client_disconnect(struct mcrdma_client* client) {
     return 0;
 }
 
+// Post rbuf for the next response, or right after the part of the current
+// one received so far
 static int post_rbuf(struct mcrdma_client* client) {
     if(!client->rbuf_posted) {
-        if(rdma_post_recv(client->id, NULL, client->rbuf, client->rbuf_size, client->rbuf_mr)) {
+        if(client->resp_len == client->rbuf_size) {
+            mcrdma_log("Response larger than the receive buffer\n");
+            return -1;
+        }
+        if(rdma_post_recv(client->id, NULL, client->rbuf + client->resp_len,
+                    client->rbuf_size - client->resp_len, client->rbuf_mr)) {
             printf("post recv FAILED\n");
             return -1;
         }
+        client->rbuf_posted = true;
     }
     return 0;
 }
 
-int mcrdma_client_ascii_send(struct mcrdma_client* client, size_t len) {
-    // Pre-post rbuf
-    if(post_rbuf(client)) {
-        mcrdma_error("Failed to pre-post rbuf");
+// Reap a single work completion. Receives are handled here: credits are
+// collected and a response is kept in rbuf until mcrdma_client_ascii_recv().
+// Returns 1 for a send completion, 0 for a receive, -1 on error.
+static int poll_one(struct mcrdma_client* client) {
+    struct ibv_wc wc = {0};
+
+    //int num_wc = process_work_completion_events(client->comp_channel, &wc, 1);
+    int num_wc = poll_cq_for_wc(client->cq, &wc, 1);
+    if(num_wc < 0) {
+        mcrdma_log("Failed to process work completion events. Returned with value %d\n", num_wc);
         return -1;
     }
 
-    client->rbuf_posted = true;
+    if(!(wc.opcode & IBV_WC_RECV)) {
+        return 1;
+    }
 
-    // This send could be made unsignaled
-    if(rdma_post_send(client->id, NULL, client->sbuf, len, client->sbuf_mr, IBV_SEND_SIGNALED)) {
-        mcrdma_error("Failed posting send");
-        return -1;
+    client->rbuf_posted = false;
+    uint32_t imm = 0;
+    if(wc.wc_flags & IBV_WC_WITH_IMM) {
+        imm = ntohl(wc.imm_data);
+        client->credits += imm & ~MCRDMA_IMM_MORE;
     }
 
-    struct ibv_wc wc = {0};
+    if(wc.byte_len == 0) {
+        // Credits only, the response is still to come
+        return post_rbuf(client);
+    }
 
-    //int num_wc = process_work_completion_events(client->comp_channel, &wc, 1);
-    int num_wc = poll_cq_for_wc(client->cq, &wc, 1);
-    if(num_wc < 0) {
-        mcrdma_log("Failed to process work completion events. Returned with value %d\n", num_wc);
+    client->resp_len += wc.byte_len;
+    if(imm & MCRDMA_IMM_MORE) {
+        // Large response, the rest lands right after this part
+        return post_rbuf(client);
+    }
+    client->resp_ready = true;
+    return 0;
+}
+
+int mcrdma_client_ascii_send(struct mcrdma_client* client, size_t len) {
+    if(client->async) {
+        mcrdma_log("Blocking call on an asynchronous client\n");
         return -1;
     }
 
-    mcrdma_log("Received %d WCs\n", num_wc);
+    // Pre-post rbuf, sending a new request drops any response not read yet
+    client->resp_ready = false;
+    if(!client->rbuf_posted) {
+        client->resp_len = 0;
+    }
+    if(post_rbuf(client)) {
+        mcrdma_error("Failed to pre-post rbuf");
+        return -1;
+    }
+
+    // Requests larger than what the server can receive in one go are split
+    // over several sends, each one spending a credit. Only every MAX_WR/2-th
+    // one is signaled and waited for, so that the send queue never
+    // overflows.
+    size_t off = 0;
+    int unsignaled = 0;
+    do {
+        while(client->credits == 0) {
+            if(poll_one(client) < 0) {
+                return -1;
+            }
+        }
+
+        size_t frag = len - off;
+        if(frag > client->max_send_size) {
+            frag = client->max_send_size;
+        }
+        bool last = off + frag == len;
+        bool signaled = last || unsignaled == MAX_WR / 2 - 1;
+
+        if(rdma_post_send(client->id, NULL, client->sbuf + off, frag, client->sbuf_mr,
+                    signaled ? IBV_SEND_SIGNALED : 0)) {
+            mcrdma_error("Failed posting send");
+            return -1;
+        }
+        off += frag;
+        client->credits--;
+
+        if(!signaled) {
+            unsignaled++;
+            continue;
+        }
+        unsignaled = 0;
+
+        int ret;
+        while((ret = poll_one(client)) == 0);
+        if(ret < 0) {
+            return -1;
+        }
+    } while(off < len);
+
     return 0;
 }
 
@@ -233,20 +365,611 @@ int mcrdma_client_ascii_send_buf(struct mcrdma_client* client, char* buf, size_t
 
 int mcrdma_client_ascii_recv(struct mcrdma_client* client) {
     mcrdma_log("started receive\n");
-    struct ibv_wc wc = {0};
+    if(client->async) {
+        mcrdma_log("Blocking call on an asynchronous client\n");
+        return -1;
+    }
     if(post_rbuf(client)) {
         mcrdma_error("Failed to post recv");
         return -1;
     }
-    
-    //process_work_completion_events(client->comp_channel, &wc, 1);
-    int num_wc = poll_cq_for_wc(client->cq, &wc, 1);
-    if(num_wc < 0) {
-        mcrdma_log("Failed to process work completion events. Returned with value %d\n", num_wc);
+
+    while(!client->resp_ready) {
+        if(poll_one(client) < 0) {
+            return -1;
+        }
+    }
+
+    size_t len = client->resp_len;
+    client->resp_ready = false;
+    client->resp_len = 0;
+    return len;
+}
+
+// RDMA READ len bytes at addr into obuf, waiting for completion
+static int read_remote(struct mcrdma_client* client, size_t len, uint64_t addr, uint32_t rkey) {
+    if(rdma_post_read(client->id, NULL, client->obuf, len, client->obuf_mr,
+                IBV_SEND_SIGNALED, addr, rkey)) {
+        mcrdma_error("Failed posting read");
         return -1;
     }
 
+    int ret;
+    while((ret = poll_one(client)) == 0);
+    return ret < 0 ? -1 : 0;
+}
 
-    client->rbuf_posted = false;
-    return wc.byte_len;
-}
\ No newline at end of file
+// Regular GET, for whatever the one-sided path can't serve
+static int get_twosided(struct mcrdma_client* client, const char* key, size_t nkey,
+        char* value, size_t value_size, uint32_t* flags) {
+    int len = snprintf(client->sbuf, client->sbuf_size, "get %.*s\r\n", (int)nkey, key);
+    if(mcrdma_client_ascii_send(client, len)) {
+        return -2;
+    }
+
+    int rlen = mcrdma_client_ascii_recv(client);
+    if(rlen < 0) {
+        return -2;
+    }
+    if(rlen >= 5 && memcmp(client->rbuf, "END\r\n", 5) == 0) {
+        return -1;
+    }
+
+    // VALUE <key> <flags> <bytes>\r\n<data>\r\nEND\r\n
+    unsigned int f;
+    size_t bytes;
+    char* data = memchr(client->rbuf, '\n', rlen);
+    if(!data || sscanf(client->rbuf + 6 + nkey, "%u %zu", &f, &bytes) != 2) {
+        return -2;
+    }
+    data++;
+    if(data + bytes > client->rbuf + rlen || bytes > value_size) {
+        return -2;
+    }
+
+    memcpy(value, data, bytes);
+    if(flags) {
+        *flags = f;
+    }
+    return bytes;
+}
+
+int mcrdma_client_get_onesided(struct mcrdma_client* client, const char* key, size_t nkey,
+        char* value, size_t value_size, uint32_t* flags) {
+    if(client->async) {
+        mcrdma_log("Blocking call on an asynchronous client\n");
+        return -2;
+    }
+    if(client->index_size == 0) {
+        return get_twosided(client, key, nkey, value, value_size, flags);
+    }
+
+    uint32_t slot = crc32c(0, key, nkey) & (client->index_size - 1);
+    uint64_t entry_addr = client->index_addr + (uint64_t)slot * sizeof(struct mcrdma_index_entry);
+
+    for(int attempt = 0; attempt < ONESIDED_RETRIES; attempt++) {
+        if(read_remote(client, sizeof(struct mcrdma_index_entry), entry_addr, client->index_rkey)) {
+            return -2;
+        }
+        struct mcrdma_index_entry e;
+        memcpy(&e, client->obuf, sizeof(e));
+
+        uint32_t version = ntohl(e.version);
+        if((version & 1) || e.version != e.version_end) {
+            // Being updated
+            continue;
+        }
+
+        uint64_t addr = be64toh(e.addr);
+        size_t len = ntohl(e.len);
+        size_t value_off = ntohs(e.value_off);
+        if(addr == 0 || ntohs(e.nkey) != nkey
+                || len > client->obuf_size || value_off + 2 > len) {
+            // Empty, taken by another key or too large to read at once
+            break;
+        }
+
+        if(read_remote(client, len, addr, client->mem_rkey)) {
+            return -2;
+        }
+        if(crc32c(0, client->obuf, len) != ntohl(e.crc)) {
+            // The item changed under our feet
+            continue;
+        }
+        if(memcmp(client->obuf, key, nkey) != 0) {
+            break;
+        }
+
+        size_t bytes = len - value_off - 2;
+        if(bytes > value_size) {
+            return -2;
+        }
+        memcpy(value, client->obuf + value_off, bytes);
+        if(flags) {
+            *flags = ntohl(e.flags);
+        }
+        return bytes;
+    }
+
+    return get_twosided(client, key, nkey, value, value_size, flags);
+}
+
+int mcrdma_client_set_write(struct mcrdma_client* client, const char* key, size_t nkey,
+        uint32_t flags, uint32_t exptime, const char* value, size_t len) {
+    if(client->async) {
+        mcrdma_log("Blocking call on an asynchronous client\n");
+        return -1;
+    }
+    if(len + 2 > client->sbuf_size) {
+        mcrdma_log("Value too large\n");
+        return -1;
+    }
+
+    int cmd_len = snprintf(client->sbuf, client->sbuf_size, "set %.*s %u %u %zu rdma\r\n",
+            (int)nkey, key, flags, exptime, len);
+    if(mcrdma_client_ascii_send(client, cmd_len)) {
+        return -1;
+    }
+
+    // WRITE <token> <addr> <rkey> <len>[ <addr> <rkey> <len>...]\r\n
+    int rlen = mcrdma_client_ascii_recv(client);
+    if(rlen < 0) {
+        return -1;
+    }
+    char* line = client->rbuf;
+    line[rlen < client->rbuf_size ? rlen : client->rbuf_size - 1] = '\0';
+    uint32_t token;
+    int n;
+    if(sscanf(line, "WRITE %u%n", &token, &n) != 1) {
+        mcrdma_log("Write set refused: %s", line);
+        return -1;
+    }
+    line += n;
+
+    // The value and its \r\n are laid over the segments in order
+    memcpy(client->sbuf, value, len);
+    memcpy(client->sbuf + len, "\r\n", 2);
+
+    size_t off = 0;
+    int posted = 0;
+    unsigned long long addr;
+    uint32_t rkey;
+    size_t seg_len;
+    while(sscanf(line, " %llu %u %zu%n", &addr, &rkey, &seg_len, &n) == 3) {
+        line += n;
+        if(off + seg_len > len + 2) {
+            mcrdma_log("Segments larger than the value\n");
+            return -1;
+        }
+
+        struct ibv_sge sge;
+        sge.addr = (uintptr_t)(client->sbuf + off);
+        sge.length = seg_len;
+        sge.lkey = client->sbuf_mr->lkey;
+        off += seg_len;
+
+        struct ibv_send_wr wr = {0};
+        struct ibv_send_wr* bad_wr = NULL;
+        bool last = off == len + 2;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.wr.rdma.remote_addr = addr;
+        wr.wr.rdma.rkey = rkey;
+        wr.opcode = IBV_WR_RDMA_WRITE;
+        if(last) {
+            // Lets the server know the value is all there, which takes a
+            // receive on its side
+            wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+            wr.imm_data = htonl(token);
+            while(client->credits == 0) {
+                if(poll_one(client) < 0) {
+                    return -1;
+                }
+            }
+            client->credits--;
+            if(post_rbuf(client)) {
+                return -1;
+            }
+        }
+        // Keep the send queue from overflowing, as in ascii_send
+        bool signaled = last || ++posted % (MAX_WR / 2) == 0;
+        wr.send_flags = signaled ? IBV_SEND_SIGNALED : 0;
+
+        if(ibv_post_send(client->id->qp, &wr, &bad_wr)) {
+            mcrdma_error("Failed posting write");
+            return -1;
+        }
+        if(signaled) {
+            int ret;
+            while((ret = poll_one(client)) == 0);
+            if(ret < 0) {
+                return -1;
+            }
+        }
+        if(last) {
+            break;
+        }
+    }
+    if(off != len + 2) {
+        mcrdma_log("Segments don't cover the value\n");
+        return -1;
+    }
+
+    rlen = mcrdma_client_ascii_recv(client);
+    if(rlen < 8 || memcmp(client->rbuf, "STORED\r\n", 8) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int mcrdma_client_async_init(struct mcrdma_client* client, int recv_bufs, size_t recv_size) {
+    if(recv_bufs < 1 || recv_bufs > MAX_RECV_WR
+            || recv_size < MCRDMA_BUF_MIN || recv_size > client->rbuf_size) {
+        mcrdma_log("Invalid receive buffers\n");
+        return -1;
+    }
+
+    client->rq_mem = malloc((size_t)recv_bufs * recv_size);
+    client->chunks = malloc(recv_bufs * sizeof(struct mcrdma_chunk));
+    client->ids = malloc(ASYNC_MAX_INFLIGHT * sizeof(uint64_t));
+    if(!client->rq_mem || !client->chunks || !client->ids) {
+        mcrdma_error("Failed to allocate the asynchronous API buffers");
+        return -1;
+    }
+    client->rq_count = recv_bufs;
+    client->rq_buf_size = recv_size;
+
+    client->rq_mr = ibv_reg_mr(client->pd, client->rq_mem, (size_t)recv_bufs * recv_size,
+            MCRDMA_BUF_ACCESS_FLAGS);
+    if(!client->rq_mr) {
+        mcrdma_error("Failed to register buffer memory region");
+        return -1;
+    }
+
+    // The wr_id of a receive is the index of its buffer
+    for(int i = 0; i < recv_bufs; i++) {
+        if(rdma_post_recv(client->id, (void*)(uintptr_t)i, client->rq_mem + i * recv_size,
+                    recv_size, client->rq_mr)) {
+            mcrdma_error("Failed to post recv");
+            return -1;
+        }
+    }
+    // Keeps the server from sending more than a buffer holds
+    client->recv_size = recv_size;
+
+    client->chunk_first = 0;
+    client->chunk_count = 0;
+    client->chunk_cur = 0;
+    client->chunk_off = 0;
+    client->resp_start = 0;
+    client->line_len = 0;
+    client->data_left = 0;
+    client->data_ends_resp = false;
+    client->assembling = false;
+    client->abuf_len = 0;
+    client->ids_head = 0;
+    client->ids_tail = 0;
+    client->sq_head = 0;
+    client->sq_posted = 0;
+    client->sq_tail = 0;
+    client->sq_skip_len = 0;
+    client->send_head = 0;
+    client->send_tail = 0;
+    client->unsignaled = 0;
+    client->async = true;
+    return 0;
+}
+
+static int repost_chunk(struct mcrdma_client* client, int buf) {
+    if(rdma_post_recv(client->id, (void*)(uintptr_t)buf,
+                client->rq_mem + buf * client->rq_buf_size, client->rq_buf_size, client->rq_mr)) {
+        mcrdma_error("Failed to post recv");
+        return -1;
+    }
+    return 0;
+}
+
+// Reap every work completion available, without waiting. Credits are
+// collected, receives holding data are queued for parsing and completed
+// sends give their room in sbuf back.
+static int reap(struct mcrdma_client* client) {
+    struct ibv_wc wcs[CQ_CAPACITY];
+    int n;
+
+    do {
+        n = ibv_poll_cq(client->cq, CQ_CAPACITY, wcs);
+        if(n < 0) {
+            mcrdma_error("Failed to poll CQ for WC");
+            return -1;
+        }
+
+        for(int i = 0; i < n; i++) {
+            struct ibv_wc* wc = &wcs[i];
+            if(wc->status != IBV_WC_SUCCESS) {
+                mcrdma_log("Work completion failed: %s\n", ibv_wc_status_str(wc->status));
+                return -1;
+            }
+
+            if(!(wc->opcode & IBV_WC_RECV)) {
+                // Sends complete in order, along with the unsignaled ones
+                // before
+                client->sq_tail = client->send_ends[wc->wr_id % MAX_WR];
+                client->send_tail = wc->wr_id + 1;
+                continue;
+            }
+
+            if(wc->wc_flags & IBV_WC_WITH_IMM) {
+                // Responses are parsed as a stream, MCRDMA_IMM_MORE is
+                // irrelevant here
+                client->credits += ntohl(wc->imm_data) & ~MCRDMA_IMM_MORE;
+            }
+            if(wc->byte_len == 0) {
+                // Credits only
+                if(repost_chunk(client, wc->wr_id)) {
+                    return -1;
+                }
+                continue;
+            }
+
+            struct mcrdma_chunk* chunk =
+                &client->chunks[(client->chunk_first + client->chunk_count) % client->rq_count];
+            chunk->buf = wc->wr_id;
+            chunk->len = wc->byte_len;
+            client->chunk_count++;
+        }
+    } while(n == CQ_CAPACITY);
+
+    return 0;
+}
+
+// Whether a request of len bytes fits in sbuf, taking the room skipped at
+// its end into account
+static bool sq_fits(struct mcrdma_client* client, size_t len) {
+    size_t off = client->sq_head % client->sbuf_size;
+    size_t need = off + len > client->sbuf_size ? client->sbuf_size - off + len : len;
+    return client->ids_tail - client->ids_head < ASYNC_MAX_INFLIGHT
+        && need <= client->sbuf_size - (client->sq_head - client->sq_tail);
+}
+
+int mcrdma_client_submit(struct mcrdma_client* client, uint64_t id, const char* req, size_t len) {
+    if(!client->async) {
+        mcrdma_log("Asynchronous API not enabled\n");
+        return -1;
+    }
+    if(len == 0 || len > client->sbuf_size) {
+        mcrdma_log("Invalid request size\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!sq_fits(client, len)) {
+        // Room may come back with the sends completed so far
+        if(reap(client) || mcrdma_client_flush(client)) {
+            return -1;
+        }
+        if(!sq_fits(client, len)) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    size_t off = client->sq_head % client->sbuf_size;
+    if(off + len > client->sbuf_size) {
+        client->sq_skip_at = client->sq_head;
+        client->sq_skip_len = client->sbuf_size - off;
+        client->sq_head += client->sq_skip_len;
+        off = 0;
+    }
+    memcpy(client->sbuf + off, req, len);
+    client->sq_head += len;
+    client->ids[client->ids_tail++ % ASYNC_MAX_INFLIGHT] = id;
+    return 0;
+}
+
+int mcrdma_client_flush(struct mcrdma_client* client) {
+    if(!client->async) {
+        mcrdma_log("Asynchronous API not enabled\n");
+        return -1;
+    }
+
+    // As many sends as credits and the send queue allow, each one as large as
+    // the server takes. Only every MAX_WR/2-th one is signaled, along with
+    // the last one, so that completions keep coming back.
+    while(client->sq_posted < client->sq_head && client->credits > 0
+            && client->send_head - client->send_tail < MAX_WR) {
+        if(client->sq_skip_len && client->sq_posted == client->sq_skip_at) {
+            client->sq_posted += client->sq_skip_len;
+            client->sq_skip_len = 0;
+            continue;
+        }
+
+        size_t off = client->sq_posted % client->sbuf_size;
+        uint64_t end = client->sq_head;
+        if(client->sq_skip_len && end > client->sq_skip_at) {
+            end = client->sq_skip_at;
+        }
+        size_t len = end - client->sq_posted;
+        if(len > client->sbuf_size - off) {
+            len = client->sbuf_size - off;
+        }
+        if(len > client->max_send_size) {
+            len = client->max_send_size;
+        }
+
+        client->credits--;
+        bool signaled = client->sq_posted + len == client->sq_head
+            || client->credits == 0
+            || client->send_head + 1 - client->send_tail == MAX_WR
+            || client->unsignaled == MAX_WR / 2 - 1;
+
+        struct ibv_sge sge;
+        sge.addr = (uintptr_t)(client->sbuf + off);
+        sge.length = len;
+        sge.lkey = client->sbuf_mr->lkey;
+
+        struct ibv_send_wr wr = {0};
+        struct ibv_send_wr* bad_wr = NULL;
+        wr.wr_id = client->send_head;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = IBV_WR_SEND;
+        wr.send_flags = signaled ? IBV_SEND_SIGNALED : 0;
+        if(ibv_post_send(client->id->qp, &wr, &bad_wr)) {
+            mcrdma_error("Failed posting send");
+            return -1;
+        }
+
+        client->sq_posted += len;
+        client->send_ends[client->send_head % MAX_WR] = client->sq_posted;
+        client->send_head++;
+        client->unsignaled = signaled ? 0 : client->unsignaled + 1;
+    }
+
+    return 0;
+}
+
+// Append part of a response spanning chunks to rbuf
+static int assemble(struct mcrdma_client* client, const char* buf, size_t len) {
+    if(client->abuf_len + len > client->rbuf_size) {
+        mcrdma_log("Response larger than the receive buffer\n");
+        return -1;
+    }
+    memcpy(client->rbuf + client->abuf_len, buf, len);
+    client->abuf_len += len;
+    client->assembling = true;
+    return 0;
+}
+
+// Whether a line ends the response it belongs to. VALUE, STAT and ITEM
+// lines are followed by more, a VA line by its value only.
+static bool line_ends_resp(struct mcrdma_client* client) {
+    size_t bytes;
+    if(strncmp(client->line, "VALUE ", 6) == 0
+            && sscanf(client->line, "VALUE %*s %*u %zu", &bytes) == 1) {
+        client->data_left = bytes + 2;
+        client->data_ends_resp = false;
+        return false;
+    }
+    if(strncmp(client->line, "VA ", 3) == 0
+            && sscanf(client->line, "VA %zu", &bytes) == 1) {
+        client->data_left = bytes + 2;
+        client->data_ends_resp = true;
+        return false;
+    }
+    return strncmp(client->line, "STAT ", 5) != 0
+        && strncmp(client->line, "ITEM ", 5) != 0;
+}
+
+// Parse the current chunk on from chunk_off, adding the responses it
+// completes to comps. Returns 1 once the chunk is parsed entirely, 0 if
+// parsing has to stop before, -1 on error.
+static int parse_chunk(struct mcrdma_client* client, struct mcrdma_completion* comps, int max, int* n) {
+    struct mcrdma_chunk* chunk =
+        &client->chunks[(client->chunk_first + client->chunk_cur) % client->rq_count];
+    const char* buf = client->rq_mem + chunk->buf * client->rq_buf_size;
+    size_t len = chunk->len;
+    size_t i = client->chunk_off;
+
+    while(i < len) {
+        if(*n == max) {
+            client->chunk_off = i;
+            return 0;
+        }
+
+        bool end;
+        if(client->data_left) {
+            size_t k = len - i < client->data_left ? len - i : client->data_left;
+            client->data_left -= k;
+            i += k;
+            end = client->data_left == 0 && client->data_ends_resp;
+        } else {
+            // Lines may be split across chunks, only their beginning matters
+            const char* nl = memchr(buf + i, '\n', len - i);
+            size_t k = nl ? (size_t)(nl - (buf + i)) + 1 : len - i;
+            size_t room = sizeof(client->line) - 1 - client->line_len;
+            memcpy(client->line + client->line_len, buf + i, k < room ? k : room);
+            client->line_len += k < room ? k : room;
+            i += k;
+            if(!nl) {
+                break;
+            }
+            client->line[client->line_len] = '\0';
+            client->line_len = 0;
+            end = line_ends_resp(client);
+        }
+        if(!end) {
+            continue;
+        }
+
+        if(client->ids_head == client->ids_tail) {
+            mcrdma_log("Response to no request\n");
+            return -1;
+        }
+        struct mcrdma_completion* comp = &comps[(*n)++];
+        comp->id = client->ids[client->ids_head++ % ASYNC_MAX_INFLIGHT];
+
+        if(!client->assembling) {
+            comp->resp = buf + client->resp_start;
+            comp->len = i - client->resp_start;
+            client->resp_start = i;
+            continue;
+        }
+
+        // rbuf can't hold another one until the next poll
+        if(assemble(client, buf + client->resp_start, i - client->resp_start)) {
+            return -1;
+        }
+        comp->resp = client->rbuf;
+        comp->len = client->abuf_len;
+        client->assembling = false;
+        client->abuf_len = 0;
+        client->resp_start = i;
+        client->chunk_off = i;
+        return 0;
+    }
+
+    // What is left of the chunk begins a response, which keeps going in
+    // the next one
+    if(client->resp_start < len
+            && assemble(client, buf + client->resp_start, len - client->resp_start)) {
+        return -1;
+    }
+    client->chunk_cur++;
+    client->chunk_off = 0;
+    client->resp_start = 0;
+    return 1;
+}
+
+int mcrdma_client_poll(struct mcrdma_client* client, struct mcrdma_completion* comps, int max) {
+    if(!client->async) {
+        mcrdma_log("Asynchronous API not enabled\n");
+        return -1;
+    }
+
+    // Responses handed out by the previous poll are gone, so are the
+    // buffers they were in
+    while(client->chunk_cur > 0) {
+        if(repost_chunk(client, client->chunks[client->chunk_first].buf)) {
+            return -1;
+        }
+        client->chunk_first = (client->chunk_first + 1) % client->rq_count;
+        client->chunk_count--;
+        client->chunk_cur--;
+    }
+
+    if(reap(client) || mcrdma_client_flush(client)) {
+        return -1;
+    }
+
+    int n = 0;
+    while(n < max && client->chunk_cur < client->chunk_count) {
+        int ret = parse_chunk(client, comps, max, &n);
+        if(ret < 0) {
+            return -1;
+        }
+        if(ret == 0) {
+            break;
+        }
+    }
+    return n;
+}
@@ -3,6 +3,30 @@
 
 #include <netinet/in.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_SGE (8)
+#define MAX_WR (16)
+// Receive buffers of the asynchronous API
+#define MAX_RECV_WR (64)
+#define CQ_CAPACITY (MAX_WR + MAX_RECV_WR)
+// Requests the asynchronous API may have waiting for a response
+#define ASYNC_MAX_INFLIGHT (4096)
+// Attempts at a one-sided GET racing with updates before falling back
+#define ONESIDED_RETRIES (3)
+
+// A receive buffer of the asynchronous API holding data
+struct mcrdma_chunk {
+    int buf;      // index of the buffer
+    uint32_t len; // bytes received
+};
+
+// A response handed out by mcrdma_client_poll()
+struct mcrdma_completion {
+    uint64_t id;      // as given to mcrdma_client_submit()
+    const char* resp; // the whole response, valid until the next poll
+    size_t len;
+};
 
 struct mcrdma_client {
     struct sockaddr_in addr;
@@ -24,11 +48,76 @@ struct mcrdma_client {
     char* sbuf;
     size_t sbuf_size;
     struct ibv_mr* sbuf_mr;
-};
 
-#define CQ_CAPACITY (16)
-#define MAX_SGE (8)
-#define MAX_WR (16)
+    // Largest message the client receives at once, larger responses are
+    // split by the server and put back together in rbuf. May be lowered
+    // before connecting, down to 4096.
+    size_t recv_size;
+    // Send buffer asked to the server, 0 for its default. Set before
+    // connecting, holds what the server settled on once connected.
+    size_t server_sbuf_size;
+
+    // Largest message the server accepts, advertised when connecting
+    size_t max_send_size;
+    // Messages the server is willing to take right now
+    int credits;
+
+    // A response landed in rbuf and wasn't handed out yet
+    bool resp_ready;
+    size_t resp_len; // bytes of it received so far
+
+    // One-sided GETs, index_size is 0 if the server doesn't support them
+    uint32_t index_size;
+    uint64_t index_addr;
+    uint32_t index_rkey;
+    uint32_t mem_rkey;
+    // Destination of RDMA READs
+    char* obuf;
+    size_t obuf_size;
+    struct ibv_mr* obuf_mr;
+
+    // Asynchronous API, see mcrdma_client_async_init()
+    bool async;
+    // Receive buffers, all of them posted but the ones holding data
+    char* rq_mem;
+    struct ibv_mr* rq_mr;
+    int rq_count;
+    size_t rq_buf_size;
+    // Buffers holding data in arrival order: chunk_cur of them were parsed
+    // and get posted again by the next poll, the one after is being parsed
+    struct mcrdma_chunk* chunks;
+    int chunk_first;
+    int chunk_count;
+    int chunk_cur;
+    size_t chunk_off;  // bytes of the current chunk parsed
+    size_t resp_start; // where the response being parsed starts in it
+    // Response being parsed, rbuf puts together the ones spanning chunks
+    char line[320];    // beginning of the current line
+    size_t line_len;
+    size_t data_left;  // bytes of a value and its \r\n still to come
+    bool data_ends_resp;
+    bool assembling;
+    size_t abuf_len;
+    // Ids of the requests waiting for a response, oldest first
+    uint64_t* ids;
+    uint64_t ids_head;
+    uint64_t ids_tail;
+    // sbuf is a ring: requests are copied at sq_head, posted up to sq_posted
+    // and given back at sq_tail once their sends complete. All of them only
+    // grow, positions are taken modulo sbuf_size. A request that wouldn't fit
+    // before the end of sbuf starts over at its beginning, skipping
+    // sq_skip_len bytes from sq_skip_at.
+    uint64_t sq_head;
+    uint64_t sq_posted;
+    uint64_t sq_tail;
+    uint64_t sq_skip_at;
+    size_t sq_skip_len;
+    // End of every send in flight, by wr_id modulo MAX_WR
+    uint64_t send_ends[MAX_WR];
+    uint64_t send_head;
+    uint64_t send_tail;
+    int unsignaled;
+};
 
 int mcrdma_client_init(struct mcrdma_client *client);
 
@@ -42,4 +131,60 @@ int mcrdma_client_ascii_send_buf(struct mcrdma_client* client, char* buf, size_t
 
 int mcrdma_client_ascii_recv(struct mcrdma_client* client);
 
+/**
+ * SET a key, RDMA writing the value straight into the item allocated by the
+ * server instead of sending it. Requires the server to run with
+ * -o rdma_write_sets, meant for large values.
+ * @return          0 once stored, -1 otherwise
+ */
+int mcrdma_client_set_write(struct mcrdma_client* client, const char* key, size_t nkey,
+        uint32_t flags, uint32_t exptime, const char* value, size_t len);
+
+/**
+ * GET a key with one-sided RDMA READs, without involving the server CPU.
+ * Falls back to a regular GET if the server doesn't support it, the key is
+ * not in its index or keeps being updated while being read.
+ * @param value     where the value is copied, without the trailing "\r\n"
+ * @param flags     client flags of the item, can be NULL
+ * @return          the value length, -1 on a miss, -2 on error
+ */
+int mcrdma_client_get_onesided(struct mcrdma_client* client, const char* key, size_t nkey,
+        char* value, size_t value_size, uint32_t* flags);
+
+/**
+ * Switch the client to the asynchronous API, which lets many requests be in
+ * flight. Call it between mcrdma_client_alloc_resources() and
+ * mcrdma_client_connect(); the blocking calls above can't be used anymore.
+ * Every request must get exactly one response, i.e. no noreply or quiet
+ * mode commands.
+ * @param recv_bufs receive buffers posted, up to MAX_RECV_WR
+ * @param recv_size size of each, the largest message the server sends at
+ *                  once. At least 4096, up to rbuf_size.
+ * @return          0 on success, -1 on error
+ */
+int mcrdma_client_async_init(struct mcrdma_client* client, int recv_bufs, size_t recv_size);
+
+/**
+ * Queue an ascii request, copied to the send buffer. Queued requests are
+ * sent together by the next flush or poll.
+ * @param id        handed back along with the response
+ * @return          0 on success, -1 on error. errno is EAGAIN if too many
+ *                  requests are in flight, poll and try again.
+ */
+int mcrdma_client_submit(struct mcrdma_client* client, uint64_t id, const char* req, size_t len);
+
+/**
+ * Send the requests queued so far, as far as the server takes them.
+ * @return          0 on success, -1 on error
+ */
+int mcrdma_client_flush(struct mcrdma_client* client);
+
+/**
+ * Flush, then hand out the responses received, in the order of their
+ * requests, without waiting for any. Responses point into the receive
+ * buffers, they are valid until the next call.
+ * @return          the number of completions, up to max, -1 on error
+ */
+int mcrdma_client_poll(struct mcrdma_client* client, struct mcrdma_completion* comps, int max);
+
 #endif // MCRDMA_CLIENT_H
\ No newline at end of file
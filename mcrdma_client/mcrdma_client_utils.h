@@ -34,6 +34,8 @@
 
 // This value is tentative and a more dynamic approach might be used in the future
 #define MCRDMA_BUF_SIZE (1000000 * 2)
+// Smallest receive size servers accept
+#define MCRDMA_BUF_MIN 4096
 
 #define MCRDMA_BUF_ACCESS_FLAGS (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE)
 
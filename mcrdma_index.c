@@ -0,0 +1,135 @@
+#include "mcrdma_index.h"
+#include "mcrdma_proto.h"
+#include "crc32c.h"
+#include <arpa/inet.h>
+#include <endian.h>
+#include <stdlib.h>
+
+static struct mcrdma_index_entry *index_base = NULL;
+static uint32_t index_mask = 0;
+
+static struct {
+    uint64_t entries;    // entries pointing at an item
+    uint64_t updates;    // entries written by links and unlinks
+    uint64_t collisions; // links evicting another key from its entry
+} index_stats;
+
+static struct mcrdma_index_entry *index_entry(const char *key, size_t nkey) {
+    return &index_base[crc32c(0, key, nkey) & index_mask];
+}
+
+/*
+ * Entries are updated seqlock style: the version is odd while the other
+ * fields are being written. version_end is written last, so a remote read
+ * racing with an update sees the two versions differ. Keys sharing an entry
+ * may be covered by different item locks, so taking the entry is a CAS.
+ */
+static uint32_t index_entry_lock(struct mcrdma_index_entry *e) {
+    while(true) {
+        uint32_t raw = e->version;
+        uint32_t v = ntohl(raw);
+        if((v & 1) == 0 &&
+                __sync_bool_compare_and_swap(&e->version, raw, htonl(v + 1))) {
+            return v + 1;
+        }
+    }
+}
+
+static void index_entry_unlock(struct mcrdma_index_entry *e, uint32_t v) {
+    __sync_synchronize();
+    e->version_end = htonl(v + 1);
+    __sync_synchronize();
+    e->version = htonl(v + 1);
+    __sync_add_and_fetch(&index_stats.updates, 1);
+}
+
+// Item link hook
+static void index_link(item *it) {
+    // Chunked values aren't contiguous and extstore ones aren't in memory
+    if(it->it_flags & (ITEM_CHUNKED | ITEM_HDR)) {
+        return;
+    }
+
+    char *key = ITEM_key(it);
+    uint32_t value_off = ITEM_data(it) - key;
+    uint32_t len = value_off + it->nbytes;
+    uint32_t crc = crc32c(0, key, len);
+    uint32_t flags;
+    FLAGS_CONV(it, flags);
+
+    struct mcrdma_index_entry *e = index_entry(key, it->nkey);
+    uint32_t v = index_entry_lock(e);
+    if(e->addr == 0) {
+        __sync_add_and_fetch(&index_stats.entries, 1);
+    } else {
+        __sync_add_and_fetch(&index_stats.collisions, 1);
+    }
+    e->crc = htonl(crc);
+    e->addr = htobe64((uintptr_t)key);
+    e->len = htonl(len);
+    e->nkey = htons(it->nkey);
+    e->value_off = htons(value_off);
+    e->flags = htonl(flags);
+    index_entry_unlock(e, v);
+}
+
+// Item unlink hook
+static void index_unlink(item *it) {
+    char *key = ITEM_key(it);
+    struct mcrdma_index_entry *e = index_entry(key, it->nkey);
+
+    // Cheap check first, the entry may well belong to another key
+    if(e->addr != htobe64((uintptr_t)key)) {
+        return;
+    }
+
+    uint32_t v = index_entry_lock(e);
+    if(e->addr == htobe64((uintptr_t)key)) {
+        e->addr = 0;
+        __sync_sub_and_fetch(&index_stats.entries, 1);
+    }
+    index_entry_unlock(e, v);
+}
+
+int mcrdma_index_init(int power) {
+    size_t size = (size_t)1 << power;
+    if(posix_memalign((void **)&index_base, 64,
+                size * sizeof(struct mcrdma_index_entry)) != 0) {
+        index_base = NULL;
+        return -1;
+    }
+    memset(index_base, 0, size * sizeof(struct mcrdma_index_entry));
+    index_mask = size - 1;
+
+    crc32c_init();
+    item_set_link_hooks(index_link, index_unlink);
+    return 0;
+}
+
+bool mcrdma_index_enabled(void) {
+    return index_base != NULL;
+}
+
+struct ibv_mr *mcrdma_index_register(struct ibv_pd *pd) {
+    return ibv_reg_mr(pd, index_base,
+            (size_t)mcrdma_index_size() * sizeof(struct mcrdma_index_entry),
+            IBV_ACCESS_REMOTE_READ);
+}
+
+void *mcrdma_index_base(void) {
+    return index_base;
+}
+
+uint32_t mcrdma_index_size(void) {
+    return index_base ? index_mask + 1 : 0;
+}
+
+void mcrdma_index_stats(ADD_STAT add_stats, conn *c) {
+    APPEND_STAT("index_size", "%u", mcrdma_index_size());
+    APPEND_STAT("index_entries", "%llu",
+            (unsigned long long)__sync_add_and_fetch(&index_stats.entries, 0));
+    APPEND_STAT("index_updates", "%llu",
+            (unsigned long long)__sync_add_and_fetch(&index_stats.updates, 0));
+    APPEND_STAT("index_collisions", "%llu",
+            (unsigned long long)__sync_add_and_fetch(&index_stats.collisions, 0));
+}
@@ -0,0 +1,31 @@
+#ifndef MCRDMA_INDEX_H
+#define MCRDMA_INDEX_H
+
+#include "memcached.h"
+#include <infiniband/verbs.h>
+
+/*
+ * Index of the items living in slab memory, read by clients with one-sided
+ * RDMA READs (see struct mcrdma_index_entry). Kept up to date as items get
+ * linked and unlinked, no request ever reaches the server for such GETs.
+ */
+
+// Default number of entries, as a power of two
+#define MCRDMA_INDEX_POWER_DEFAULT 20
+#define MCRDMA_INDEX_POWER_MAX 30
+
+// Return 0 on success, -1 on failure
+int mcrdma_index_init(int power);
+
+bool mcrdma_index_enabled(void);
+
+// Register the index for remote reads with a worker's PD
+struct ibv_mr *mcrdma_index_register(struct ibv_pd *pd);
+
+void *mcrdma_index_base(void);
+
+uint32_t mcrdma_index_size(void);
+
+void mcrdma_index_stats(ADD_STAT add_stats, conn *c);
+
+#endif // MCRDMA_INDEX_H
@@ -0,0 +1,84 @@
+#ifndef MCRDMA_PROTO_H
+#define MCRDMA_PROTO_H
+
+#include <stdint.h>
+
+/*
+ * Definitions shared by the server and the rdma clients.
+ * All the multi-byte fields travel in network byte order.
+ */
+
+#define MCRDMA_PROTO_VERSION 1
+
+// Private data a client may attach to rdma_connect(), zeroes or no private
+// data at all leave the choice to the server
+struct mcrdma_connect_data {
+    uint32_t version;
+    // Largest message the client can receive, longer responses are split
+    // over several sends
+    uint32_t recv_size;
+    // Send buffer the server should set aside for the connection, i.e. how
+    // much of the responses may be in flight at once. Small value clients
+    // don't need much.
+    uint32_t send_buf_size;
+};
+
+// Set in the immediate data of a send holding part of a response, the rest
+// comes with the next sends. The other bits are credits.
+#define MCRDMA_IMM_MORE (1u << 31)
+
+// Private data attached by the server to rdma_accept()
+struct mcrdma_accept_data {
+    uint32_t version;
+    // Largest message the server can receive, clients must split anything
+    // bigger over several sends
+    uint32_t recv_size;
+    // Messages a client may send before waiting for more credits. Every
+    // send from the server returns credits in its immediate data, sends with
+    // no payload carry credits only.
+    uint32_t credits;
+    // One-sided GETs, all zero unless enabled on the server. Entries live
+    // at index_addr, the items they point at under mem_rkey.
+    uint32_t index_size; // entries, a power of two
+    uint64_t index_addr;
+    uint32_t index_rkey;
+    uint32_t mem_rkey;
+    // Sizes the server settled on: the largest message it sends and its
+    // send buffer
+    uint32_t send_size;
+    uint32_t send_buf_size;
+};
+
+// Private data attached by the server to its SIDR reply, which gives the UD
+// QP to send requests to. Requests and responses are framed as for UDP.
+struct mcrdma_ud_accept_data {
+    uint32_t version;
+    // Largest datagram the server receives, requests must fit in one
+    uint32_t recv_size;
+};
+
+/*
+ * Entry of the one-sided GET index, the one for a key is found at
+ * index_addr + (crc32c(key) & (index_size - 1)) * sizeof(entry). Entries are
+ * shared by keys, the key at addr must be checked.
+ *
+ * A client reads the entry, then len bytes at addr. The entry is only
+ * consistent if version is even and equal to version_end, the item only if
+ * its bytes match crc. Anything else means a concurrent update: retry or
+ * fall back to a regular GET.
+ * Expiration and flush_all aren't checked: such items stay visible until
+ * they get unlinked, by the LRU crawler or a regular access.
+ */
+struct mcrdma_index_entry {
+    uint32_t version;
+    uint32_t crc;        // crc32c of the len bytes at addr
+    uint64_t addr;       // item key, 0 if the entry is empty
+    uint32_t len;        // bytes from the key to the end of the value
+    uint16_t nkey;
+    uint16_t value_off;  // offset of the value from the key, the value
+                         // ends with "\r\n"
+    uint32_t flags;      // client flags
+    uint32_t version_end;
+};
+
+#endif // MCRDMA_PROTO_H
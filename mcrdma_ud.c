@@ -0,0 +1,581 @@
+#include "mcrdma_ud.h"
+#include "mcrdma.h"
+#include "mcrdma_utils.h"
+#include "mcrdma_proto.h"
+#include <rdma/rdma_cma.h>
+#include <fcntl.h>
+#include <assert.h>
+
+static struct {
+    struct rdma_event_channel *echannel;
+    struct rdma_cm_id *id;
+    struct event event;
+    // One UD QP per worker, set up along with the first SIDR request since
+    // that's when we learn which device clients are coming from
+    struct mcrdma_ud **eps;
+    int count;
+    int next; // round robin of the SIDR replies
+} ud;
+
+static void ud_free(struct mcrdma_ud *u) {
+    if(u->qp)
+        ibv_destroy_qp(u->qp);
+    if(u->recv_cq)
+        ibv_destroy_cq(u->recv_cq);
+    if(u->send_cq)
+        ibv_destroy_cq(u->send_cq);
+    if(u->comp_channel)
+        ibv_destroy_comp_channel(u->comp_channel);
+    if(u->recv_mr)
+        ibv_dereg_mr(u->recv_mr);
+    if(u->send_mr)
+        ibv_dereg_mr(u->send_mr);
+    free(u->recv_mem);
+    free(u->send_mem);
+    for(int i = 0; i < MCRDMA_UD_AH_TABLE_SIZE; i++) {
+        while(u->ahs[i]) {
+            struct mcrdma_ud_ah *a = u->ahs[i];
+            u->ahs[i] = a->next;
+            ibv_destroy_ah(a->ah);
+            free(a);
+        }
+    }
+    free(u);
+}
+
+static inline char *recv_buf(struct mcrdma_ud *u, uint64_t i) {
+    return u->recv_mem + i * (MCRDMA_UD_GRH_SIZE + u->mtu);
+}
+
+static int post_recv(struct mcrdma_ud *u, uint64_t i) {
+    struct ibv_sge sge;
+    struct ibv_recv_wr wr = {0};
+    struct ibv_recv_wr *bad_wr = NULL;
+
+    sge.addr = (uintptr_t)recv_buf(u, i);
+    sge.length = MCRDMA_UD_GRH_SIZE + u->mtu;
+    sge.lkey = u->recv_mr->lkey;
+    wr.wr_id = i;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    return ibv_post_recv(u->qp, &wr, &bad_wr);
+}
+
+// INIT, RTR then RTS: UD QPs have no peer to connect to
+static int qp_ready(struct mcrdma_ud *u) {
+    struct ibv_qp_attr attr = {0};
+
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = u->port_num;
+    attr.qkey = RDMA_UDP_QKEY;
+    if(ibv_modify_qp(u->qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX
+                | IBV_QP_PORT | IBV_QP_QKEY)) {
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    if(ibv_modify_qp(u->qp, &attr, IBV_QP_STATE)) {
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = 0;
+    if(ibv_modify_qp(u->qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN)) {
+        return -1;
+    }
+    return 0;
+}
+
+static struct mcrdma_ud *ud_new(struct mcrdma_device *dev, uint8_t port_num, size_t mtu) {
+    struct mcrdma_ud *u = calloc(1, sizeof(struct mcrdma_ud));
+    if(!u) {
+        return NULL;
+    }
+    u->dev = dev;
+    u->port_num = port_num;
+    u->mtu = mtu;
+    pthread_mutex_init(&u->stats_lock, NULL);
+
+    u->comp_channel = ibv_create_comp_channel(dev->verbs);
+    if(!u->comp_channel) {
+        mcrdma_error("Failed to create UD completion channel");
+        goto err;
+    }
+    int flags = fcntl(u->comp_channel->fd, F_GETFL, 0);
+    fcntl(u->comp_channel->fd, F_SETFL, flags | O_NONBLOCK);
+
+    // Only receives wake the conn up, sends are reaped as more are posted
+    u->recv_cq = ibv_create_cq(dev->verbs, MCRDMA_UD_RECV_DEPTH, u, u->comp_channel, 0);
+    u->send_cq = ibv_create_cq(dev->verbs, MCRDMA_UD_SEND_DEPTH, u, NULL, 0);
+    if(!u->recv_cq || !u->send_cq) {
+        mcrdma_error("Failed to create UD CQs");
+        goto err;
+    }
+
+    struct ibv_qp_init_attr qp_init_attr = {0};
+    qp_init_attr.qp_type = IBV_QPT_UD;
+    qp_init_attr.send_cq = u->send_cq;
+    qp_init_attr.recv_cq = u->recv_cq;
+    qp_init_attr.cap.max_send_wr = MCRDMA_UD_SEND_DEPTH;
+    qp_init_attr.cap.max_recv_wr = MCRDMA_UD_RECV_DEPTH;
+    qp_init_attr.cap.max_send_sge = 1;
+    qp_init_attr.cap.max_recv_sge = 1;
+    qp_init_attr.cap.max_inline_data = MCRDMA_UD_MAX_INLINE;
+    u->qp = ibv_create_qp(dev->pd, &qp_init_attr);
+    if(!u->qp) {
+        mcrdma_error("Failed to create UD QP");
+        goto err;
+    }
+    // What the device settled on
+    u->max_inline = qp_init_attr.cap.max_inline_data;
+
+    if(qp_ready(u)) {
+        mcrdma_error("Failed to bring the UD QP up");
+        goto err;
+    }
+
+    size_t recv_len = (size_t)MCRDMA_UD_RECV_DEPTH * (MCRDMA_UD_GRH_SIZE + mtu);
+    size_t send_len = (size_t)MCRDMA_UD_SEND_DEPTH * mtu;
+    u->recv_mem = malloc(recv_len);
+    u->send_mem = malloc(send_len);
+    if(!u->recv_mem || !u->send_mem) {
+        mcrdma_error("Failed to allocate UD buffers");
+        goto err;
+    }
+    u->recv_mr = ibv_reg_mr(dev->pd, u->recv_mem, recv_len, IBV_ACCESS_LOCAL_WRITE);
+    u->send_mr = ibv_reg_mr(dev->pd, u->send_mem, send_len, IBV_ACCESS_LOCAL_WRITE);
+    if(!u->recv_mr || !u->send_mr) {
+        mcrdma_error("Failed to register UD buffers");
+        goto err;
+    }
+
+    for(int i = 0; i < MCRDMA_UD_RECV_DEPTH; i++) {
+        if(post_recv(u, i)) {
+            mcrdma_error("Failed to post UD receives");
+            goto err;
+        }
+    }
+
+    if(ibv_req_notify_cq(u->recv_cq, 0)) {
+        mcrdma_error("Failed to request notifications");
+        goto err;
+    }
+    u->armed = true;
+
+    return u;
+err:
+    ud_free(u);
+    return NULL;
+}
+
+// Largest datagram of the port, in bytes
+static size_t port_mtu(struct ibv_context *verbs, uint8_t port_num) {
+    struct ibv_port_attr attr;
+    if(ibv_query_port(verbs, port_num, &attr)) {
+        return 0;
+    }
+    return (size_t)128 << attr.active_mtu;
+}
+
+// Set up the UD QPs of all the workers, on the device of the first SIDR
+// request, and hand each one to its worker as a conn
+static int ud_start(struct rdma_cm_id *id) {
+    struct mcrdma_device *dev = mcrdma_device_get(id->verbs);
+    if(!dev) {
+        return -1;
+    }
+
+    size_t mtu = port_mtu(id->verbs, id->port_num);
+    if(mtu < UDP_MAX_PAYLOAD_SIZE) {
+        // Responses are cut in UDP sized packets
+        fprintf(stderr, "rdma UD transport needs an MTU of at least %d bytes, "
+                "port %d has %zu\n", UDP_MAX_PAYLOAD_SIZE, id->port_num, mtu);
+        return -1;
+    }
+
+    ud.eps = calloc(settings.num_threads, sizeof(struct mcrdma_ud *));
+    if(!ud.eps) {
+        return -1;
+    }
+    for(int i = 0; i < settings.num_threads; i++) {
+        ud.eps[i] = ud_new(dev, id->port_num, mtu);
+        if(!ud.eps[i]) {
+            while(i-- > 0) {
+                ud_free(ud.eps[i]);
+            }
+            free(ud.eps);
+            ud.eps = NULL;
+            return -1;
+        }
+    }
+    ud.count = settings.num_threads;
+
+    // The dispatcher round-robins new conns among threads, so this is
+    // guaranteed to assign one QP to each thread, as for UDP sockets
+    for(int i = 0; i < ud.count; i++) {
+        dispatch_conn_new(ud.eps[i]->comp_channel->fd, conn_read,
+                EV_READ | EV_PERSIST, UDP_READ_BUFFER_SIZE,
+                rdma_ud_transport, NULL);
+    }
+    return 0;
+}
+
+// Answer a SIDR request with the QP of one of the workers
+static void ud_accept(struct rdma_cm_id *id) {
+    if(!ud.eps && ud_start(id) != 0) {
+        rdma_reject(id, NULL, 0);
+        return;
+    }
+    if(id->verbs != ud.eps[0]->dev->verbs) {
+        // Workers only have a UD QP on a single device
+        mcrdma_log("UD request from a second rdma device\n");
+        rdma_reject(id, NULL, 0);
+        return;
+    }
+
+    struct mcrdma_ud *u = ud.eps[ud.next++ % ud.count];
+    struct mcrdma_ud_accept_data accept_data = {0};
+    accept_data.version = htonl(MCRDMA_PROTO_VERSION);
+    accept_data.recv_size = htonl(u->mtu);
+
+    struct rdma_conn_param conn_param = {0};
+    conn_param.qp_num = u->qp->qp_num;
+    conn_param.private_data = &accept_data;
+    conn_param.private_data_len = sizeof(accept_data);
+    if(rdma_accept(id, &conn_param)) {
+        mcrdma_error("Failed to answer a UD request");
+    }
+}
+
+static void ud_listen_handler(evutil_socket_t fd, short which, void *arg) {
+    struct rdma_cm_event *cm_event = NULL;
+
+    while(rdma_get_cm_event(ud.echannel, &cm_event) == 0) {
+        struct rdma_cm_id *id = cm_event->id;
+        bool request = cm_event->event == RDMA_CM_EVENT_CONNECT_REQUEST
+            && cm_event->status == 0;
+
+        if(!request) {
+            mcrdma_log("ignoring UD cm event %s, status %d\n",
+                    rdma_event_str(cm_event->event), cm_event->status);
+        }
+        if(rdma_ack_cm_event(cm_event)) {
+            mcrdma_error("Failed to acknowledge cm event\n");
+        }
+        if(request) {
+            // Nothing to keep once answered: clients talk to a worker's QP
+            ud_accept(id);
+            rdma_destroy_id(id);
+        }
+    }
+
+    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+        mcrdma_error("Failed to retrieve a cm event");
+    }
+}
+
+int mcrdma_ud_init(struct sockaddr *sockaddr) {
+    // Peers are kept in request_addr, see try_read_udp()
+    assert(sizeof(struct mcrdma_ud_addr) <= sizeof(((conn *)0)->request_addr));
+
+    ud.echannel = rdma_create_event_channel();
+    if(!ud.echannel) {
+        mcrdma_error("cm channel creation error");
+        return -1;
+    }
+
+    if(rdma_create_id(ud.echannel, &ud.id, NULL, RDMA_PS_UDP)) {
+        mcrdma_error("rdma UD id creation error");
+        return -1;
+    }
+
+    if(rdma_bind_addr(ud.id, sockaddr)) {
+        mcrdma_error("cannot bind UD address");
+        return -1;
+    }
+
+    if(rdma_listen(ud.id, MCRDMA_BACKLOG)) {
+        mcrdma_error("rdma_listen failed for UD");
+        return -1;
+    }
+    return 0;
+}
+
+int mcrdma_ud_listen(struct event_base *base) {
+    int flags = fcntl(ud.echannel->fd, F_GETFL);
+    if(flags < 0 || fcntl(ud.echannel->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        mcrdma_error("cannot make the UD cm channel non-blocking");
+        return -1;
+    }
+
+    event_set(&ud.event, ud.echannel->fd, EV_READ | EV_PERSIST,
+            ud_listen_handler, NULL);
+    event_base_set(base, &ud.event);
+    if(event_add(&ud.event, 0) == -1) {
+        mcrdma_error("cannot add the UD cm channel to the event base");
+        return -1;
+    }
+    return 0;
+}
+
+void mcrdma_ud_destroy(void) {
+    if(!ud.id) {
+        return;
+    }
+    event_del(&ud.event);
+    rdma_destroy_id(ud.id);
+    rdma_destroy_event_channel(ud.echannel);
+}
+
+struct mcrdma_ud *mcrdma_ud_get(int sfd) {
+    for(int i = 0; i < ud.count; i++) {
+        if(ud.eps[i]->comp_channel->fd == sfd) {
+            return ud.eps[i];
+        }
+    }
+    return NULL;
+}
+
+// Address handle to answer the sender of wc, created once per host
+static struct ibv_ah *ah_get(struct mcrdma_ud *u, struct ibv_wc *wc, struct ibv_grh *grh) {
+    bool has_grh = wc->wc_flags & IBV_WC_GRH;
+    uint32_t hash = wc->slid;
+    if(has_grh) {
+        hash ^= grh->sgid.raw[15] | grh->sgid.raw[14] << 8 | grh->sgid.raw[13] << 16;
+    }
+    hash %= MCRDMA_UD_AH_TABLE_SIZE;
+
+    for(struct mcrdma_ud_ah *a = u->ahs[hash]; a; a = a->next) {
+        if(a->lid == wc->slid && a->grh == has_grh
+                && (!has_grh || memcmp(&a->gid, &grh->sgid, sizeof(a->gid)) == 0)) {
+            return a->ah;
+        }
+    }
+
+    struct mcrdma_ud_ah *a = calloc(1, sizeof(struct mcrdma_ud_ah));
+    if(!a) {
+        return NULL;
+    }
+    a->ah = ibv_create_ah_from_wc(u->dev->pd, wc, grh, u->port_num);
+    if(!a->ah) {
+        free(a);
+        return NULL;
+    }
+    a->lid = wc->slid;
+    a->grh = has_grh;
+    if(has_grh) {
+        memcpy(&a->gid, &grh->sgid, sizeof(a->gid));
+    }
+    a->next = u->ahs[hash];
+    u->ahs[hash] = a;
+
+    pthread_mutex_lock(&u->stats_lock);
+    u->stats.ahs++;
+    pthread_mutex_unlock(&u->stats_lock);
+    return a->ah;
+}
+
+/*
+ * Move receive completions to the pending queue. Notifications are requested
+ * as soon as the CQ is drained, anything landing afterwards wakes the conn up
+ * through its socket.
+ */
+static int ud_poll(struct mcrdma_ud *u) {
+    for(int pass = 0; pass < 2; pass++) {
+        int room = MCRDMA_UD_WC_BATCH * 2 - u->pending_count;
+        if(room > MCRDMA_UD_WC_BATCH) {
+            room = MCRDMA_UD_WC_BATCH;
+        }
+        int tail = (u->pending_head + u->pending_count) % (MCRDMA_UD_WC_BATCH * 2);
+        struct ibv_wc wcs[MCRDMA_UD_WC_BATCH];
+        int n = ibv_poll_cq(u->recv_cq, room, wcs);
+        if(n < 0) {
+            mcrdma_error("Failed to poll the UD CQ");
+            return -1;
+        }
+        for(int i = 0; i < n; i++) {
+            u->pending[(tail + i) % (MCRDMA_UD_WC_BATCH * 2)] = wcs[i];
+        }
+        u->pending_count += n;
+
+        if(n == room || u->armed) {
+            break;
+        }
+        if(ibv_req_notify_cq(u->recv_cq, 0)) {
+            mcrdma_error("Failed to request notifications");
+            return -1;
+        }
+        u->armed = true;
+        // Poll once more, for what landed before notifications were on
+    }
+    return 0;
+}
+
+ssize_t mcrdma_ud_recvfrom(conn *c, void *buf, size_t len,
+        struct sockaddr *addr, socklen_t *addrlen) {
+    struct mcrdma_ud *u = c->ud;
+    struct ibv_cq *ev_cq;
+    void *ev_ctx;
+    int events = 0;
+
+    while(ibv_get_cq_event(u->comp_channel, &ev_cq, &ev_ctx) == 0) {
+        events++;
+    }
+    if(events) {
+        ibv_ack_cq_events(u->recv_cq, events);
+        u->armed = false;
+    }
+
+    if(u->pending_count == 0 && ud_poll(u) != 0) {
+        return -1;
+    }
+
+    ssize_t res = -1;
+    errno = EAGAIN;
+    while(u->pending_count > 0 && res < 0) {
+        struct ibv_wc *wc = &u->pending[u->pending_head];
+        u->pending_head = (u->pending_head + 1) % (MCRDMA_UD_WC_BATCH * 2);
+        u->pending_count--;
+
+        char *rbuf = recv_buf(u, wc->wr_id);
+        if(wc->status == IBV_WC_SUCCESS && wc->byte_len >= MCRDMA_UD_GRH_SIZE) {
+            struct ibv_ah *ah = ah_get(u, wc, (struct ibv_grh *)rbuf);
+            size_t n = wc->byte_len - MCRDMA_UD_GRH_SIZE;
+            if(ah && n <= len) {
+                struct mcrdma_ud_addr peer = {0};
+                peer.family = AF_UNSPEC;
+                peer.qpn = wc->src_qp;
+                peer.ah = ah;
+                memcpy(addr, &peer, sizeof(peer));
+                *addrlen = sizeof(peer);
+                memcpy(buf, rbuf + MCRDMA_UD_GRH_SIZE, n);
+                res = n;
+
+                pthread_mutex_lock(&u->stats_lock);
+                u->stats.recvs++;
+                u->stats.recv_bytes += n;
+                pthread_mutex_unlock(&u->stats_lock);
+            }
+        }
+        if(wc->status != IBV_WC_WR_FLUSH_ERR && post_recv(u, wc->wr_id)) {
+            mcrdma_error("Failed to post a UD receive");
+        }
+    }
+
+    // Unlike a socket, the completion channel won't stay readable for the
+    // requests already reaped or left in an unarmed CQ
+    if(u->pending_count > 0 || !u->armed) {
+        event_active(&c->event, EV_READ, 0);
+    }
+    return res;
+}
+
+// Sends up to the last signaled one that completed are done
+static void send_reap(struct mcrdma_ud *u) {
+    struct ibv_wc wcs[MCRDMA_UD_WC_BATCH];
+    int n;
+    while((n = ibv_poll_cq(u->send_cq, MCRDMA_UD_WC_BATCH, wcs)) > 0) {
+        for(int i = 0; i < n; i++) {
+            if(wcs[i].status != IBV_WC_SUCCESS) {
+                mcrdma_log("UD send failed: %s\n", ibv_wc_status_str(wcs[i].status));
+            }
+            u->send_tail = wcs[i].wr_id + 1;
+        }
+    }
+}
+
+/*
+ * Responses are copied in a slot of the send buffer, or inlined when small.
+ * Like a UDP socket with a full buffer, a response is dropped when there's no
+ * slot left: clients deal with lost packets anyway.
+ */
+ssize_t mcrdma_ud_sendmsg(conn *c, struct msghdr *msg, int flags) {
+    struct mcrdma_ud *u = c->ud;
+    struct mcrdma_ud_addr peer;
+    ssize_t len = 0;
+
+    for(int i = 0; i < msg->msg_iovlen; i++) {
+        len += msg->msg_iov[i].iov_len;
+    }
+    memcpy(&peer, msg->msg_name, sizeof(peer));
+
+    if(u->send_head - u->send_tail == MCRDMA_UD_SEND_DEPTH) {
+        send_reap(u);
+    }
+    if(u->send_head - u->send_tail == MCRDMA_UD_SEND_DEPTH
+            || !peer.ah || (size_t)len > u->mtu) {
+        pthread_mutex_lock(&u->stats_lock);
+        u->stats.send_drops++;
+        pthread_mutex_unlock(&u->stats_lock);
+        return len;
+    }
+
+    char *dst = u->send_mem + (size_t)(u->send_head % MCRDMA_UD_SEND_DEPTH) * u->mtu;
+    size_t off = 0;
+    for(int i = 0; i < msg->msg_iovlen; i++) {
+        memcpy(dst + off, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+        off += msg->msg_iov[i].iov_len;
+    }
+
+    bool signaled = u->unsignaled + 1 >= MCRDMA_UD_SIGNAL_INTERVAL
+        || u->send_head - u->send_tail + 1 == MCRDMA_UD_SEND_DEPTH;
+
+    struct ibv_sge sge;
+    struct ibv_send_wr wr = {0};
+    struct ibv_send_wr *bad_wr = NULL;
+    sge.addr = (uintptr_t)dst;
+    sge.length = len;
+    sge.lkey = u->send_mr->lkey;
+    wr.wr_id = u->send_head;
+    wr.opcode = IBV_WR_SEND;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.send_flags = signaled ? IBV_SEND_SIGNALED : 0;
+    if((size_t)len <= u->max_inline) {
+        wr.send_flags |= IBV_SEND_INLINE;
+    }
+    wr.wr.ud.ah = peer.ah;
+    wr.wr.ud.remote_qpn = peer.qpn;
+    wr.wr.ud.remote_qkey = RDMA_UDP_QKEY;
+
+    if(ibv_post_send(u->qp, &wr, &bad_wr)) {
+        mcrdma_error("Failed posting a UD send");
+        return -1;
+    }
+    u->send_head++;
+    u->unsignaled = signaled ? 0 : u->unsignaled + 1;
+
+    pthread_mutex_lock(&u->stats_lock);
+    u->stats.sends++;
+    u->stats.send_bytes += len;
+    pthread_mutex_unlock(&u->stats_lock);
+    return len;
+}
+
+void mcrdma_ud_stats(ADD_STAT add_stats, conn *c) {
+    struct mcrdma_ud_stats totals = {0};
+
+    for(int i = 0; i < ud.count; i++) {
+        struct mcrdma_ud *u = ud.eps[i];
+        pthread_mutex_lock(&u->stats_lock);
+        totals.recvs += u->stats.recvs;
+        totals.recv_bytes += u->stats.recv_bytes;
+        totals.sends += u->stats.sends;
+        totals.send_bytes += u->stats.send_bytes;
+        totals.send_drops += u->stats.send_drops;
+        totals.ahs += u->stats.ahs;
+        pthread_mutex_unlock(&u->stats_lock);
+    }
+
+    APPEND_STAT("ud_qps", "%d", ud.count);
+    APPEND_STAT("ud_mtu", "%zu", ud.count ? ud.eps[0]->mtu : (size_t)0);
+    APPEND_STAT("ud_recvs", "%llu", (unsigned long long)totals.recvs);
+    APPEND_STAT("ud_recv_bytes", "%llu", (unsigned long long)totals.recv_bytes);
+    APPEND_STAT("ud_sends", "%llu", (unsigned long long)totals.sends);
+    APPEND_STAT("ud_send_bytes", "%llu", (unsigned long long)totals.send_bytes);
+    APPEND_STAT("ud_send_drops", "%llu", (unsigned long long)totals.send_drops);
+    APPEND_STAT("ud_address_handles", "%d", totals.ahs);
+}
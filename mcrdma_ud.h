@@ -0,0 +1,109 @@
+#ifndef MCRDMA_UD_H
+#define MCRDMA_UD_H
+
+#include "memcached.h"
+#include <infiniband/verbs.h>
+
+/*
+ * Unreliable Datagram transport. Every worker owns a single UD QP serving
+ * all the clients, instead of one RC QP per client: the NIC keeps no state
+ * per client, which is what lets a server take a huge fan-in of small GETs.
+ *
+ * Each QP is the socket of a conn of rdma_ud_transport, which goes through
+ * the UDP code paths of memcached (same frame header, request IDs and
+ * sequence numbers, see try_read_udp() and transmit_udp()). Clients learn the
+ * QP to talk to with a SIDR request on the RDMA port, answered with the
+ * QP number of one of the workers in a round robin fashion.
+ */
+
+// Receives posted to every UD QP, i.e. requests that may queue up
+#define MCRDMA_UD_RECV_DEPTH 1024
+// Responses a UD QP may have posted and not reaped yet, once full the next
+// ones are dropped as a UDP socket would
+#define MCRDMA_UD_SEND_DEPTH 256
+// Sends are unsignaled, except every this many
+#define MCRDMA_UD_SIGNAL_INTERVAL 16
+// Receive completions reaped at once
+#define MCRDMA_UD_WC_BATCH 32
+// Responses this small are inlined in the send WR
+#define MCRDMA_UD_MAX_INLINE 256
+// Buckets of the table caching address handles, one per client host
+#define MCRDMA_UD_AH_TABLE_SIZE 1024
+// Space taken by the GRH at the beginning of every receive buffer
+#define MCRDMA_UD_GRH_SIZE 40
+
+// What recvfrom() writes in request_addr for a UD peer
+struct mcrdma_ud_addr {
+    sa_family_t family; // AF_UNSPEC
+    uint32_t qpn;
+    struct ibv_ah *ah;
+};
+
+struct mcrdma_ud_stats {
+    uint64_t recvs;       // requests received
+    uint64_t recv_bytes;
+    uint64_t sends;       // response packets sent
+    uint64_t send_bytes;
+    uint64_t send_drops;  // response packets dropped, out of send room or AH
+    int ahs;              // address handles cached
+};
+
+struct mcrdma_ud_ah {
+    struct mcrdma_ud_ah *next;
+    uint16_t lid;
+    bool grh;
+    union ibv_gid gid;
+    struct ibv_ah *ah;
+};
+
+struct mcrdma_ud {
+    struct mcrdma_device *dev;
+    uint8_t port_num;
+    size_t mtu; // largest datagram, request or response
+
+    struct ibv_comp_channel *comp_channel; // the conn's socket
+    struct ibv_cq *recv_cq;
+    struct ibv_cq *send_cq;
+    struct ibv_qp *qp;
+    bool armed; // recv_cq notifications requested since the last event
+
+    char *recv_mem;
+    struct ibv_mr *recv_mr;
+    // Receive completions reaped and not read yet, oldest first
+    struct ibv_wc pending[MCRDMA_UD_WC_BATCH * 2];
+    int pending_head;
+    int pending_count;
+
+    char *send_mem;
+    struct ibv_mr *send_mr;
+    uint32_t send_head;
+    uint32_t send_tail;
+    int unsignaled;
+    uint32_t max_inline;
+
+    struct mcrdma_ud_ah *ahs[MCRDMA_UD_AH_TABLE_SIZE];
+
+    pthread_mutex_t stats_lock;
+    struct mcrdma_ud_stats stats;
+};
+
+// Bind the UD port space of sockaddr. Return 0 on success, -1 on failure.
+int mcrdma_ud_init(struct sockaddr *sockaddr);
+
+// Take SIDR requests from the given event base. Return 0 on success, -1 on
+// failure.
+int mcrdma_ud_listen(struct event_base *base);
+
+void mcrdma_ud_destroy(void);
+
+// The UD QP behind the socket of a conn
+struct mcrdma_ud *mcrdma_ud_get(int sfd);
+
+// Socket calls of the UDP code paths, for conns of rdma_ud_transport
+ssize_t mcrdma_ud_recvfrom(conn *c, void *buf, size_t len,
+        struct sockaddr *addr, socklen_t *addrlen);
+ssize_t mcrdma_ud_sendmsg(conn *c, struct msghdr *msg, int flags);
+
+void mcrdma_ud_stats(ADD_STAT add_stats, conn *c);
+
+#endif // MCRDMA_UD_H
@@ -35,9 +35,6 @@
         fprintf(stderr, " | errno: %s (%d)\n", strerror(errno), errno); \
     } while(0);
 
-// This value is tentative and a more dynamic approach might be used in the future
-#define MCRDMA_BUF_SIZE (1000000 * 2)
-
 #define MCRDMA_BUF_ACCESS_FLAGS (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE)
 
 /**
@@ -52,8 +49,6 @@ int mcrdma_process_event(struct rdma_event_channel *echannel,
     	enum rdma_cm_event_type expected_event,
 		struct rdma_cm_event **cm_event);
 
-int poll_wce (struct mcrdma_state* s, struct ibv_wc *wc, int max_wc);
-
 
 
 #endif // MCRDMA_UTILS_H
\ No newline at end of file
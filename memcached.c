@@ -63,6 +63,8 @@
 #endif
 
 #include "mcrdma.h"
+#include "mcrdma_index.h"
+#include "mcrdma_ud.h"
 
 /*
  * forward declarations
@@ -103,6 +105,7 @@ struct stats_state stats_state;
 struct settings settings;
 time_t process_started;     /* when the process was started */
 conn **conns;
+int max_fds;
 
 struct slab_rebalance slab_rebal;
 volatile int slab_rebalance_signal;
@@ -114,7 +117,6 @@ void *ext_storage = NULL;
 #endif
 /** file scope variables **/
 static conn *listen_conn = NULL;
-static int max_fds;
 static struct event_base *main_base;
 
 /* Default methods to read from/ write to a socket */
@@ -210,6 +212,14 @@ static void settings_init(void) {
     settings.port = 11211;
     settings.udpport = 0;
     settings.use_rdma = false;
+    settings.rdma_port = 0;
+    settings.rdma_index_power = 0;
+    settings.rdma_write_sets = false;
+    settings.rdma_ud = false;
+    settings.rdma_poll_us = 0;
+    settings.rdma_buf_size = MCRDMA_BUF_SIZE;
+    settings.rdma_buf_max = MCRDMA_BUF_MAX_DEFAULT;
+    settings.rdma_buf_cache = MCRDMA_BUF_CACHE_DEFAULT;
 #ifdef TLS
     settings.ssl_enabled = false;
     settings.ssl_ctx = NULL;
@@ -261,6 +271,7 @@ static void settings_init(void) {
     settings.temporary_ttl = 61;
     settings.idle_timeout = 0; /* disabled */
     settings.hashpower_init = 0;
+    settings.hash_layout = HASH_LAYOUT_CHAINED;
     settings.slab_reassign = true;
     settings.slab_automove = 1;
     settings.slab_automove_ratio = 0.8;
@@ -275,6 +286,8 @@ static void settings_init(void) {
     settings.drop_privileges = false;
     settings.watch_enabled = true;
     settings.read_buf_mem_limit = 0;
+    settings.latency_stats = false;
+    settings.optimistic_reads = false;
 #ifdef MEMCACHED_DEBUG
     settings.relaxed_privileges = false;
 #endif
@@ -322,7 +335,9 @@ static void *conn_timeout_thread(void *arg) {
 
             c = conns[i];
 
-            if (!IS_TCP(c->transport))
+            /* RDMA connections go idle just like TCP ones, their CM event
+             * channel standing for the socket */
+            if (!IS_TCP(c->transport) && !IS_RDMA(c->transport))
                 continue;
 
             if (c->state != conn_new_cmd && c->state != conn_read)
@@ -518,7 +533,11 @@ void conn_close_idle(conn *c) {
         c->close_reason = IDLE_TIMEOUT_CLOSE;
 
         conn_set_state(c, conn_closing);
-        drive_machine(c);
+        if (IS_RDMA(c->transport)) {
+            mcrdma_state_machine(c);
+        } else {
+            drive_machine(c);
+        }
     }
 }
 
@@ -532,6 +551,10 @@ void conn_worker_readd(conn *c) {
             return;
         }
     }
+    if (IS_RDMA(c->transport)) {
+        mcrdma_conn_readd(c);
+        return;
+    }
     c->ev_flags = EV_READ | EV_PERSIST;
     event_set(&c->event, c->sfd, c->ev_flags, event_handler, (void *)c);
     event_base_set(c->thread->base, &c->event);
@@ -623,6 +646,7 @@ void conn_io_queue_complete(conn *c) {
         qcb++;
         q++;
     }
+    latency_io_done(c);
 }
 
 // called to return a single IO object to the original worker thread.
@@ -632,6 +656,37 @@ void conn_io_queue_return(io_pending_t *io) {
     return;
 }
 
+/*
+ * Pick the command parser for c->protocol. Shared by every stream transport,
+ * UDP sets its own.
+ */
+void conn_init_protocol(conn *c) {
+    switch (c->protocol) {
+        case ascii_prot:
+            if (settings.auth_file == NULL) {
+                c->authenticated = true;
+                c->try_read_command = try_read_command_ascii;
+            } else {
+                c->authenticated = false;
+                c->try_read_command = try_read_command_asciiauth;
+            }
+            break;
+        case binary_prot:
+            // binprot handles its own authentication via SASL parsing.
+            c->authenticated = false;
+            c->try_read_command = try_read_command_binary;
+            break;
+        case negotiating_prot:
+            c->try_read_command = try_read_command_negotiate;
+            break;
+#ifdef PROXY
+        case proxy_prot:
+            c->try_read_command = try_read_command_proxy;
+            break;
+#endif
+    }
+}
+
 conn *conn_new(const int sfd, enum conn_states init_state,
                 const int event_flags,
                 const int read_buffer_size, enum network_transport transport,
@@ -743,6 +798,8 @@ conn *conn_new(const int sfd, enum conn_states init_state,
     c->mset_res = false;
     c->close_after_write = false;
     c->last_cmd_time = current_time; /* initialize for idle kicker */
+    c->recv_time = 0;
+    c->latency_op = LATENCY_NONE;
     // wipe all queues.
     memset(c->io_queues, 0, sizeof(c->io_queues));
     c->io_queues_submitted = 0;
@@ -770,33 +827,17 @@ conn *conn_new(const int sfd, enum conn_states init_state,
         c->write = tcp_write;
     }
 
+    if (IS_RDMA_UD(transport)) {
+        c->ud = mcrdma_ud_get(sfd);
+        c->read = NULL;
+        c->sendmsg = mcrdma_ud_sendmsg;
+        c->write = NULL;
+    }
+
     if (IS_UDP(transport)) {
         c->try_read_command = try_read_command_udp;
     } else {
-        switch (c->protocol) {
-            case ascii_prot:
-                if (settings.auth_file == NULL) {
-                    c->authenticated = true;
-                    c->try_read_command = try_read_command_ascii;
-                } else {
-                    c->authenticated = false;
-                    c->try_read_command = try_read_command_asciiauth;
-                }
-                break;
-            case binary_prot:
-                // binprot handles its own authentication via SASL parsing.
-                c->authenticated = false;
-                c->try_read_command = try_read_command_binary;
-                break;
-            case negotiating_prot:
-                c->try_read_command = try_read_command_negotiate;
-                break;
-#ifdef PROXY
-            case proxy_prot:
-                c->try_read_command = try_read_command_proxy;
-                break;
-#endif
-        }
+        conn_init_protocol(c);
     }
 
     event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
@@ -1437,6 +1478,7 @@ void complete_nread(conn *c) {
         complete_nread_proxy(c);
 #endif
     }
+    latency_cmd_done(c);
 }
 
 /* Destination must always be chunked */
@@ -1653,8 +1695,10 @@ enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t h
 
         if (do_store) {
             STORAGE_delete(c->thread->storage, old_it);
-            item_replace(old_it, it, hv);
-            stored = STORED;
+            /* On failure the old item is gone all the same, like when the
+             * new one can't be allocated */
+            if (item_replace(old_it, it, hv))
+                stored = STORED;
         }
 
         do_item_remove(old_it);         /* release our reference */
@@ -1689,8 +1733,8 @@ enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t h
         }
 
         if (do_store) {
-            do_item_link(it, hv);
-            stored = STORED;
+            if (do_item_link(it, hv))
+                stored = STORED;
         }
     }
 
@@ -1743,6 +1787,8 @@ void server_stats(ADD_STAT add_stats, conn *c) {
     threadlocal_stats_aggregate(&thread_stats);
     struct slab_stats slab_stats;
     slab_stats_aggregate(&thread_stats, &slab_stats);
+    uint64_t expand_moved, expand_total;
+    assoc_expand_progress(&expand_moved, &expand_total);
 #ifndef WIN32
     struct rusage usage;
     getrusage(RUSAGE_SELF, &usage);
@@ -1790,6 +1836,9 @@ void server_stats(ADD_STAT add_stats, conn *c) {
     APPEND_STAT("get_misses", "%llu", (unsigned long long)thread_stats.get_misses);
     APPEND_STAT("get_expired", "%llu", (unsigned long long)thread_stats.get_expired);
     APPEND_STAT("get_flushed", "%llu", (unsigned long long)thread_stats.get_flushed);
+    if (settings.optimistic_reads) {
+        APPEND_STAT("get_optimistic_fallbacks", "%llu", (unsigned long long)thread_stats.get_optimistic_fallbacks);
+    }
 #ifdef EXTSTORE
     if (c->thread->storage) {
         APPEND_STAT("get_extstore", "%llu", (unsigned long long)thread_stats.get_extstore);
@@ -1836,6 +1885,8 @@ void server_stats(ADD_STAT add_stats, conn *c) {
     APPEND_STAT("hash_power_level", "%u", stats_state.hash_power_level);
     APPEND_STAT("hash_bytes", "%llu", (unsigned long long)stats_state.hash_bytes);
     APPEND_STAT("hash_is_expanding", "%u", stats_state.hash_is_expanding);
+    APPEND_STAT("hash_expand_buckets", "%llu", (unsigned long long)expand_total);
+    APPEND_STAT("hash_expand_buckets_moved", "%llu", (unsigned long long)expand_moved);
     if (settings.slab_reassign) {
         APPEND_STAT("slab_reassign_rescues", "%llu", stats.slab_reassign_rescues);
         APPEND_STAT("slab_reassign_chunk_rescues", "%llu", stats.slab_reassign_chunk_rescues);
@@ -1924,6 +1975,8 @@ void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("flush_enabled", "%s", settings.flush_enabled ? "yes" : "no");
     APPEND_STAT("dump_enabled", "%s", settings.dump_enabled ? "yes" : "no");
     APPEND_STAT("hash_algorithm", "%s", settings.hash_algorithm);
+    APPEND_STAT("hash_layout", "%s",
+            settings.hash_layout == HASH_LAYOUT_BUCKETS ? "buckets" : "chained");
     APPEND_STAT("lru_maintainer_thread", "%s", settings.lru_maintainer_thread ? "yes" : "no");
     APPEND_STAT("lru_segmented", "%s", settings.lru_segmented ? "yes" : "no");
     APPEND_STAT("hot_lru_pct", "%d", settings.hot_lru_pct);
@@ -1937,6 +1990,8 @@ void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("worker_logbuf_size", "%u", settings.logger_buf_size);
     APPEND_STAT("read_buf_mem_limit", "%u", settings.read_buf_mem_limit);
     APPEND_STAT("track_sizes", "%s", item_stats_sizes_status() ? "yes" : "no");
+    APPEND_STAT("latency_stats", "%s", settings.latency_stats ? "yes" : "no");
+    APPEND_STAT("optimistic_reads", "%s", settings.optimistic_reads ? "yes" : "no");
     APPEND_STAT("inline_ascii_response", "%s", "no"); // setting is dead, cannot be yes.
 #ifdef HAVE_DROP_PRIVILEGES
     APPEND_STAT("drop_privileges", "%s", settings.drop_privileges ? "yes" : "no");
@@ -2263,7 +2318,8 @@ enum delta_result_type do_add_delta(conn *c, const char *key, const size_t nkey,
     res = strlen(buf);
     /* refcount == 2 means we are the only ones holding the item, and it is
      * linked. We hold the item's lock in this function, so refcount cannot
-     * increase. */
+     * increase once optimistic readers are done with it. */
+    item_hazard_wait(it);
     if (res + 2 <= it->nbytes && it->refcount == 2) { /* replace in-place */
         /* When changing the value without replacing the item, we
            need to update the CAS on the existing item. */
@@ -2287,7 +2343,11 @@ enum delta_result_type do_add_delta(conn *c, const char *key, const size_t nkey,
         }
         memcpy(ITEM_data(new_it), buf, res);
         memcpy(ITEM_data(new_it) + res, "\r\n", 2);
-        item_replace(it, new_it, hv);
+        if (!item_replace(it, new_it, hv)) {
+            do_item_remove(new_it);
+            do_item_remove(it);
+            return EOM;
+        }
         // Overwrite the older item's CAS with our new CAS since we're
         // returning the CAS of the old item below.
         ITEM_set_cas(it, (settings.use_cas) ? ITEM_get_cas(new_it) : 0);
@@ -2360,14 +2420,23 @@ static enum try_read_result try_read_udp(conn *c) {
     assert(c != NULL);
 
     c->request_addr_size = sizeof(c->request_addr);
-    res = recvfrom(c->sfd, c->rbuf, c->rsize,
-                   0, (struct sockaddr *)&c->request_addr,
-                   &c->request_addr_size);
+    if (IS_RDMA_UD(c->transport)) {
+        res = mcrdma_ud_recvfrom(c, c->rbuf, c->rsize,
+                                 (struct sockaddr *)&c->request_addr,
+                                 &c->request_addr_size);
+    } else {
+        res = recvfrom(c->sfd, c->rbuf, c->rsize,
+                       0, (struct sockaddr *)&c->request_addr,
+                       &c->request_addr_size);
+    }
     if (res > 8) {
         unsigned char *buf = (unsigned char *)c->rbuf;
         pthread_mutex_lock(&c->thread->stats.mutex);
         c->thread->stats.bytes_read += res;
         pthread_mutex_unlock(&c->thread->stats.mutex);
+        if (c->thread->latency) {
+            c->recv_time = latency_now();
+        }
 
         /* Beginning of UDP packet is the request ID; save it. */
         c->request_id = buf[0] * 256 + buf[1];
@@ -2442,42 +2511,17 @@ enum try_read_result try_read_network(conn *c) {
             pthread_mutex_lock(&c->thread->stats.mutex);
             c->thread->stats.bytes_read += res;
             pthread_mutex_unlock(&c->thread->stats.mutex);
-
-            if(IS_RDMA(c->transport) && c->rdma->pinged) {
-                c->rdma->pinged = false;
-                return READ_NO_DATA_RECEIVED;
+            if (c->thread->latency) {
+                c->recv_time = latency_now();
             }
 
-            // Check for PING PONG
-            if(memcmp(c->rbuf + c->rbytes, "PING\r\n", res) == 0) {
-                // It is a PING request, send back a PONG
-                //resp_start(c);
-                //out_string(c, "PONG");
-                //conn_set_state(c, conn_mwrite);
-                struct iovec iov[1];
-                iov[0].iov_base = "PONG\r\n";
-                iov[0].iov_len = 6;
-                struct msghdr msg;
-                msg.msg_name = NULL;
-                msg.msg_namelen = 0;
-                msg.msg_iov = iov;
-                msg.msg_iovlen = 1;
-                msg.msg_control = NULL;
-                msg.msg_controllen = 0;
-                msg.msg_flags = 0;
-                c->sendmsg(c, &msg, 0);
-                return READ_NO_DATA_RECEIVED;
-                // We use READ_MEMORY_ERROR as it will not cause the caller to change the state
-                // return READ_MEMORY_ERROR;
+            gotdata = READ_DATA_RECEIVED;
+            c->rbytes += res;
+            if (res == avail && c->rbuf_malloced) {
+                // Resize rbuf and try a few times if huge ascii multiget.
+                continue;
             } else {
-                gotdata = READ_DATA_RECEIVED;
-                c->rbytes += res;
-                if (res == avail && c->rbuf_malloced) {
-                    // Resize rbuf and try a few times if huge ascii multiget.
-                    continue;
-                } else {
-                    break;
-                }
+                break;
             }
         }
         if (res == 0) {
@@ -2719,7 +2763,8 @@ enum transmit_result transmit(conn *c) {
     }
 
     if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-        if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+        // RDMA conns are resumed by their send completion instead.
+        if (!IS_RDMA(c->transport) && !update_event(c, EV_WRITE | EV_PERSIST)) {
             if (settings.verbose > 0)
                 fprintf(stderr, "Couldn't update event\n");
             conn_set_state(c, conn_closing);
@@ -2838,7 +2883,12 @@ static enum transmit_result transmit_udp(conn *c) {
     ssize_t res;
     msg.msg_iovlen = iovused;
     // NOTE: uses system sendmsg since we have no support for indirect UDP.
-    res = sendmsg(c->sfd, &msg, 0);
+    // RDMA datagrams are the exception.
+    if (IS_RDMA_UD(c->transport)) {
+        res = c->sendmsg(c, &msg, 0);
+    } else {
+        res = sendmsg(c->sfd, &msg, 0);
+    }
     if (res >= 0) {
         pthread_mutex_lock(&c->thread->stats.mutex);
         c->thread->stats.bytes_written += res;
@@ -3994,6 +4044,9 @@ static void usage(void) {
            "                          disabled by default; very dangerous option.\n"
            "   - hash_algorithm:      the hash table algorithm\n"
            "                          default is murmur3 hash. options: jenkins, murmur3, xxh3\n"
+           "   - hash_layout:         chained: items chained from each bucket (default)\n"
+           "                          buckets: 64 byte buckets of tagged items, fewer\n"
+           "                          cache misses per lookup for 8x the table memory\n"
            "   - no_lru_crawler:      disable LRU Crawler background thread.\n"
            "   - lru_crawler_sleep:   microseconds to sleep between items\n"
            "                          default is %d.\n"
@@ -4023,6 +4076,10 @@ static void usage(void) {
            "   - worker_logbuf_size:  size in kilobytes of per-worker-thread buffer\n"
            "                          read by background thread, then written to watchers. (default: %u)\n"
            "   - track_sizes:         enable dynamic reports for 'stats sizes' command.\n"
+           "   - latency_stats:       time get/set/delete/meta commands for 'stats latency'.\n"
+           "   - optimistic_reads:    look items up for gets without taking the item\n"
+           "                          lock, retrying under it on conflicts. chained\n"
+           "                          hash_layout only\n"
            "   - no_hashexpand:       disables hash table expansion (dangerous)\n"
            "   - modern:              enables options which will be default in future.\n"
            "                          currently: nothing\n"
@@ -4032,6 +4089,32 @@ static void usage(void) {
     verify_default("tail_repair_time", settings.tail_repair_time == TAIL_REPAIR_TIME_DEFAULT);
     verify_default("lru_crawler_tocrawl", settings.lru_crawler_tocrawl == 0);
     verify_default("idle_timeout", settings.idle_timeout == 0);
+    printf("   - rdma_onesided:       let RDMA clients GET with one-sided reads. Needs\n"
+           "                          preallocated memory (-L). Optional value: index\n"
+           "                          entries as a power of 2 (default: %d)\n",
+           MCRDMA_INDEX_POWER_DEFAULT);
+    printf("   - rdma_write_sets:     let RDMA clients write large values straight into\n"
+           "                          slab memory. Only for trusted clients.\n");
+    printf("   - rdma_ud:             also take UDP style requests over RDMA datagrams,\n"
+           "                          one UD QP per worker serving every client\n");
+    printf("   - rdma_poll_us:        busy poll RDMA completions for this many\n"
+           "                          microseconds, up to 1000, before sleeping\n"
+           "                          (default: %d)\n",
+           settings.rdma_poll_us);
+    verify_default("rdma_poll_us", settings.rdma_poll_us == 0);
+    printf("   - rdma_port:           port RDMA connections are accepted on\n"
+           "                          (default: same as the TCP port)\n");
+    verify_default("rdma_port", settings.rdma_port == 0);
+    printf("   - rdma_buf_size:       bytes of responses an RDMA connection may have\n"
+           "                          in flight, unless the client asks (default: %u)\n",
+           settings.rdma_buf_size);
+    verify_default("rdma_buf_size", settings.rdma_buf_size == MCRDMA_BUF_SIZE);
+    printf("   - rdma_buf_max:        largest such buffer a client may ask for\n"
+           "                          (default: %u)\n", settings.rdma_buf_max);
+    verify_default("rdma_buf_max", settings.rdma_buf_max == MCRDMA_BUF_MAX_DEFAULT);
+    printf("   - rdma_buf_cache:      RDMA send buffers of each size kept registered\n"
+           "                          for reuse (default: %d)\n", settings.rdma_buf_cache);
+    verify_default("rdma_buf_cache", settings.rdma_buf_cache == MCRDMA_BUF_CACHE_DEFAULT);
 #ifdef HAVE_DROP_PRIVILEGES
     printf("   - drop_privileges:     enable dropping extra syscall privileges\n"
            "   - no_drop_privileges:  disable drop_privileges in case it causes issues with\n"
@@ -4104,7 +4187,7 @@ static void usage(void) {
     verify_default("ssl_min_version", settings.ssl_min_version == TLS1_2_VERSION);
 #endif
     printf("-N, --napi_ids            number of napi ids. see doc/napi_ids.txt for more details\n");
-    printf("-g, --rdma                use RDMA for networking\n");
+    printf("-g, --rdma                also accept RDMA connections\n");
     return;
 }
 
@@ -4450,6 +4533,7 @@ static int _mc_meta_save_cb(const char *tag, void *ctx, void *data) {
     restart_set_kv(ctx, "oldest_cas", "%llu", (unsigned long long) settings.oldest_cas);
     restart_set_kv(ctx, "logger_gid", "%llu", logger_get_gid());
     restart_set_kv(ctx, "hashpower", "%u", stats_state.hash_power_level);
+    restart_set_kv(ctx, "curr_items", "%llu", (unsigned long long) stats_state.curr_items);
     // NOTE: oldest_live is a rel_time_t, which aliases for unsigned int.
     // should future proof this with a 64bit upcast, or fetch value from a
     // converter function/macro?
@@ -4479,6 +4563,7 @@ static int _mc_meta_load_cb(const char *tag, void *ctx, void *data) {
     meta->time_delta = 0;
     meta->current_time = 0;
     int lines_seen = 0;
+    uint64_t curr_items = 0;
 
     // TODO: not sure this is any better than just doing an if/else tree with
     // strcmp's...
@@ -4500,6 +4585,7 @@ static int _mc_meta_load_cb(const char *tag, void *ctx, void *data) {
         R_STOP_TIME,
         R_PROCESS_STARTED,
         R_HASHPOWER,
+        R_CURR_ITEMS,
     };
 
     const char *opts[] = {
@@ -4520,6 +4606,7 @@ static int _mc_meta_load_cb(const char *tag, void *ctx, void *data) {
         [R_STOP_TIME] = "stop_time",
         [R_PROCESS_STARTED] = "process_started",
         [R_HASHPOWER] = "hashpower",
+        [R_CURR_ITEMS] = "curr_items",
         NULL
     };
 
@@ -4663,6 +4750,13 @@ static int _mc_meta_load_cb(const char *tag, void *ctx, void *data) {
                 settings.hashpower_init = val_uint;
             }
             break;
+        case R_CURR_ITEMS:
+            // optional, not in files from older versions.
+            lines_seen--;
+            if (!safe_strtoull(val, &curr_items)) {
+                reuse_mmap = -1;
+            }
+            break;
         default:
             fprintf(stderr, "[restart] unhandled key: %s\n", key);
         }
@@ -4678,6 +4772,15 @@ static int _mc_meta_load_cb(const char *tag, void *ctx, void *data) {
         reuse_mmap = -1;
     }
 
+    // The hash table may have been due to grow. Size it for all the items
+    // at once rather than have it expand right after relinking them.
+    if (reuse_mmap == 0 && settings.hashpower_init != 0) {
+        while (settings.hashpower_init < HASHPOWER_MAX &&
+               curr_items > (((uint64_t)1 << settings.hashpower_init) * 3) / 2) {
+            settings.hashpower_init++;
+        }
+    }
+
     return reuse_mmap;
 }
 
@@ -4723,6 +4826,7 @@ int main (int argc, char **argv) {
         SLAB_AUTOMOVE_WINDOW,
         TAIL_REPAIR_TIME,
         HASH_ALGORITHM,
+        HASH_LAYOUT,
         LRU_CRAWLER,
         LRU_CRAWLER_SLEEP,
         LRU_CRAWLER_TOCRAWL,
@@ -4753,6 +4857,16 @@ int main (int argc, char **argv) {
         RESP_OBJ_MEM_LIMIT,
         READ_BUF_MEM_LIMIT,
         META_RESPONSE_OLD,
+        LATENCY_STATS,
+        OPTIMISTIC_READS,
+        RDMA_ONESIDED,
+        RDMA_WRITE_SETS,
+        RDMA_UD,
+        RDMA_POLL_US,
+        RDMA_PORT,
+        RDMA_BUF_SIZE,
+        RDMA_BUF_MAX,
+        RDMA_BUF_CACHE,
 #ifdef TLS
         SSL_CERT,
         SSL_KEY,
@@ -4782,6 +4896,7 @@ int main (int argc, char **argv) {
         [SLAB_AUTOMOVE_WINDOW] = "slab_automove_window",
         [TAIL_REPAIR_TIME] = "tail_repair_time",
         [HASH_ALGORITHM] = "hash_algorithm",
+        [HASH_LAYOUT] = "hash_layout",
         [LRU_CRAWLER] = "lru_crawler",
         [LRU_CRAWLER_SLEEP] = "lru_crawler_sleep",
         [LRU_CRAWLER_TOCRAWL] = "lru_crawler_tocrawl",
@@ -4812,6 +4927,16 @@ int main (int argc, char **argv) {
         [RESP_OBJ_MEM_LIMIT] = "resp_obj_mem_limit",
         [READ_BUF_MEM_LIMIT] = "read_buf_mem_limit",
         [META_RESPONSE_OLD] = "meta_response_old",
+        [LATENCY_STATS] = "latency_stats",
+        [OPTIMISTIC_READS] = "optimistic_reads",
+        [RDMA_ONESIDED] = "rdma_onesided",
+        [RDMA_WRITE_SETS] = "rdma_write_sets",
+        [RDMA_UD] = "rdma_ud",
+        [RDMA_POLL_US] = "rdma_poll_us",
+        [RDMA_PORT] = "rdma_port",
+        [RDMA_BUF_SIZE] = "rdma_buf_size",
+        [RDMA_BUF_MAX] = "rdma_buf_max",
+        [RDMA_BUF_CACHE] = "rdma_buf_cache",
 #ifdef TLS
         [SSL_CERT] = "ssl_chain_cert",
         [SSL_KEY] = "ssl_key",
@@ -5270,6 +5395,20 @@ int main (int argc, char **argv) {
                     return 1;
                 }
                 break;
+            case HASH_LAYOUT:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing hash_layout argument\n");
+                    return 1;
+                };
+                if (strcmp(subopts_value, "chained") == 0) {
+                    settings.hash_layout = HASH_LAYOUT_CHAINED;
+                } else if (strcmp(subopts_value, "buckets") == 0) {
+                    settings.hash_layout = HASH_LAYOUT_BUCKETS;
+                } else {
+                    fprintf(stderr, "Unknown hash_layout option (chained, buckets)\n");
+                    return 1;
+                }
+                break;
             case LRU_CRAWLER:
                 start_lru_crawler = true;
                 break;
@@ -5421,6 +5560,83 @@ int main (int argc, char **argv) {
             case META_RESPONSE_OLD:
                 settings.meta_response_old = true;
                 break;
+            case LATENCY_STATS:
+                settings.latency_stats = true;
+                break;
+            case OPTIMISTIC_READS:
+                settings.optimistic_reads = true;
+                break;
+            case RDMA_ONESIDED:
+                settings.rdma_index_power = MCRDMA_INDEX_POWER_DEFAULT;
+                if (subopts_value != NULL) {
+                    settings.rdma_index_power = atoi(subopts_value);
+                }
+                if (settings.rdma_index_power < 1 ||
+                        settings.rdma_index_power > MCRDMA_INDEX_POWER_MAX) {
+                    fprintf(stderr, "rdma_onesided index power must be between 1 and %d\n",
+                            MCRDMA_INDEX_POWER_MAX);
+                    return 1;
+                }
+                break;
+            case RDMA_WRITE_SETS:
+                settings.rdma_write_sets = true;
+                break;
+            case RDMA_UD:
+                settings.rdma_ud = true;
+                break;
+            case RDMA_POLL_US:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_poll_us value\n");
+                    return 1;
+                }
+                settings.rdma_poll_us = atoi(subopts_value);
+                if (settings.rdma_poll_us > 1000 || settings.rdma_poll_us < 0) {
+                    fprintf(stderr, "rdma_poll_us must be between 0 and 1000\n");
+                    return 1;
+                }
+                break;
+            case RDMA_PORT:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_port value\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.rdma_port) ||
+                        settings.rdma_port <= 0 || settings.rdma_port > 65535) {
+                    fprintf(stderr, "rdma_port must be between 1 and 65535\n");
+                    return 1;
+                }
+                break;
+            case RDMA_BUF_SIZE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_buf_size value\n");
+                    return 1;
+                }
+                if (!safe_strtoul(subopts_value, &settings.rdma_buf_size)) {
+                    fprintf(stderr, "could not parse argument to rdma_buf_size\n");
+                    return 1;
+                }
+                break;
+            case RDMA_BUF_MAX:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_buf_max value\n");
+                    return 1;
+                }
+                if (!safe_strtoul(subopts_value, &settings.rdma_buf_max)) {
+                    fprintf(stderr, "could not parse argument to rdma_buf_max\n");
+                    return 1;
+                }
+                break;
+            case RDMA_BUF_CACHE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_buf_cache value\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.rdma_buf_cache) ||
+                        settings.rdma_buf_cache < 0) {
+                    fprintf(stderr, "could not parse argument to rdma_buf_cache\n");
+                    return 1;
+                }
+                break;
 #ifdef TLS
             case SSL_CERT:
                 if (subopts_value == NULL) {
@@ -5629,6 +5845,11 @@ int main (int argc, char **argv) {
         exit(EX_USAGE);
     }
 
+    if (settings.optimistic_reads && settings.hash_layout != HASH_LAYOUT_CHAINED) {
+        fprintf(stderr, "optimistic_reads requires the chained hash_layout\n");
+        exit(EX_USAGE);
+    }
+
     if (settings.item_size_max < ITEM_SIZE_MAX_LOWER_LIMIT) {
         fprintf(stderr, "Item max size cannot be less than 1024 bytes.\n");
         exit(EX_USAGE);
@@ -5754,8 +5975,50 @@ int main (int argc, char **argv) {
         settings.port = settings.udpport;
     }
 
-    if(settings.use_rdma && udp_specified) {
-        fprintf(stderr, "ERROR: Cannot enable UDP while using RDMA.\n");
+    if (settings.rdma_port && !settings.use_rdma) {
+        fprintf(stderr, "ERROR: rdma_port requires RDMA (-g).\n");
+        exit(EX_USAGE);
+    }
+
+    if ((settings.rdma_buf_size != MCRDMA_BUF_SIZE ||
+            settings.rdma_buf_max != MCRDMA_BUF_MAX_DEFAULT ||
+            settings.rdma_buf_cache != MCRDMA_BUF_CACHE_DEFAULT) && !settings.use_rdma) {
+        fprintf(stderr, "ERROR: rdma_buf_size, rdma_buf_max and rdma_buf_cache require RDMA (-g).\n");
+        exit(EX_USAGE);
+    }
+
+    if (settings.rdma_buf_max < MCRDMA_BUF_MIN ||
+            settings.rdma_buf_max > MCRDMA_BUF_MAX_LIMIT) {
+        fprintf(stderr, "ERROR: rdma_buf_max must be between %d and %zu bytes.\n",
+                MCRDMA_BUF_MIN, MCRDMA_BUF_MAX_LIMIT);
+        exit(EX_USAGE);
+    }
+
+    if (settings.rdma_buf_size < MCRDMA_BUF_MIN ||
+            settings.rdma_buf_size > settings.rdma_buf_max) {
+        fprintf(stderr, "ERROR: rdma_buf_size must be between %d and rdma_buf_max (%u) bytes.\n",
+                MCRDMA_BUF_MIN, settings.rdma_buf_max);
+        exit(EX_USAGE);
+    }
+
+    if (settings.rdma_index_power && !settings.use_rdma) {
+        fprintf(stderr, "ERROR: rdma_onesided requires RDMA (-g).\n");
+        exit(EX_USAGE);
+    }
+
+    if (settings.rdma_write_sets && !settings.use_rdma) {
+        fprintf(stderr, "ERROR: rdma_write_sets requires RDMA (-g).\n");
+        exit(EX_USAGE);
+    }
+
+    if (settings.rdma_ud && !settings.use_rdma) {
+        fprintf(stderr, "ERROR: rdma_ud requires RDMA (-g).\n");
+        exit(EX_USAGE);
+    }
+
+    // Clients are handed a single key for the whole of the slab memory
+    if (settings.rdma_index_power && !preallocate && settings.memory_file == NULL) {
+        fprintf(stderr, "ERROR: rdma_onesided requires preallocated memory (-L).\n");
         exit(EX_USAGE);
     }
 
@@ -5978,21 +6241,14 @@ int main (int argc, char **argv) {
         setup_privilege_violations_handler();
     }
 
+    // Before any item gets linked, restart fixups included
+    if (settings.rdma_index_power && mcrdma_index_init(settings.rdma_index_power) != 0) {
+        fprintf(stderr, "Failed to allocate the RDMA one-sided index\n");
+        exit(EX_OSERR);
+    }
+
     if (prefill)
         slabs_prefill_global();
-    /* In restartable mode and we've decided to issue a fixup on memory */
-    if (settings.memory_file != NULL && reuse_mem) {
-        mc_ptr_t old_base = meta->old_base;
-        assert(old_base == meta->old_base);
-
-        // should've pulled in process_started from meta file.
-        process_started = meta->process_started;
-        // TODO: must be a more canonical way of serializing/deserializing
-        // pointers? passing through uint64_t should work, and we're not
-        // annotating the pointer with anything, but it's still slightly
-        // insane.
-        restart_fixup((void *)old_base);
-    }
     /*
      * ignore SIGPIPE signals; we can use errno == EPIPE if we
      * need that information
@@ -6012,14 +6268,26 @@ int main (int argc, char **argv) {
 #endif
 #ifdef EXTSTORE
     slabs_set_storage(storage);
-    //if(!settings.use_rdma) // Disabled thread subsystem when using rdma TODO
-        memcached_thread_init(settings.num_threads, storage);
+    memcached_thread_init(settings.num_threads, storage);
     init_lru_crawler(storage);
 #else
-    //if(!settings.use_rdma)
-        memcached_thread_init(settings.num_threads, NULL);
+    memcached_thread_init(settings.num_threads, NULL);
     init_lru_crawler(NULL);
 #endif
+    /* In restartable mode and we've decided to issue a fixup on memory.
+     * Items are relinked from several threads, under the item locks. */
+    if (settings.memory_file != NULL && reuse_mem) {
+        mc_ptr_t old_base = meta->old_base;
+        assert(old_base == meta->old_base);
+
+        // should've pulled in process_started from meta file.
+        process_started = meta->process_started;
+        // TODO: must be a more canonical way of serializing/deserializing
+        // pointers? passing through uint64_t should work, and we're not
+        // annotating the pointer with anything, but it's still slightly
+        // insane.
+        restart_fixup((void *)old_base);
+    }
 
     if (start_assoc_maint && start_assoc_maintenance_thread() == -1) {
         exit(EXIT_FAILURE);
@@ -6108,47 +6376,45 @@ int main (int argc, char **argv) {
             }
         }
 
-        // Right now you can either use RDMA or TCP/UDP, but not both at the same time
-        // function server_sockets is still called to preserve multiple interfaces parsing logic
-        if(settings.use_rdma) {
-            // RDMA server creation
-            if(settings.port &&
-                    server_sockets(settings.port, rdma_transport, portnumber_file) ) {
-                if (settings.inter == NULL) {
-                    vperror("failed to start RDMA server on port %d", settings.port);
-                } else {
-                    vperror("failed to start RDMA server on one of interface(s) %s", settings.inter);
-                }
-                exit(EX_OSERR);
+        errno = 0;
+        if (settings.port && server_sockets(settings.port, tcp_transport,
+                                            portnumber_file)) {
+            if (settings.inter == NULL) {
+                vperror("failed to listen on TCP port %d", settings.port);
+            } else {
+                vperror("failed to listen on one of interface(s) %s", settings.inter);
             }
-        } else {
-            // TCP and UDP socket creation
-            errno = 0;
-            if (settings.port && server_sockets(settings.port, tcp_transport,
+            exit(EX_OSERR);
+        }
+
+        /*
+         * initialization order: first create the listening sockets
+         * (may need root on low ports), then drop root if needed,
+         * then daemonize if needed, then init libevent (in some cases
+         * descriptors created by libevent wouldn't survive forking).
+         */
+
+        /* create the UDP listening socket and bind it */
+        errno = 0;
+        if (settings.udpport && server_sockets(settings.udpport, udp_transport,
                                             portnumber_file)) {
-                if (settings.inter == NULL) {
-                    vperror("failed to listen on TCP port %d", settings.port);
-                } else {
-                    vperror("failed to listen on one of interface(s) %s", settings.inter);
-                }
-                exit(EX_OSERR);
+            if (settings.inter == NULL) {
+                vperror("failed to listen on UDP port %d", settings.udpport);
+            } else {
+                vperror("failed to listen on one of interface(s) %s", settings.inter);
             }
+            exit(EX_OSERR);
+        }
 
-            /*
-            * initialization order: first create the listening sockets
-            * (may need root on low ports), then drop root if needed,
-            * then daemonize if needed, then init libevent (in some cases
-            * descriptors created by libevent wouldn't survive forking).
-            */
-
-            /* create the UDP listening socket and bind it */
-            errno = 0;
-            if (settings.udpport && server_sockets(settings.udpport, udp_transport,
-                                                portnumber_file)) {
+        /* RDMA listens next to TCP/UDP, on its own port space */
+        if (settings.use_rdma) {
+            int rdma_port = settings.rdma_port ? settings.rdma_port : settings.port;
+            if (rdma_port && server_sockets(rdma_port, rdma_transport,
+                                            portnumber_file)) {
                 if (settings.inter == NULL) {
-                    vperror("failed to listen on UDP port %d", settings.udpport);
+                    vperror("failed to start RDMA server on port %d", rdma_port);
                 } else {
-                    vperror("failed to listen on one of interface(s) %s", settings.inter);
+                    vperror("failed to start RDMA server on one of interface(s) %s", settings.inter);
                 }
                 exit(EX_OSERR);
             }
@@ -6183,24 +6449,16 @@ int main (int argc, char **argv) {
     /* Initialize the uriencode lookup table. */
     uriencode_init();
 
-    if(settings.use_rdma) {
-        fprintf(stderr, "listening for RDMA connections\n");
-
-        /* RDMA connection management */
-        while(!stop_main_loop) {
-            if(mcrdma_listen() < 0) {
-                retval = EXIT_FAILURE;
-                break;
-            }
-        }
+    if (settings.use_rdma && mcrdma_listen(main_base) != 0) {
+        fprintf(stderr, "failed to listen for RDMA connections\n");
+        exit(EX_OSERR);
+    }
 
-    } else {
-        /* enter the event loop for TCP/UDP */
-        while (!stop_main_loop) {
-            if (event_base_loop(main_base, EVLOOP_ONCE) != 0) {
-                retval = EXIT_FAILURE;
-                break;
-            }
+    /* enter the event loop */
+    while (!stop_main_loop) {
+        if (event_base_loop(main_base, EVLOOP_ONCE) != 0) {
+            retval = EXIT_FAILURE;
+            break;
         }
     }
 
@@ -45,10 +45,8 @@
 #include "protocol_binary.h"
 #include "cache.h"
 #include "logger.h"
-
-#ifdef EXTSTORE
+#include "latency.h"
 #include "crc32c.h"
-#endif
 
 #include "sasl_defs.h"
 #ifdef TLS
@@ -237,7 +235,8 @@ enum network_transport {
     local_transport, /* Unix sockets*/
     tcp_transport,
     udp_transport,
-    rdma_transport // exists for consistency
+    rdma_transport, // exists for consistency
+    rdma_ud_transport /* RDMA datagrams, handled as UDP */
 };
 
 enum pause_thread_types {
@@ -261,8 +260,9 @@ enum close_reasons {
 };
 
 #define IS_TCP(x) (x == tcp_transport)
-#define IS_UDP(x) (x == udp_transport)
+#define IS_UDP(x) (x == udp_transport || x == rdma_ud_transport)
 #define IS_RDMA(x) (x == rdma_transport) // exists for consistency
+#define IS_RDMA_UD(x) (x == rdma_ud_transport)
 
 #define NREAD_ADD 1
 #define NREAD_SET 2
@@ -328,7 +328,8 @@ struct slab_stats {
     X(response_obj_bytes) \
     X(read_buf_oom) \
     X(store_too_large) \
-    X(store_no_memory)
+    X(store_no_memory) \
+    X(get_optimistic_fallbacks) /* -o optimistic_reads GETs that took the lock */
 
 #ifdef EXTSTORE
 #define EXTSTORE_THREAD_STATS_FIELDS \
@@ -426,6 +427,12 @@ struct stats_state {
 
 #define MAX_VERBOSITY_LEVEL 2
 
+/* How the hash table stores items, see assoc.c */
+enum hash_layout {
+    HASH_LAYOUT_CHAINED = 0, /* buckets chain items through h_next */
+    HASH_LAYOUT_BUCKETS      /* cache line buckets of tagged items */
+};
+
 /* When adding a setting, be sure to update process_stat_settings */
 /**
  * Globally accessible settings as derived from the commandline.
@@ -436,6 +443,14 @@ struct settings {
     int port;
     int udpport;
     bool use_rdma;
+    int rdma_port; /* RDMA CM port, 0 to share the TCP port number */
+    int rdma_index_power; /* one-sided GET index entries, 0 if disabled */
+    bool rdma_write_sets; /* let RDMA clients write values into slab memory */
+    bool rdma_ud; /* serve UDP style requests over RDMA datagrams */
+    int rdma_poll_us; /* busy poll RDMA completions for this long when idle */
+    uint32_t rdma_buf_size; /* RDMA send buffer, unless the client asks */
+    uint32_t rdma_buf_max; /* largest RDMA send buffer a client may ask for */
+    int rdma_buf_cache; /* RDMA send buffers of each size kept registered */
     char *inter;
     int verbose;
     rel_time_t oldest_live; /* ignore existing items older than this */
@@ -474,6 +489,7 @@ struct settings {
     bool flush_enabled;     /* flush_all enabled */
     bool dump_enabled;      /* whether cachedump/metadump commands work */
     char *hash_algorithm;     /* Hash algorithm in use */
+    enum hash_layout hash_layout; /* Hash table layout */
     int lru_crawler_sleep;  /* Microsecond sleep between items */
     uint32_t lru_crawler_tocrawl; /* Number of items to crawl per run */
     int hot_lru_pct; /* percentage of slab space for HOT_LRU */
@@ -491,6 +507,8 @@ struct settings {
     bool watch_enabled; /* allows watch commands to be dropped */
     bool relaxed_privileges;   /* Relax process restrictions when running testapp */
     bool meta_response_old; /* use "OK" instead of "HD". for response code TEMPORARY! */
+    bool latency_stats; /* time commands for "stats latency" */
+    bool optimistic_reads; /* GETs look items up without the item lock */
 #ifdef EXTSTORE
     unsigned int ext_io_threadcount; /* number of IO threads to run. */
     unsigned int ext_page_size; /* size in megabytes of storage pages. */
@@ -705,6 +723,9 @@ typedef struct {
     int notify_send_fd;         /* sending end of notify pipe */
 #endif
     struct thread_stats stats;  /* Stats generated by this thread */
+    struct latency_stats *latency; /* command latencies, NULL if not timed */
+    item *hazard;               /* item an optimistic GET is taking a reference on */
+    unsigned int optimistic_seq; /* odd while an optimistic GET walks the hash table */
     io_queue_cb_t io_queues[IO_QUEUE_COUNT];
     struct conn_queue *ev_queue; /* Worker/conn event queue */
     cache_t *rbuf_cache;        /* static-sized read buffers */
@@ -719,6 +740,7 @@ typedef struct {
     char   *ssl_wbuf;
 #endif
     int napi_id;                /* napi id associated with this thread */
+    struct mcrdma_thread *rdma; /* rdma resources of the thread's conns, per device */
 #ifdef PROXY
     void *L;
     void *proxy_hooks;
@@ -750,6 +772,10 @@ typedef struct _mc_resp {
      */
     bool skip;
     bool free; // double free detection.
+    /* its command is timed until its IO completes, see latency_io_done() */
+    bool latency_io;
+    enum latency_op latency_op;
+    uint64_t latency_start;
     // UDP bits. Copied in from the client.
     uint16_t    request_id; /* Incoming UDP request ID, if this is a UDP "connection" */
     uint16_t    udp_sequence; /* packet counter when transmitting result */
@@ -800,6 +826,10 @@ struct conn {
     enum conn_states  state;
     enum bin_substates substate;
     rel_time_t last_cmd_time;
+    uint64_t recv_time; /* when the data being parsed was read, in ns */
+    uint64_t latency_start; /* when the command being timed started */
+    enum latency_op latency_op; /* LATENCY_NONE if not timed */
+    int latency_ios; /* IOs queued when the command being timed started */
     struct event event;
     short  ev_flags;
     short  which;   /** which events were just triggered */
@@ -866,10 +896,12 @@ struct conn {
 
     // Rdma stuff
     struct mcrdma_state *rdma;
+    struct mcrdma_ud *ud; /* UD QP of an rdma_ud_transport conn */
 };
 
 /* array of conn structures, indexed by file descriptor */
 extern conn **conns;
+extern int max_fds;
 
 /* current time of day (updated periodically) */
 extern volatile rel_time_t current_time;
@@ -940,7 +972,6 @@ const char *state_text(enum conn_states state);
 
 /* RDMA DECLARATIONS */
 void memcached_thread_init(int nthreads, void *arg);
-void mcrdma_libevent_thread_init(LIBEVENT_THREAD* thread);
 void reset_cmd_handler(conn *c);
 void complete_nread(conn *c);
 int read_into_chunked_item(conn *c);
@@ -977,6 +1008,7 @@ void proxy_reload_notify(LIBEVENT_THREAD *t);
 void return_io_pending(io_pending_t *io);
 void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags, int read_buffer_size,
     enum network_transport transport, void *ssl);
+void dispatch_rdma_conn_new(void *id, enum conn_states init_state, int read_buffer_size);
 void sidethread_conn_close(conn *c);
 
 /* Lock wrappers for cache functions that are called from main loop. */
@@ -1002,17 +1034,26 @@ void item_lock(uint32_t hv);
 void *item_trylock(uint32_t hv);
 void item_trylock_unlock(void *arg);
 void item_unlock(uint32_t hv);
+unsigned int item_lock_seq(uint32_t hv);
+bool item_lock_seq_valid(uint32_t hv, unsigned int seq);
+void item_hazard_wait(item *it);
+void item_optimistic_sync(void);
 void pause_threads(enum pause_thread_types type);
 void stop_threads(void);
 int stop_conn_timeout_thread(void);
-#define refcount_incr(it) ++(it->refcount)
-#define refcount_decr(it) --(it->refcount)
+/* Only atomic with -o optimistic_reads, whose GETs take references without
+ * the item lock */
+#define refcount_incr(it) (settings.optimistic_reads ? \
+        __sync_add_and_fetch(&(it)->refcount, 1) : ++((it)->refcount))
+#define refcount_decr(it) (settings.optimistic_reads ? \
+        __sync_sub_and_fetch(&(it)->refcount, 1) : --((it)->refcount))
 void STATS_LOCK(void);
 void STATS_UNLOCK(void);
 #define THR_STATS_LOCK(c) pthread_mutex_lock(&c->thread->stats.mutex)
 #define THR_STATS_UNLOCK(c) pthread_mutex_unlock(&c->thread->stats.mutex)
 void threadlocal_stats_reset(void);
 void threadlocal_stats_aggregate(struct thread_stats *stats);
+void threadlocal_latency_aggregate(struct latency_stats *stats);
 void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out);
 LIBEVENT_THREAD *get_worker_thread(int id);
 
@@ -1043,6 +1084,7 @@ bool resp_has_stack(conn *c);
 bool rbuf_switch_to_malloc(conn *c);
 void conn_release_items(conn *c);
 void conn_set_state(conn *c, enum conn_states state);
+void conn_init_protocol(conn *c);
 void out_of_memory(conn *c, char *ascii_error);
 void out_errstring(conn *c, const char *str);
 void write_and_free(conn *c, char *buf, int bytes);
@@ -1056,6 +1098,12 @@ void stats_reset(void);
 void process_stat_settings(ADD_STAT add_stats, void *c);
 void process_stats_conns(ADD_STAT add_stats, void *c);
 
+/* Command latencies, see latency.h */
+void latency_cmd_start(conn *c, enum latency_op op);
+void latency_cmd_done(conn *c);
+void latency_io_done(conn *c);
+void process_latency_stats(ADD_STAT add_stats, conn *c);
+
 #if HAVE_DROP_PRIVILEGES
 extern void setup_privilege_violations_handler(void);
 extern void drop_privileges(void);
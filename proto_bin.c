@@ -119,7 +119,11 @@ int try_read_command_binary(conn *c) {
         c->rbytes -= sizeof(c->binary_header) + extlen + keylen;
         c->rcurr += sizeof(c->binary_header) + extlen + keylen;
 
+        latency_cmd_start(c, latency_op_binary(c->cmd));
         dispatch_bin_command(c, extbuf);
+        if (c->state != conn_nread) {
+            latency_cmd_done(c);
+        }
     }
 
     return 1;
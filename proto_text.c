@@ -12,6 +12,7 @@
 #include "authfile.h"
 #include "storage.h"
 #include "base64.h"
+#include "mcrdma.h"
 #ifdef TLS
 #include "tls.h"
 #endif
@@ -487,7 +488,12 @@ int try_read_command_ascii(conn *c) {
     assert(cont <= (c->rcurr + c->rbytes));
 
     c->last_cmd_time = current_time;
+    latency_cmd_start(c, latency_op_ascii(c->rcurr));
     process_command_ascii(c, c->rcurr);
+    /* Stores are timed until the value is in, see complete_nread() */
+    if (c->state != conn_nread) {
+        latency_cmd_done(c);
+    }
 
     c->rbytes -= (cont - c->rcurr);
     c->rcurr = cont;
@@ -794,6 +800,14 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
         return;
     } else if (strcmp(subcommand, "conns") == 0) {
         process_stats_conns(&append_stats, c);
+    } else if (strcmp(subcommand, "rdma") == 0) {
+        process_rdma_stats(&append_stats, c);
+    } else if (strcmp(subcommand, "latency") == 0) {
+        if (!settings.latency_stats) {
+            out_string(c, "CLIENT_ERROR stats latency not enabled");
+            return;
+        }
+        process_latency_stats(&append_stats, c);
 #ifdef EXTSTORE
     } else if (strcmp(subcommand, "extstore") == 0) {
         process_extstore_stats(&append_stats, c);
@@ -1133,8 +1147,13 @@ static void process_mget_command(conn *c, token_t *tokens, const size_t ntokens)
             // I look forward to the day I get rid of this :)
             memcpy(ITEM_data(it), "\r\n", 2);
             // NOTE: This initializes the CAS value.
-            do_item_link(it, hv);
-            item_created = true;
+            if (do_item_link(it, hv)) {
+                item_created = true;
+            } else {
+                // Out of memory linking it, act as if the alloc failed.
+                do_item_remove(it);
+                it = NULL;
+            }
         }
     }
 
@@ -1929,11 +1948,23 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
     int vlen;
     uint64_t req_cas_id=0;
     item *it;
+    bool rdma_write = false;
 
     assert(c != NULL);
 
     set_noreply_maybe(c, tokens, ntokens);
 
+    /* RDMA clients may write the value straight into the item instead,
+     * which takes the place of "noreply". */
+    if (IS_RDMA(c->transport) && tokens[ntokens - 2].value
+        && strcmp(tokens[ntokens - 2].value, "rdma") == 0) {
+        if (!settings.rdma_write_sets) {
+            out_string(c, "CLIENT_ERROR rdma writes not enabled");
+            return;
+        }
+        rdma_write = true;
+    }
+
     if (tokens[KEY_TOKEN].length > KEY_MAX_LENGTH) {
         out_string(c, "CLIENT_ERROR bad command line format");
         return;
@@ -1988,9 +2019,11 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
         }
         LOGGER_LOG(c->thread->l, LOG_MUTATIONS, LOGGER_ITEM_STORE,
                 NULL, status, comm, key, nkey, 0, 0, c->sfd);
-        /* swallow the data line */
-        conn_set_state(c, conn_swallow);
-        c->sbytes = vlen;
+        /* swallow the data line, unless it was never going to be sent */
+        if (!rdma_write) {
+            conn_set_state(c, conn_swallow);
+            c->sbytes = vlen;
+        }
 
         /* Avoid stale data persisting in cache because we failed alloc.
          * Unacceptable for SET. Anywhere else too? */
@@ -2020,6 +2053,12 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
     c->rlbytes = it->nbytes;
     c->cmd = comm;
     conn_set_state(c, conn_nread);
+
+    if (rdma_write && mcrdma_write_set(c) != 0) {
+        item_remove(c->item);
+        c->item = 0;
+        out_string(c, "SERVER_ERROR cannot write value over rdma");
+    }
 }
 
 static void process_touch_command(conn *c, token_t *tokens, const size_t ntokens) {
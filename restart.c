@@ -9,6 +9,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <pthread.h>
 
 typedef struct _restart_data_cb restart_data_cb;
 
@@ -348,37 +349,33 @@ void restart_mmap_close(void) {
     free(memory_file);
 }
 
-// given memory base, quickly walk memory and do pointer fixup.
-// do this once on startup to avoid having to do pointer fixup on every
-// reference from hash table or LRU.
-unsigned int restart_fixup(void *orig_addr) {
-    struct timeval tv;
-    uint64_t checked = 0;
-    const unsigned int page_size = settings.slab_page_size;
-    unsigned int page_remain = page_size;
+struct fixup_thread {
+    pthread_t tid;
+    void *orig_addr;
+    // range of pages to fix up, last one excluded
+    uint64_t first_page;
+    uint64_t last_page;
+    struct slabs_fixup_freelist freelists[MAX_NUMBER_OF_SLAB_CLASSES];
+    struct item_fixup_stats stats;
+};
 
-    gettimeofday(&tv, NULL);
-    if (settings.verbose > 0) {
-        fprintf(stderr, "[restart] original memory base: [%p] new base: [%p]\n", orig_addr, mmap_base);
-        fprintf(stderr, "[restart] recovery start [%d.%d]\n", (int)tv.tv_sec, (int)tv.tv_usec);
-    }
+// fix up the chunks of one page of memory.
+static void _fixup_page(struct fixup_thread *t, char *page, uint64_t page_len) {
+    void *orig_addr = t->orig_addr;
+    unsigned int page_remain = settings.slab_page_size;
+    uint64_t checked = 0;
 
     // since chunks don't align with pages, we have to also track page size.
-    while (checked < slabmem_limit) {
-        //fprintf(stderr, "checked: %lu\n", checked);
-        item *it = (item *)((char *)mmap_base + checked);
+    while (checked < page_len) {
+        item *it = (item *)(page + checked);
 
-        int size = slabs_fixup((char *)mmap_base + checked,
-                checked % settings.slab_page_size);
-        //fprintf(stderr, "id: %d, size: %d remain: %u\n", it->slabs_clsid, size, page_remain);
         // slabber gobbled an entire page, skip and move on.
-        if (size == -1) {
-            assert(page_remain % page_size == 0);
-            assert(page_remain == page_size);
-            checked += page_remain;
-            page_remain = page_size;
-            continue;
+        if (ITEM_clsid(it) == 0) {
+            assert(checked == 0);
+            break;
         }
+        int size = slabs_fixup(page + checked, t->freelists);
+        //fprintf(stderr, "id: %d, size: %d remain: %u\n", it->slabs_clsid, size, page_remain);
 
         if (it->it_flags & ITEM_LINKED) {
             // fixup next/prev links while on LRU.
@@ -392,7 +389,7 @@ unsigned int restart_fixup(void *orig_addr) {
             }
 
             //fprintf(stderr, "item was linked\n");
-            do_item_link_fixup(it);
+            item_link_fixup(it, &t->stats);
         }
 
         if (it->it_flags & (ITEM_CHUNKED|ITEM_CHUNK)) {
@@ -428,15 +425,89 @@ unsigned int restart_fixup(void *orig_addr) {
         page_remain -= size;
         if (size > page_remain) {
             //fprintf(stderr, "doot %d\n", page_remain);
-            checked += page_remain;
-            page_remain = settings.slab_page_size;
+            break;
         }
-        //assert(checked != 3145728);
     }
+}
+
+static void *_fixup_thread(void *arg) {
+    struct fixup_thread *t = arg;
+    const uint64_t page_size = settings.slab_page_size;
+    uint64_t i;
+
+    for (i = t->first_page; i < t->last_page; i++) {
+        uint64_t len = slabmem_limit - i * page_size;
+        _fixup_page(t, (char *)mmap_base + i * page_size,
+                len < page_size ? len : page_size);
+    }
+    return NULL;
+}
+
+// given memory base, quickly walk memory and do pointer fixup.
+// do this once on startup to avoid having to do pointer fixup on every
+// reference from hash table or LRU.
+// Pages are handed out to one thread per worker thread, which relink their
+// items into the hash table under the item locks. Must be called after
+// memcached_thread_init().
+unsigned int restart_fixup(void *orig_addr) {
+    struct timeval tv;
+    struct fixup_thread *threads;
+    const uint64_t page_size = settings.slab_page_size;
+    uint64_t npages = (slabmem_limit + page_size - 1) / page_size;
+    uint64_t i;
+    int nthreads = settings.num_threads;
+    int ret;
+
+    gettimeofday(&tv, NULL);
+    if (settings.verbose > 0) {
+        fprintf(stderr, "[restart] original memory base: [%p] new base: [%p]\n", orig_addr, mmap_base);
+        fprintf(stderr, "[restart] recovery start [%d.%d]\n", (int)tv.tv_sec, (int)tv.tv_usec);
+    }
+
+    // slab classes keep their pages in memory order, so these are handed
+    // out first. Only takes a look at the first chunk of each page.
+    for (i = 0; i < npages; i++) {
+        slabs_fixup_page((char *)mmap_base + i * page_size);
+    }
+
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if ((uint64_t)nthreads > npages) {
+        nthreads = npages;
+    }
+    threads = calloc(nthreads, sizeof(struct fixup_thread));
+    if (threads == NULL) {
+        fprintf(stderr, "[restart] failed to allocate fixup threads\n");
+        abort();
+    }
+
+    for (i = 0; i < (uint64_t)nthreads; i++) {
+        struct fixup_thread *t = &threads[i];
+        t->orig_addr = orig_addr;
+        t->first_page = npages * i / nthreads;
+        t->last_page = npages * (i + 1) / nthreads;
+        if ((ret = pthread_create(&t->tid, NULL, _fixup_thread, t)) != 0) {
+            fprintf(stderr, "[restart] failed to create fixup thread: %s\n",
+                    strerror(ret));
+            abort();
+        }
+    }
+
+    for (i = 0; i < (uint64_t)nthreads; i++) {
+        pthread_join(threads[i].tid, NULL);
+        slabs_fixup_freelists(threads[i].freelists);
+        item_link_fixup_stats(&threads[i].stats);
+    }
+    for (i = 0; i < (uint64_t)nthreads; i++) {
+        item_link_fixup_drop(&threads[i].stats);
+    }
+    free(threads);
 
     if (settings.verbose > 0) {
         gettimeofday(&tv, NULL);
-        fprintf(stderr, "[restart] recovery end [%d.%d]\n", (int)tv.tv_sec, (int)tv.tv_usec);
+        fprintf(stderr, "[restart] recovery end [%d.%d] with %d threads\n",
+                (int)tv.tv_sec, (int)tv.tv_usec, nthreads);
     }
 
     return 0;
@@ -50,6 +50,10 @@ static int power_largest;
 static void *mem_base = NULL;
 static void *mem_current = NULL;
 static size_t mem_avail = 0;
+/* Notified of memory entering and leaving the allocator */
+static slabs_mem_cb mem_alloc_cb = NULL;
+static slabs_mem_cb mem_release_cb = NULL;
+static void *mem_cb_arg = NULL;
 #ifdef EXTSTORE
 static void *storage  = NULL;
 #endif
@@ -163,42 +167,57 @@ static void * alloc_large_chunk(const size_t limit)
     return ptr;
 }
 
-unsigned int slabs_fixup(char *chunk, const int border) {
-    slabclass_t *p;
-    item *it = (item *)chunk;
+void slabs_fixup_page(char *page) {
+    item *it = (item *)page;
     int id = ITEM_clsid(it);
+    slabclass_t *p = &slabclass[id];
 
     // memory isn't used yet. shunt to global pool.
     // (which must be 0)
-    if (id == 0) {
-        //assert(border == 0);
-        p = &slabclass[0];
-        grow_slab_list(0);
-        p->slab_list[p->slabs++] = (char*)chunk;
-        return -1;
-    }
-    p = &slabclass[id];
+    grow_slab_list(id);
+    p->slab_list[p->slabs++] = page;
+}
 
-    // if we're on a page border, add the slab to slab class
-    if (border == 0) {
-        grow_slab_list(id);
-        p->slab_list[p->slabs++] = chunk;
-    }
+unsigned int slabs_fixup(char *chunk, struct slabs_fixup_freelist *freelists) {
+    item *it = (item *)chunk;
+    int id = ITEM_clsid(it);
 
     // increase free count if ITEM_SLABBED
     if (it->it_flags == ITEM_SLABBED) {
+        struct slabs_fixup_freelist *fl = &freelists[id];
         // if ITEM_SLABBED re-stack on freelist.
         // don't have to run pointer fixups.
         it->prev = 0;
-        it->next = p->slots;
-        if (it->next) it->next->prev = it;
-        p->slots = it;
-
-        p->sl_curr++;
+        it->next = fl->head;
+        if (it->next) {
+            it->next->prev = it;
+        } else {
+            fl->tail = it;
+        }
+        fl->head = it;
+        fl->count++;
         //fprintf(stderr, "replacing into freelist\n");
     }
 
-    return p->size;
+    return slabclass[id].size;
+}
+
+/* Stacks the freelists of a fixup thread on top of the slab classes' ones.
+ * Merging the threads in the order of their pages leaves the chunks in the
+ * same order as a single walk over all of them would. */
+void slabs_fixup_freelists(struct slabs_fixup_freelist *freelists) {
+    int id;
+
+    for (id = 0; id < MAX_NUMBER_OF_SLAB_CLASSES; id++) {
+        struct slabs_fixup_freelist *fl = &freelists[id];
+        slabclass_t *p = &slabclass[id];
+        if (fl->head == NULL)
+            continue;
+        fl->tail->next = p->slots;
+        if (p->slots) ((item *)p->slots)->prev = fl->tail;
+        p->slots = fl->head;
+        p->sl_curr += fl->count;
+    }
 }
 
 /**
@@ -613,6 +632,9 @@ static void *memory_allocate(size_t size) {
     if (mem_base == NULL) {
         /* We are not using a preallocated large memory chunk */
         ret = malloc(size);
+        if (ret != NULL && mem_alloc_cb != NULL) {
+            mem_alloc_cb(ret, size, mem_cb_arg);
+        }
     } else {
         ret = mem_current;
 
@@ -648,6 +670,9 @@ static void memory_release() {
 
     while (mem_malloced > mem_limit &&
             (p = get_page_from_global_pool()) != NULL) {
+        if (mem_release_cb != NULL) {
+            mem_release_cb(p, settings.slab_page_size, mem_cb_arg);
+        }
         free(p);
         mem_malloced -= settings.slab_page_size;
     }
@@ -669,6 +694,42 @@ void slabs_free(void *ptr, size_t size, unsigned int id) {
     pthread_mutex_unlock(&slabs_lock);
 }
 
+void slabs_set_mem_hooks(slabs_mem_cb alloc_cb, slabs_mem_cb release_cb, void *arg) {
+    pthread_mutex_lock(&slabs_lock);
+    mem_alloc_cb = alloc_cb;
+    mem_release_cb = release_cb;
+    mem_cb_arg = arg;
+    pthread_mutex_unlock(&slabs_lock);
+}
+
+/* Walks every chunk of memory owned by the allocator: either the single
+ * preallocated region or each page malloc'ed so far. */
+void slabs_mem_foreach(slabs_mem_cb cb, void *arg) {
+    int i, x;
+    pthread_mutex_lock(&slabs_lock);
+    if (mem_base != NULL) {
+        cb(mem_base, mem_limit, arg);
+    } else {
+        for (i = 0; i < MAX_NUMBER_OF_SLAB_CLASSES; i++) {
+            slabclass_t *p = &slabclass[i];
+            /* same page sizing as do_slabs_newslab() */
+            size_t len = (i == SLAB_GLOBAL_PAGE_POOL || settings.slab_reassign
+                    || settings.slab_chunk_size_max != settings.slab_page_size)
+                ? settings.slab_page_size
+                : p->size * p->perslab;
+            for (x = 0; x < p->slabs; x++) {
+                cb(p->slab_list[x], len, arg);
+            }
+        }
+    }
+    pthread_mutex_unlock(&slabs_lock);
+}
+
+bool slabs_mem_prealloc(void) {
+    /* only ever set by slabs_init() */
+    return mem_base != NULL;
+}
+
 void slabs_stats(ADD_STAT add_stats, void *c) {
     pthread_mutex_lock(&slabs_lock);
     do_slabs_stats(add_stats, c);
@@ -905,6 +966,7 @@ static int slab_rebalance_move(void) {
                     status = MOVE_LOCKED;
                 } else {
                     bool is_linked = (it->it_flags & ITEM_LINKED);
+                    item_hazard_wait(it);
                     refcount = refcount_incr(it);
                     if (refcount == 2) { /* item is linked but not busy */
                         /* Double check ITEM_LINKED flag here, since we're
@@ -40,6 +40,18 @@ typedef struct {
 void fill_slab_stats_automove(slab_stats_automove *am);
 unsigned int global_page_pool_size(bool *mem_flag);
 
+/** Lets other subsystems track the memory handed out by the allocator, e.g.
+ * to register it with network hardware. The alloc callback fires for each
+ * page malloc'ed from now on, the release callback right before a page is
+ * freed. Both run under the slabs lock. */
+typedef void (*slabs_mem_cb)(void *ptr, size_t len, void *arg);
+void slabs_set_mem_hooks(slabs_mem_cb alloc_cb, slabs_mem_cb release_cb, void *arg);
+/** Call cb on every region of memory currently owned by the allocator */
+void slabs_mem_foreach(slabs_mem_cb cb, void *arg);
+/** True if items live in a single preallocated region, which neither moves
+ * nor goes away: the hooks then never fire. */
+bool slabs_mem_prealloc(void);
+
 /** Fill buffer with stats */ /*@null@*/
 void slabs_stats(ADD_STAT add_stats, void *c);
 
@@ -66,7 +78,18 @@ void slabs_rebalancer_resume(void);
 void slabs_set_storage(void *arg);
 #endif
 
-/* Fixup for restartable code. */
-unsigned int slabs_fixup(char *chunk, const int border);
+/* Fixup for restartable code. Pages are registered in order by
+ * slabs_fixup_page(), then their chunks may be fixed up from several threads,
+ * each restacking free chunks on its own freelists until
+ * slabs_fixup_freelists() merges them. */
+struct slabs_fixup_freelist {
+    item *head;
+    item *tail;
+    unsigned int count;
+};
+
+void slabs_fixup_page(char *page);
+unsigned int slabs_fixup(char *chunk, struct slabs_fixup_freelist *freelists);
+void slabs_fixup_freelists(struct slabs_fixup_freelist *freelists);
 
 #endif
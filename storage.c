@@ -426,10 +426,14 @@ static void recache_or_free(io_pending_t *pending) {
                 it->refcount = 0;
                 it->h_next = NULL; // might not be necessary.
                 STORAGE_delete(c->thread->storage, h_it);
-                item_replace(h_it, it, hv);
-                pthread_mutex_lock(&c->thread->stats.mutex);
-                c->thread->stats.recache_from_extstore++;
-                pthread_mutex_unlock(&c->thread->stats.mutex);
+                if (item_replace(h_it, it, hv)) {
+                    pthread_mutex_lock(&c->thread->stats.mutex);
+                    c->thread->stats.recache_from_extstore++;
+                    pthread_mutex_unlock(&c->thread->stats.mutex);
+                } else {
+                    // Out of memory linking it.
+                    do_free = true;
+                }
             }
         }
         if (hold_lock)
@@ -553,11 +557,15 @@ static int storage_write(void *storage, const int clsid, const int item_age) {
                  * header and replace. Most of this requires the item lock
                  */
                 /* CAS gets set while linking. Copy post-replace */
-                item_replace(it, hdr_it, it_info.hv);
-                ITEM_set_cas(hdr_it, ITEM_get_cas(it));
+                if (item_replace(it, hdr_it, it_info.hv)) {
+                    ITEM_set_cas(hdr_it, ITEM_get_cas(it));
+                    did_moves = 1;
+                    LOGGER_LOG(NULL, LOG_EVICTIONS, LOGGER_EXTSTORE_WRITE, it, bucket);
+                } else {
+                    /* Out of memory linking it, give back the flash space */
+                    STORAGE_delete(storage, hdr_it);
+                }
                 do_item_remove(hdr_it);
-                did_moves = 1;
-                LOGGER_LOG(NULL, LOG_EVICTIONS, LOGGER_EXTSTORE_WRITE, it, bucket);
             } else {
                 /* Failed to write for some reason, can't continue. */
                 slabs_free(hdr_it, ITEM_ntotal(hdr_it), ITEM_clsid(hdr_it));
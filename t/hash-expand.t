@@ -0,0 +1,73 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use POSIX ();
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-o hashpower=13 -t 4");
+my $sock = $server->sock;
+
+my $stats = mem_stats($sock);
+is($stats->{hash_is_expanding}, 0, "not expanding");
+is($stats->{hash_expand_buckets}, 0, "no buckets to move");
+is($stats->{hash_expand_buckets_moved}, 0, "no buckets moved");
+
+my $hot = 1000;
+for my $i (1 .. $hot) {
+    print $sock "set hot$i 0 0 " . length($i) . " noreply\r\n$i\r\n";
+}
+mem_get_is($sock, "hot$hot", $hot);
+
+# Workers keep serving while the table grows under them: a reader must find
+# every item all along, and the progress must make sense.
+my $pid = fork();
+if ($pid == 0) {
+    my $s = $server->new_sock;
+    my $bad = 0;
+    my $done = 0;
+    for my $round (1 .. 1000) {
+        for my $i (1 .. $hot) {
+            print $s "mg hot$i v\r\n";
+            my $line = <$s>;
+            if ($line ne "VA " . length($i) . "\r\n" || scalar <$s> ne "$i\r\n") {
+                $bad++;
+            }
+        }
+        my $st = mem_stats($s);
+        $bad++ if $st->{hash_expand_buckets_moved} > $st->{hash_expand_buckets};
+        $bad++ if $st->{hash_is_expanding} && $st->{hash_expand_buckets} == 0;
+        last if $st->{hash_power_level} > 13 && !$st->{hash_is_expanding} && ++$done > 2;
+    }
+    # Skip destructors, they would kill the server
+    POSIX::_exit($bad ? 1 : 0);
+}
+
+my $count = 30000;
+for my $i (1 .. $count) {
+    print $sock "set key$i 0 0 " . length($i) . " noreply\r\n$i\r\n";
+}
+mem_get_is($sock, "key$count", $count);
+
+waitpid($pid, 0);
+is($?, 0, "items found while expanding");
+
+$stats = mem_stats($sock);
+cmp_ok($stats->{hash_power_level}, '>', 13, "hash table grew");
+is($stats->{hash_is_expanding}, 0, "hash table expansion done");
+is($stats->{hash_expand_buckets}, 0, "no buckets left to move");
+
+my $found = 0;
+for my $i (1 .. $count) {
+    print $sock "mg key$i v\r\n";
+    my $line = <$sock>;
+    if ($line =~ /^VA/) {
+        $found++ if scalar <$sock> eq "$i\r\n";
+    }
+}
+is($found, $count, "all items found after expansion");
+
+done_testing();
@@ -0,0 +1,69 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# A small table so that it has to grow, and buckets overflow on the way
+my $server = new_memcached("-o hash_layout=buckets,hashpower=13");
+my $sock = $server->sock;
+
+my $stats = mem_stats($sock, "settings");
+is($stats->{hash_layout}, "buckets", "hash_layout setting reported");
+
+my $count = 30000;
+for my $i (1 .. $count) {
+    my $val = "val$i";
+    print $sock "set key$i 0 0 " . length($val) . " noreply\r\n$val\r\n";
+}
+mem_get_is($sock, "key$count", "val$count");
+
+# Expansion is kicked off by the clock event, let it run its course
+for (1 .. 10) {
+    $stats = mem_stats($sock);
+    last if $stats->{hash_power_level} > 13 && !$stats->{hash_is_expanding};
+    sleep 1;
+}
+is($stats->{hash_is_expanding}, 0, "hash table expansion done");
+cmp_ok($stats->{hash_power_level}, '>', 13, "hash table grew");
+is($stats->{curr_items}, $count, "all items stored");
+
+my $found = 0;
+for my $i (1 .. $count) {
+    print $sock "mg key$i v\r\n";
+    my $line = <$sock>;
+    if ($line eq "VA " . length("val$i") . "\r\n") {
+        $found++ if scalar <$sock> eq "val$i\r\n";
+    }
+}
+is($found, $count, "all items found");
+
+for my $i (grep { $_ % 2 } 1 .. $count) {
+    print $sock "delete key$i noreply\r\n";
+}
+mem_get_is($sock, "key1", undef);
+mem_get_is($sock, "key2", "val2");
+$stats = mem_stats($sock);
+is($stats->{curr_items}, $count / 2, "half of the items deleted");
+
+# Missing keys landing on the same buckets
+my $misses = 0;
+for my $i (1 .. 2000) {
+    print $sock "mg nokey$i v\r\n";
+    $misses++ if scalar <$sock> eq "EN\r\n";
+}
+is($misses, 2000, "missing keys not found");
+
+# Walks the hash table rather than the LRUs
+print $sock "lru_crawler metadump hash\r\n";
+my $dumped = 0;
+while (my $line = <$sock>) {
+    last if $line eq "END\r\n";
+    $dumped++ if $line =~ /^key=key\d+ /;
+}
+is($dumped, $count / 2, "hash walk sees every item");
+
+done_testing();
@@ -0,0 +1,104 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use POSIX ();
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-o optimistic_reads,hashpower=13 -t 4");
+my $sock = $server->sock;
+
+my $stats = mem_stats($sock, "settings");
+is($stats->{optimistic_reads}, "yes", "optimistic_reads setting reported");
+
+print $sock "set foo 0 0 3\r\nbar\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored foo");
+mem_get_is($sock, "foo", "bar");
+mem_get_is($sock, "nope", undef);
+
+# Expiring an item needs the lock
+print $sock "set short 0 1 2\r\nhi\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored short");
+sleep 2;
+mem_get_is($sock, "short", undef, "expired item not returned");
+$stats = mem_stats($sock);
+cmp_ok($stats->{get_optimistic_fallbacks}, '>', 0, "fallbacks counted");
+
+print $sock "set num 0 0 2\r\n10\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored num");
+print $sock "incr num 5\r\n";
+is(scalar <$sock>, "15\r\n", "incr in place");
+mem_get_is($sock, "num", "15");
+
+# Readers racing writers on the same keys must only ever see whole values
+# of the key they asked for.
+my $keys = 50;
+my @pids;
+for my $child (1 .. 4) {
+    my $pid = fork();
+    if ($pid == 0) {
+        my $s = $server->new_sock;
+        my $bad = 0;
+        for my $i (1 .. 3000) {
+            my $k = int(rand($keys));
+            if ($child % 2 == 0 && $i % 3 == 0) {
+                if ($i % 7 == 0) {
+                    print $s "delete k$k\r\n";
+                } else {
+                    my $val = "k$k:" . ("x" x int(rand(200)));
+                    print $s "set k$k 0 0 " . length($val) . "\r\n$val\r\n";
+                }
+                my $line = <$s>;
+            } else {
+                print $s "get k$k\r\n";
+                my $line = <$s>;
+                next if $line eq "END\r\n";
+                if ($line !~ /^VALUE k$k 0 (\d+)\r\n$/) {
+                    $bad++;
+                    last;
+                }
+                my $len = $1;
+                my $val = <$s>;
+                $bad++ unless $val =~ /^k$k:x*\r\n$/ && length($val) == $len + 2;
+                $line = <$s>;
+            }
+        }
+        # Skip destructors, they would kill the server
+        POSIX::_exit($bad ? 1 : 0);
+    }
+    push(@pids, $pid);
+}
+
+my $failed = 0;
+for my $pid (@pids) {
+    waitpid($pid, 0);
+    $failed++ if $?;
+}
+is($failed, 0, "concurrent readers saw consistent values");
+
+# The old table is freed once readers are done with it after an expansion
+for my $i (1 .. 20000) {
+    print $sock "set grow$i 0 0 " . length($i) . " noreply\r\n$i\r\n";
+}
+for (1 .. 10) {
+    $stats = mem_stats($sock);
+    last if $stats->{hash_power_level} > 13 && !$stats->{hash_is_expanding};
+    sleep 1;
+}
+cmp_ok($stats->{hash_power_level}, '>', 13, "hash table grew");
+is($stats->{hash_is_expanding}, 0, "hash table expansion done");
+my $found = 0;
+for my $i (1 .. 20000) {
+    print $sock "mg grow$i v\r\n";
+    my $line = <$sock>;
+    if ($line =~ /^VA/) {
+        $found++ if scalar <$sock> eq "$i\r\n";
+    }
+}
+is($found, 20000, "all items found after expansion");
+mem_get_is($sock, "foo", "bar");
+
+done_testing();
@@ -103,6 +103,24 @@ diag "Data that should expire while stopped.";
     like(scalar <$sock>, qr/STORED/, "stored low ttl item");
 }
 
+diag "Items over many pages, relinked by several threads";
+my $spread = 20000;
+{
+    my $good = 1;
+    for my $i (1 .. $spread) {
+        my $val = 'y' x (($i * 37) % 4000 + 1);
+        print $sock "set spread${i} 0 0 " . length($val) . "\r\n$val\r\n";
+        $good = 0 if (scalar <$sock> !~ m/STORED/);
+    }
+    is($good, 1, "spread items were all STORED");
+    # leave some free chunks behind in the pages
+    for my $i (grep { $_ % 5 == 0 } 1 .. $spread) {
+        print $sock "delete spread${i}\r\n";
+        $good = 0 if (scalar <$sock> !~ m/DELETED/);
+    }
+    is($good, 1, "some spread items DELETED");
+}
+
 # make sure it's okay to stop with a logger watcher enabled.
 {
     my $wsock = $server->new_sock;
@@ -111,6 +129,7 @@ diag "Data that should expire while stopped.";
     is($res, "OK\r\n", "watcher enabled");
 }
 
+my $stats_before = mem_stats($sock);
 $server->graceful_stop();
 diag "killed, waiting";
 # TODO: add way to wait for server to fully exit..
@@ -123,6 +142,26 @@ sleep 10;
 
     my $stats = mem_stats($sock);
     is($stats->{hash_power_level}, 17, "restarted hash power level is 17");
+    # low1 may be reclaimed already
+    my $lost = $stats_before->{curr_items} - $stats->{curr_items};
+    ok($lost == 0 || $lost == 1, "all items relinked");
+}
+
+{
+    my $found = 0;
+    my $want = 0;
+    for my $i (1 .. $spread) {
+        next if $i % 5 == 0;
+        $want++;
+        my $len = ($i * 37) % 4000 + 1;
+        print $sock "mg spread${i} v\r\n";
+        my $line = <$sock>;
+        if ($line eq "VA $len\r\n") {
+            $found++ if scalar <$sock> eq ('y' x $len) . "\r\n";
+        }
+    }
+    is($found, $want, "spread items found after restart");
+    mem_get_is($sock, 'spread5', undef);
 }
 
 diag "low TTL item should be gone";
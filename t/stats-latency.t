@@ -0,0 +1,73 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+{
+    my $server = new_memcached();
+    my $sock = $server->sock;
+    print $sock "stats latency\r\n";
+    is(scalar <$sock>, "CLIENT_ERROR stats latency not enabled\r\n",
+        "latency stats off by default");
+}
+
+my $server = new_memcached("-o latency_stats -l 127.0.0.1");
+my $sock = $server->sock;
+my $t = enabled_tls_testing() ? "tls" : "tcp";
+
+my $stats = mem_stats($sock, "settings");
+is($stats->{latency_stats}, "yes", "latency_stats setting reported");
+
+$stats = mem_stats($sock, "latency");
+is(scalar keys %$stats, 0, "nothing timed yet");
+
+for my $i (1 .. 10) {
+    print $sock "set foo$i 0 0 3\r\nbar\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored foo$i");
+}
+for my $i (1 .. 5) {
+    mem_get_is($sock, "foo$i", "bar");
+}
+# Several commands in a single write
+print $sock "get foo1\r\nget foo2\r\nget nope\r\n";
+for my $i (1 .. 2) {
+    is(scalar <$sock>, "VALUE foo$i 0 3\r\n", "pipelined get $i");
+    is(scalar <$sock>, "bar\r\n", "pipelined value $i");
+    is(scalar <$sock>, "END\r\n", "pipelined end $i");
+}
+is(scalar <$sock>, "END\r\n", "pipelined miss");
+print $sock "delete foo1\r\n";
+is(scalar <$sock>, "DELETED\r\n", "deleted foo1");
+print $sock "mg foo2 v\r\n";
+is(scalar <$sock>, "VA 3\r\n", "meta get");
+is(scalar <$sock>, "bar\r\n", "meta get value");
+print $sock "incr foo3 1\r\n";
+is(scalar <$sock>, "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n",
+    "incr not timed");
+
+$stats = mem_stats($sock, "latency");
+is($stats->{"$t:set:count"}, 10, "sets timed");
+is($stats->{"$t:get:count"}, 8, "gets timed");
+is($stats->{"$t:delete:count"}, 1, "delete timed");
+is($stats->{"$t:meta:count"}, 1, "meta command timed");
+for my $stat (qw(mean p50 p90 p99 p999 max)) {
+    ok(exists $stats->{"$t:get:service_$stat"}, "get service_$stat reported");
+    ok(exists $stats->{"$t:get:queue_$stat"}, "get queue_$stat reported");
+}
+cmp_ok($stats->{"$t:set:service_max"}, '>', 0, "sets took some time");
+cmp_ok($stats->{"$t:set:service_p50"}, '<=', $stats->{"$t:set:service_max"},
+    "median below the max");
+cmp_ok($stats->{"$t:get:service_p99"}, '<=', $stats->{"$t:get:service_max"},
+    "p99 below the max");
+is(scalar grep(/incr/, keys %$stats), 0, "nothing else listed");
+
+print $sock "stats reset\r\n";
+is(scalar <$sock>, "RESET\r\n", "stats reset");
+$stats = mem_stats($sock, "latency");
+is(scalar keys %$stats, 0, "reset along with the other stats");
+
+done_testing();
@@ -0,0 +1,56 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+
+# No rdma connection was ever made, so no worker thread has an SRQ yet but
+# the totals must still be reported.
+my $stats = mem_stats($sock, "rdma");
+is($stats->{recv_slab_size} > 0, 1, "receive slab size reported");
+is($stats->{srq_size}, 0, "no SRQ allocated");
+is($stats->{srq_depth}, 0, "nothing posted");
+is($stats->{srq_refills}, 0, "no refills");
+is($stats->{srq_refilled}, 0, "no slabs refilled");
+is($stats->{srq_empty}, 0, "SRQ never ran dry");
+is($stats->{recv_slabs_held}, 0, "no slabs held");
+is($stats->{send_zero_copy_bytes}, 0, "nothing sent from slab memory");
+is($stats->{send_copy_bytes}, 0, "nothing copied");
+is($stats->{mem_regions}, 0, "no slab memory registered");
+is($stats->{devices}, 0, "no device set up");
+is($stats->{reg_send_buf_count}, 0, "no send buffer registered");
+is($stats->{reg_items_count}, 0, "no slab memory registration");
+is($stats->{reg_recv_count}, 0, "no receive slabs registered");
+is($stats->{reg_index_count}, 0, "no index registered");
+is($stats->{send_buf_cache} > 0, 1, "send buffer cache size reported");
+is($stats->{send_buf_hits}, 0, "no cached send buffer handed out");
+is($stats->{send_buf_misses}, 0, "no send buffer registered on the spot");
+is($stats->{send_bufs_cached}, 0, "no send buffers cached");
+is($stats->{recv_credits} > 0, 1, "receive credits reported");
+is($stats->{credit_updates}, 0, "no credit updates sent");
+is($stats->{sends}, 0, "no responses sent");
+is($stats->{sends_signaled}, 0, "no signaled sends");
+is($stats->{send_fragments}, 0, "no fragmented responses");
+is($stats->{send_doorbells}, 0, "no sends posted");
+is($stats->{send_buf_size} > 0, 1, "default send buffer reported");
+is($stats->{send_buf_max} >= $stats->{send_buf_size}, 1, "send buffer limit reported");
+is($stats->{write_sets}, 0, "no values written by clients");
+is($stats->{write_set_bytes}, 0, "no bytes written by clients");
+is($stats->{cq_wakeups}, 0, "never woken up");
+is($stats->{cq_poll_hits}, 0, "nothing polled");
+is($stats->{poll_us}, 0, "no busy polling by default");
+is($stats->{index_size}, 0, "one-sided GETs disabled by default");
+is($stats->{index_entries}, 0, "nothing indexed");
+is($stats->{ud_qps}, 0, "no UD QPs");
+is($stats->{ud_recvs}, 0, "no datagrams received");
+is($stats->{ud_sends}, 0, "no datagrams sent");
+is($stats->{ud_send_drops}, 0, "no datagrams dropped");
+is($stats->{ud_address_handles}, 0, "no address handles");
+is(scalar(grep { /:/ } keys %$stats), 0, "no per-thread stats");
+
+done_testing();
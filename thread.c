@@ -20,6 +20,7 @@
 #include <pthread.h>
 
 #include "queue.h"
+#include "mcrdma.h"
 
 #ifdef __sun
 #include <atomic.h>
@@ -39,6 +40,7 @@ enum conn_queue_item_modes {
     queue_redispatch, /* return conn from side thread */
     queue_stop,       /* exit thread */
     queue_return_io,  /* returning a pending IO object immediately */
+    queue_new_rdma_conn, /* brand new rdma connection. */
 #ifdef PROXY
     queue_proxy_reload, /* signal proxy to reload worker VM */
 #endif
@@ -54,6 +56,7 @@ struct conn_queue_item {
     conn *c;
     void    *ssl;
     io_pending_t *io; // IO when used for deferred IO handling.
+    void    *rdma_id; // cm id of a connection request when using rdma.
     STAILQ_ENTRY(conn_queue_item) i_next;
 };
 
@@ -82,6 +85,10 @@ static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t worker_hang_lock;
 
 static pthread_mutex_t *item_locks;
+/* Bumped when taking and releasing an item lock with -o optimistic_reads, odd
+ * while it is held. Readers skipping the lock validate what they read with
+ * it, seqlock style. */
+static unsigned int *item_lock_seqs;
 /* size of the item lock hash table */
 static uint32_t item_lock_count;
 unsigned int item_lock_hashpower;
@@ -116,24 +123,95 @@ static void thread_libevent_process(evutil_socket_t fd, short which, void *arg);
  * without first locking and removing from the LRU.
  */
 
+static inline void item_lock_seq_begin(uint32_t idx) {
+    if (settings.optimistic_reads) {
+        __atomic_store_n(&item_lock_seqs[idx], item_lock_seqs[idx] + 1, __ATOMIC_RELAXED);
+        /* Also orders the bump before item_hazard_wait() reading the slots */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+static inline void item_lock_seq_end(uint32_t idx) {
+    if (settings.optimistic_reads) {
+        __atomic_store_n(&item_lock_seqs[idx], item_lock_seqs[idx] + 1, __ATOMIC_RELEASE);
+    }
+}
+
 void item_lock(uint32_t hv) {
-    mutex_lock(&item_locks[hv & hashmask(item_lock_hashpower)]);
+    uint32_t idx = hv & hashmask(item_lock_hashpower);
+    mutex_lock(&item_locks[idx]);
+    item_lock_seq_begin(idx);
 }
 
 void *item_trylock(uint32_t hv) {
-    pthread_mutex_t *lock = &item_locks[hv & hashmask(item_lock_hashpower)];
+    uint32_t idx = hv & hashmask(item_lock_hashpower);
+    pthread_mutex_t *lock = &item_locks[idx];
     if (pthread_mutex_trylock(lock) == 0) {
+        item_lock_seq_begin(idx);
         return lock;
     }
     return NULL;
 }
 
 void item_trylock_unlock(void *lock) {
+    item_lock_seq_end((pthread_mutex_t *) lock - item_locks);
     mutex_unlock((pthread_mutex_t *) lock);
 }
 
 void item_unlock(uint32_t hv) {
-    mutex_unlock(&item_locks[hv & hashmask(item_lock_hashpower)]);
+    uint32_t idx = hv & hashmask(item_lock_hashpower);
+    item_lock_seq_end(idx);
+    mutex_unlock(&item_locks[idx]);
+}
+
+/* Sequence of the item lock of a hash value, to read without the lock and
+ * check with item_lock_seq_valid() afterwards. Odd if the lock is held. */
+unsigned int item_lock_seq(uint32_t hv) {
+    return __atomic_load_n(&item_lock_seqs[hv & hashmask(item_lock_hashpower)],
+                           __ATOMIC_ACQUIRE);
+}
+
+/* True if nothing was written under the item lock since the sequence was read */
+bool item_lock_seq_valid(uint32_t hv, unsigned int seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&item_lock_seqs[hv & hashmask(item_lock_hashpower)],
+                           __ATOMIC_RELAXED) == seq;
+}
+
+/* Optimistic GETs publish the item they are taking a reference on in their
+ * thread's hazard slot. Anything about to free an item or assume nobody else
+ * can grab a reference to it waits for it to leave the slots first. The wait
+ * is short: readers never block while an item is in their slot. */
+void item_hazard_wait(item *it) {
+    int i;
+
+    if (!settings.optimistic_reads || threads == NULL)
+        return;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < settings.num_threads; i++) {
+        while (__atomic_load_n(&threads[i].hazard, __ATOMIC_ACQUIRE) == it) {
+            ;
+        }
+    }
+}
+
+/* Waits for the optimistic GETs walking the hash table as of the call to be
+ * done, after which none of them can be looking at a table unpublished before
+ * it. Like above the wait is short, a walk doesn't block. */
+void item_optimistic_sync(void) {
+    int i;
+
+    if (!settings.optimistic_reads || threads == NULL)
+        return;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < settings.num_threads; i++) {
+        unsigned int seq = __atomic_load_n(&threads[i].optimistic_seq, __ATOMIC_ACQUIRE);
+        if ((seq & 1) == 0)
+            continue;
+        while (__atomic_load_n(&threads[i].optimistic_seq, __ATOMIC_ACQUIRE) == seq) {
+            ;
+        }
+    }
 }
 
 static void wait_for_thread_registration(int nthreads) {
@@ -443,6 +521,14 @@ static void setup_thread(LIBEVENT_THREAD *me) {
         exit(EXIT_FAILURE);
     }
 
+    if (settings.latency_stats) {
+        me->latency = calloc(1, sizeof(struct latency_stats));
+        if (me->latency == NULL) {
+            perror("Failed to allocate latency stats");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     me->rbuf_cache = cache_create("rbuf", READ_BUFFER_SIZE, sizeof(char *));
     if (me->rbuf_cache == NULL) {
         fprintf(stderr, "Failed to create read buffer cache\n");
@@ -596,6 +682,17 @@ static void thread_libevent_process(evutil_socket_t fd, short which, void *arg)
 #endif
                 }
                 break;
+            case queue_new_rdma_conn:
+                c = mcrdma_conn_new(item->rdma_id, item->init_state,
+                                    item->read_buffer_size, me);
+                if (c == NULL) {
+                    if (settings.verbose > 0) {
+                        fprintf(stderr, "Can't accept rdma connection\n");
+                    }
+                } else {
+                    conn_io_queue_setup(c);
+                }
+                break;
             case queue_pause:
                 /* we were told to pause and report in */
                 register_thread_initialized();
@@ -742,6 +839,37 @@ void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags,
     notify_worker(thread, item);
 }
 
+/*
+ * Dispatches a new rdma connection request to a worker thread. The worker
+ * takes ownership of the cm id and accepts the connection from its own
+ * event loop.
+ */
+void dispatch_rdma_conn_new(void *id, enum conn_states init_state,
+                            int read_buffer_size) {
+    CQ_ITEM *item = NULL;
+    LIBEVENT_THREAD *thread = select_thread_round_robin();
+
+    item = cqi_new(thread->ev_queue);
+    if (item == NULL) {
+        free(((struct rdma_cm_id *)id)->context);
+        rdma_reject(id, NULL, 0);
+        rdma_destroy_id(id);
+        fprintf(stderr, "Failed to allocate memory for connection object\n");
+        return;
+    }
+
+    item->sfd = -1;
+    item->init_state = init_state;
+    item->event_flags = 0;
+    item->read_buffer_size = read_buffer_size;
+    item->transport = rdma_transport;
+    item->mode = queue_new_rdma_conn;
+    item->ssl = NULL;
+    item->rdma_id = id;
+
+    notify_worker(thread, item);
+}
+
 /*
  * Re-dispatches a connection back to the original thread. Can be called from
  * any side thread borrowing a connection.
@@ -802,10 +930,77 @@ item *item_alloc(char *key, size_t nkey, int flags, rel_time_t exptime, int nbyt
  * Returns an item if it hasn't been marked as expired,
  * lazy-expiring as needed.
  */
+/* Takes a reference on an item without ever touching the item lock, for
+ * -o optimistic_reads. Returns false if the lookup has to be done under the
+ * lock instead: a writer got in the way, or the item has to be expired or
+ * bumped in the LRU, which needs the lock. */
+static bool item_get_optimistic(const char *key, const size_t nkey, const uint32_t hv,
+                                conn *c, const bool do_update, item **ret) {
+    unsigned int seq = item_lock_seq(hv);
+    unsigned int *thread_seq;
+    bool valid, ref;
+    item *it;
+
+    if ((seq & 1) || settings.verbose > 2)
+        return false;
+
+    thread_seq = &c->thread->optimistic_seq;
+    __atomic_store_n(thread_seq, *thread_seq + 1, __ATOMIC_RELAXED);
+    /* Seen by item_optimistic_sync() before we look at the table */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    it = assoc_find_optimistic(key, nkey, hv, seq, &valid);
+    __atomic_store_n(thread_seq, *thread_seq + 1, __ATOMIC_RELEASE);
+    if (!valid)
+        return false;
+    if (it == NULL) {
+        LOGGER_LOG(c->thread->l, LOG_FETCHERS, LOGGER_ITEM_GET, NULL, 0, key,
+                   nkey, 0, 0, c->sfd);
+        *ret = NULL;
+        return true;
+    }
+
+    /* The item was linked as of seq. Once in the hazard slot it can't be
+     * freed, and if seq still holds no writer has unlinked it in between:
+     * a linked item always has a reference from the hash table, so the
+     * refcount is only 0 if it got unlinked and released since. */
+    __atomic_store_n(&c->thread->hazard, it, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    ref = false;
+    if (item_lock_seq_valid(hv, seq)) {
+        unsigned short refcount = __atomic_load_n(&it->refcount, __ATOMIC_RELAXED);
+        while (refcount != 0 && !ref) {
+            ref = __atomic_compare_exchange_n(&it->refcount, &refcount, refcount + 1,
+                    true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&c->thread->hazard, NULL, __ATOMIC_RELEASE);
+    if (!ref)
+        return false;
+
+    /* Hot items are already active and need no bump */
+    if (item_is_flushed(it) || (it->exptime != 0 && it->exptime <= current_time) ||
+        (do_update && (!settings.lru_segmented || (it->it_flags & ITEM_ACTIVE) == 0))) {
+        item_remove(it);
+        return false;
+    }
+
+    LOGGER_LOG(c->thread->l, LOG_FETCHERS, LOGGER_ITEM_GET, NULL, 1, key,
+               nkey, it->nbytes, ITEM_clsid(it), c->sfd);
+    *ret = it;
+    return true;
+}
+
 item *item_get(const char *key, const size_t nkey, conn *c, const bool do_update) {
     item *it;
     uint32_t hv;
     hv = hash(key, nkey);
+    if (settings.optimistic_reads) {
+        if (item_get_optimistic(key, nkey, hv, c, do_update, &it))
+            return it;
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.get_optimistic_fallbacks++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+    }
     item_lock(hv);
     it = do_item_get(key, nkey, hv, c, do_update);
     item_unlock(hv);
@@ -939,6 +1134,9 @@ void threadlocal_stats_reset(void) {
                 sizeof(threads[ii].stats.slab_stats));
         memset(&threads[ii].stats.lru_hits, 0,
                 sizeof(uint64_t) * POWER_LARGEST);
+        if (threads[ii].latency) {
+            memset(threads[ii].latency, 0, sizeof(struct latency_stats));
+        }
 
         pthread_mutex_unlock(&threads[ii].stats.mutex);
     }
@@ -984,6 +1182,20 @@ void threadlocal_stats_aggregate(struct thread_stats *stats) {
     }
 }
 
+/* Histograms are large, stats is expected to be zeroed by the caller rather
+ * than to live on the stack. */
+void threadlocal_latency_aggregate(struct latency_stats *stats) {
+    int ii;
+
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        if (threads[ii].latency == NULL)
+            continue;
+        pthread_mutex_lock(&threads[ii].stats.mutex);
+        latency_stats_merge(stats, threads[ii].latency);
+        pthread_mutex_unlock(&threads[ii].stats.mutex);
+    }
+}
+
 void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out) {
     int sid;
 
@@ -1047,6 +1259,11 @@ void memcached_thread_init(int nthreads, void *arg) {
     for (i = 0; i < item_lock_count; i++) {
         pthread_mutex_init(&item_locks[i], NULL);
     }
+    item_lock_seqs = calloc(item_lock_count, sizeof(unsigned int));
+    if (! item_lock_seqs) {
+        perror("Can't allocate item lock sequences");
+        exit(1);
+    }
 
     threads = calloc(nthreads, sizeof(LIBEVENT_THREAD));
     if (! threads) {
@@ -1090,59 +1307,3 @@ void memcached_thread_init(int nthreads, void *arg) {
     pthread_mutex_unlock(&init_lock);
 }
 
-/* MCRDMA thread stuff */
-
-/*
- * In order to make the rdma subsystem compatible with other parts of memcached,
- * an initialized LIBEVENT_THREAD must be present in the conn structure.
- * This function initializes the part of a LIBEVENT_THREAD structure for that purpuse.
- * This is a modified version of setup_thread()
- */
-void mcrdma_libevent_thread_init(LIBEVENT_THREAD* thread) {
-    // Skipping notify event init
-    // Skipping storage init
-
-    // We don't need a libevent base
-
-    thread->ev_queue = malloc(sizeof(struct conn_queue));
-    if (thread->ev_queue == NULL) {
-        perror("Failed to allocate memory for connection queue");
-        exit(EXIT_FAILURE);
-    }
-    cq_init(thread->ev_queue);
-
-    if (pthread_mutex_init(&thread->stats.mutex, NULL) != 0) {
-        perror("Failed to initialize mutex");
-        exit(EXIT_FAILURE);
-    }
-
-    thread->rbuf_cache = cache_create("rbuf", READ_BUFFER_SIZE, sizeof(char *));
-    if (thread->rbuf_cache == NULL) {
-        fprintf(stderr, "Failed to create read buffer cache\n");
-        exit(EXIT_FAILURE);
-    }
-    // Note: we were cleanly passing in num_threads before, but this now
-    // relies on settings globals too much.
-    if (settings.read_buf_mem_limit) {
-        int limit = settings.read_buf_mem_limit / settings.num_threads;
-        if (limit < READ_BUFFER_SIZE) {
-            limit = 1;
-        } else {
-            limit = limit / READ_BUFFER_SIZE;
-        }
-        cache_set_limit(thread->rbuf_cache, limit);
-    }
-
-    thread->io_cache = cache_create("io", sizeof(io_pending_t), sizeof(char*));
-    if (thread->io_cache == NULL) {
-        fprintf(stderr, "Failed to create IO object cache\n");
-        exit(EXIT_FAILURE);
-    }
-    // We don't support the following modules
-    // Skipping TLS 
-    // Skipping EXTSTORE
-    // Skipping PROXY
-
-    // Not sure if the next line is necessary since we don't really use the io queue
-    thread_io_queue_add(thread, IO_QUEUE_NONE, NULL, NULL, NULL, NULL, NULL);
-}